@@ -0,0 +1,536 @@
+/**
+    project: cogdevcam
+    source file: bench_cogdevcam
+    description: microbenchmarks of the timing, audio, display and video
+    writing hot paths, no cameras or sound hardware needed
+
+    @author Joseph M. Burling
+    @version 0.9.2 12/19/2017
+*/
+
+#include "audio.h"
+#include "imagegui.h"
+#include "video.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+/// keep the compiler from dropping a result that is never used
+template<typename T>
+void
+keep(const T &value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "r,m"(value) : "memory");
+#else
+    static volatile const void *sink;
+    sink = &value;
+#endif
+};
+
+std::string
+jsonEscape(const std::string &text)
+{
+    std::string escaped;
+    for (auto c : text)
+    {
+        switch (c)
+        {
+            case '"': escaped += "\\\""; break;
+            case '\\': escaped += "\\\\"; break;
+            case '\n': escaped += "\\n"; break;
+            case '\t': escaped += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) >= 0x20) escaped += c;
+        }
+    }
+    return escaped;
+};
+
+struct Result
+{
+    std::string         name;
+    std::string         unit       = "op";
+    double              items      = 1;
+    uint64_t            iterations = 0;
+    std::vector<double> batch_ns;
+    std::string         skipped = "";
+
+    double
+    quantile(double q) const
+    {
+        if (batch_ns.empty()) return 0;
+        auto sorted = batch_ns;
+        std::sort(sorted.begin(), sorted.end());
+        auto pos = q * static_cast<double>(sorted.size() - 1);
+        auto low = static_cast<size_t>(std::floor(pos));
+        auto up  = std::min(low + 1, sorted.size() - 1);
+        return sorted[low] + (pos - low) * (sorted[up] - sorted[low]);
+    };
+
+    double
+    mean() const
+    {
+        if (batch_ns.empty()) return 0;
+        return std::accumulate(batch_ns.begin(), batch_ns.end(), 0.0) /
+               batch_ns.size();
+    };
+
+    double
+    stddev() const
+    {
+        if (batch_ns.size() < 2) return 0;
+        auto   mu  = mean();
+        double ssq = 0;
+        for (auto ns : batch_ns) ssq += (ns - mu) * (ns - mu);
+        return std::sqrt(ssq / (batch_ns.size() - 1));
+    };
+
+    /// items per second at the median time
+    double
+    rate() const
+    {
+        auto median = quantile(0.5);
+        return median > 0 ? items * 1e9 / median : 0;
+    };
+};
+
+/**
+ * Times each benchmark in batches. The batch size is doubled until one batch
+ * takes a tenth of the minimum time, then n_batches batches are timed and
+ * each gives one nanoseconds-per-call sample.
+ */
+class Runner
+{
+  public:
+    Runner(double _min_sec, std::string _filter)
+      : min_sec(_min_sec), filter(std::move(_filter)){};
+
+    bool
+    selected(const std::string &name) const
+    {
+        return filter.empty() || name.find(filter) != std::string::npos;
+    };
+
+    /**
+     * @param name group/benchmark, used with --filter
+     * @param op one call of the code being measured
+     * @param items units of work per call, e.g., frames, for the rate
+     * @param unit name of one item
+     */
+    template<typename F>
+    void
+    run(const std::string &name,
+        F &&               op,
+        double             items = 1,
+        const std::string &unit  = "op")
+    {
+        if (!selected(name)) return;
+        Result result;
+        result.name  = name;
+        result.items = items;
+        result.unit  = unit;
+        try
+        {
+            auto     batch_sec = min_sec / n_batches;
+            uint64_t n_calls   = 1;
+            while (timeBatch(op, n_calls) < batch_sec * 1e9 &&
+                   n_calls < max_calls)
+            {
+                n_calls *= 2;
+            }
+            for (int b = 0; b < n_batches; ++b)
+            {
+                result.batch_ns.push_back(timeBatch(op, n_calls) / n_calls);
+            }
+            result.iterations = n_calls * n_batches;
+        } catch (const std::exception &error)
+        {
+            result.batch_ns.clear();
+            result.skipped = error.what();
+        }
+        print(result);
+        results.push_back(std::move(result));
+    };
+
+    void
+    skip(const std::string &name, const std::string &reason)
+    {
+        if (!selected(name)) return;
+        Result result;
+        result.name    = name;
+        result.skipped = reason;
+        print(result);
+        results.push_back(std::move(result));
+    };
+
+    void
+    writeJson(const std::string &filename) const
+    {
+        std::ofstream file(filename, std::ios::trunc);
+        if (!file.is_open())
+        {
+            throw err::Runtime("Could not open benchmark file " + filename);
+        }
+        file << std::setprecision(6) << "{\n  \"date\": \""
+             << misc::filePrefix() << "\",\n  \"compiler\": \""
+             << jsonEscape(compiler()) << "\",\n  \"optimized\": "
+#ifdef NDEBUG
+             << "true"
+#else
+             << "false"
+#endif
+             << ",\n  \"min_sec\": " << min_sec << ",\n  \"results\": [";
+        for (size_t r = 0; r < results.size(); ++r)
+        {
+            const auto &result = results[r];
+            file << (r == 0 ? "\n" : ",\n") << "    {\"name\": \""
+                 << jsonEscape(result.name) << "\"";
+            if (!result.skipped.empty())
+            {
+                file << ", \"skipped\": \"" << jsonEscape(result.skipped)
+                     << "\"}";
+                continue;
+            }
+            file << ", \"iterations\": " << result.iterations
+                 << ", \"ns_min\": " << result.quantile(0)
+                 << ", \"ns_median\": " << result.quantile(0.5)
+                 << ", \"ns_mean\": " << result.mean()
+                 << ", \"ns_stddev\": " << result.stddev()
+                 << ", \"ns_max\": " << result.quantile(1)
+                 << ", \"items_per_op\": " << result.items
+                 << ", \"items_per_sec\": " << result.rate()
+                 << ", \"item\": \"" << jsonEscape(result.unit) << "\"}";
+        }
+        file << "\n  ]\n}\n";
+        std::cout << "\nResults written to " << filename << "\n";
+    };
+
+  private:
+    double              min_sec   = 0.5;
+    std::string         filter    = "";
+    int                 n_batches = 10;
+    uint64_t            max_calls = uint64_t(1) << 30;
+    std::vector<Result> results;
+
+    template<typename F>
+    static double
+    timeBatch(F &op, uint64_t n_calls)
+    {
+        auto start = timing::getPresent();
+        for (uint64_t i = 0; i < n_calls; ++i) op();
+        return std::chrono::duration<double, std::nano>(
+                 timing::getPresent() - start)
+          .count();
+    };
+
+    static void
+    print(const Result &result)
+    {
+        std::cout << std::left << std::setw(36) << result.name << std::right;
+        if (!result.skipped.empty())
+        {
+            std::cout << "skipped: " << result.skipped << "\n";
+            return;
+        }
+        std::cout << std::fixed << std::setprecision(1) << std::setw(14)
+                  << result.quantile(0.5) << " ns/op  +/- " << std::setw(8)
+                  << result.stddev() << std::setw(14) << std::setprecision(0)
+                  << result.rate() << " " << result.unit << "/s\n";
+    };
+
+    static std::string
+    compiler()
+    {
+#if defined(__clang__)
+        return std::string("clang ") + __clang_version__;
+#elif defined(__GNUC__)
+        return std::string("gcc ") + __VERSION__;
+#elif defined(_MSC_VER)
+        return "msvc " + std::to_string(_MSC_VER);
+#else
+        return "unknown";
+#endif
+    };
+};
+
+/// noise compresses about as badly as a real scene, seeded to repeat
+cv::Mat
+noiseImage(int width, int height)
+{
+    cv::Mat img(height, width, CV_8UC3);
+    cv::RNG rng(12345);
+    rng.fill(img, cv::RNG::UNIFORM, 0, 256);
+    return img;
+};
+
+void
+timingClock(Runner &runner)
+{
+    timing::MilliClock clock;
+    runner.run("timing/clock_elapsed", [&]() { keep(clock.elapsed()); });
+
+    // the timer is checked far more often than it fires
+    clock.setTimeout(1000.0, 0.95);
+    runner.run("timing/clock_timeout", [&]() { keep(clock.timeout()); });
+
+    // every check is late, so each one rolls time over into the next period
+    auto now = timing::getPresent();
+    clock.setTimeout(1.0, 0.95);
+    runner.run("timing/clock_timeout_due", [&]() {
+        now += std::chrono::microseconds(1500);
+        keep(clock.timeout(now));
+    });
+};
+
+template<RtAudioFormat F>
+void
+audioPulseFormat(Runner &runner, const std::string &name)
+{
+    const unsigned sample_rate = 48000;
+    const unsigned n_frames    = 512;
+    const unsigned n_channels  = 2;
+    const double   pulse_rate  = 10;
+
+    audio::data::CallbackData data(
+      timing::getPresent(),
+      sample_rate,
+      static_cast<audio::data::AudioTimeType>(
+        audio::data::timeRescaleVal() / pulse_rate),
+      0.95);
+    data.format_sizeof    = audio::rt::format2sizeof(F);
+    data.buffer_len_now   = n_frames;
+    data.play.in_use      = true;
+    data.play.mode        = audio::data::PlayMode::PULSE;
+    data.play.n_channels  = n_channels;
+    data.play.pulse_width = 10;
+    data.play.byte_size   = data.format_sizeof * n_channels;
+    std::vector<char> out(n_frames * data.play.byte_size);
+    runner.run("audio/play_pulse_" + name,
+               [&]() {
+                   audio::rt::playPulseBuffer<F>(&data, out.data());
+                   keep(out.front());
+               },
+               n_frames,
+               "frames");
+};
+
+void
+audioPulse(Runner &runner)
+{
+    audioPulseFormat<RTAUDIO_SINT8>(runner, "sint8");
+    audioPulseFormat<RTAUDIO_SINT16>(runner, "sint16");
+    audioPulseFormat<RTAUDIO_SINT24>(runner, "sint24");
+    audioPulseFormat<RTAUDIO_SINT32>(runner, "sint32");
+    audioPulseFormat<RTAUDIO_FLOAT32>(runner, "float32");
+    audioPulseFormat<RTAUDIO_FLOAT64>(runner, "float64");
+};
+
+void
+audioTimestamps(Runner &runner, const std::string &folder)
+{
+    // one row per pulse plus one per callback, about a second of 10 Hz pulses
+    const size_t                      n_rows = 100;
+    std::vector<audio::data::TimeRow> rows;
+    for (size_t r = 0; r < n_rows; ++r)
+    {
+        auto ms = 10.6666 * r;
+        rows.emplace_back(r, 512, ms, ms + 0.01, ms + 0.02, r % 2);
+    }
+    audio::data::AudioTimeFile file;
+    file.init(folder + "/audio_timestamps.csv");
+    auto stream = file.streamPtr();
+    runner.run("audio/timestamps_write",
+               [&]() {
+                   stream->seekp(0);
+                   audio::data::CallbackTimestamps::writeData(
+                     stream, rows.data(), rows.size());
+               },
+               n_rows,
+               "rows");
+    stream->close();
+};
+
+void
+displayCompose(Runner &runner)
+{
+    // showImages() also hands the canvas to the window system, which needs a
+    // display, so only the drawing part is timed
+    for (int side = 1; side <= 4; ++side)
+    {
+        auto                 n_images = side * side;
+        std::vector<cv::Mat> images(n_images, noiseImage(640, 480));
+        imagegui::WinShow    window;
+        window.videoDisplaySetup(images, side, side);
+        auto grid = std::to_string(side) + "x" + std::to_string(side);
+        runner.run("display/compose_" + grid,
+                   [&]() { keep(window.composeImages(images).data); },
+                   n_images,
+                   "tiles");
+
+        // a new frame for half of the tiles
+        std::vector<uint64_t> frame_ids(n_images, 0);
+        runner.run("display/compose_" + grid + "_half_new",
+                   [&]() {
+                       for (size_t i = 0; i < frame_ids.size(); i += 2)
+                       {
+                           ++frame_ids[i];
+                       }
+                       keep(window.composeImages(images, frame_ids).data);
+                   },
+                   n_images,
+                   "tiles");
+    }
+};
+
+void
+videoWrite(Runner &runner, const std::string &folder)
+{
+    const int    width  = 640;
+    const int    height = 480;
+    const double fps    = 30;
+    auto         img    = noiseImage(width, height);
+
+    for (std::string fourcc : {"MJPG", "XVID", "MP4V", "H264"})
+    {
+        auto name = "video/write_" + fourcc;
+        if (!runner.selected(name)) continue;
+        try
+        {
+            video::VideoFile file_info;
+            file_info.folder = folder;
+            file_info.stem   = "video";
+            file_info.type   = fourcc;
+            file_info.index  = 0;
+            file_info.ext    = ".avi";
+            video::Writer writer(file_info);
+            writer.setWriterProperties(
+              video::Properties(fourcc, fps, width, height));
+            writer.openWriter();
+            runner.run(name, [&]() { writer.writeImage(img); }, 1, "frames");
+            writer.closeWriter();
+        } catch (const std::exception &error)
+        {
+            runner.skip(name, error.what());
+        }
+    }
+
+    // raw MJPG capture, JPEG bytes are only muxed
+    std::string name = "video/write_MJPG_passthrough";
+    if (!runner.selected(name)) return;
+    std::vector<uchar> jpeg;
+    cv::imencode(".jpg", img, jpeg);
+    cv::Mat encoded(1, static_cast<int>(jpeg.size()), CV_8UC1, jpeg.data());
+    try
+    {
+        video::VideoFile file_info;
+        file_info.folder = folder;
+        file_info.stem   = "video";
+        file_info.type   = "passthrough";
+        file_info.index  = 0;
+        video::Writer writer(file_info);
+        writer.setEncodedInput(true);
+        writer.setWriterProperties(
+          video::Properties("MJPG", fps, width, height));
+        writer.openWriter();
+        runner.run(name, [&]() { writer.writeImage(encoded); }, 1, "frames");
+        writer.closeWriter();
+    } catch (const std::exception &error)
+    {
+        runner.skip(name, error.what());
+    }
+};
+
+/**
+ * A new subfolder of parent for the files of this run, so removing it
+ * afterwards never touches anything that was there before
+ * @param parent --dir value, created if missing
+ * @return path of the subfolder
+ */
+std::string
+makeRunFolder(const std::string &parent)
+{
+    boost::filesystem::create_directories(parent);
+    for (;;)
+    {
+        auto run_folder = boost::filesystem::path(parent) /
+                          boost::filesystem::unique_path("run_%%%%-%%%%-%%%%");
+        // false when the name is already taken
+        if (boost::filesystem::create_directory(run_folder))
+        {
+            return run_folder.string();
+        }
+    }
+};
+};  // namespace bench
+
+/*!
+ * Microbenchmarks, results are printed and written as JSON.
+ *   bench_cogdevcam --json bench.json --filter audio/ --sec 1
+ * Files are written to a new subfolder of --dir that is removed at the end.
+ * @param argc
+ * @param argv
+ * @return
+ */
+int
+main(int argc, const char *const *argv)
+{
+    std::string json_file = "bench_cogdevcam.json";
+    std::string filter    = "";
+    std::string folder    = "bench_cogdevcam_files";
+    double      min_sec   = 0.5;
+    for (int a = 1; a < argc; ++a)
+    {
+        std::string arg   = argv[a];
+        bool        value = a + 1 < argc;
+        if (arg == "--json" && value)
+        {
+            json_file = argv[++a];
+        } else if (arg == "--filter" && value)
+        {
+            filter = argv[++a];
+        } else if (arg == "--sec" && value)
+        {
+            min_sec = std::stod(argv[++a]);
+        } else if (arg == "--dir" && value)
+        {
+            folder = argv[++a];
+        } else
+        {
+            std::cerr << "Usage: bench_cogdevcam [--json FILE] [--filter TEXT]"
+                         " [--sec SECONDS] [--dir FOLDER]\n";
+            return 1;
+        }
+    }
+
+    try
+    {
+        bool made_parent = !misc::fileExists(folder);
+        auto run_folder  = bench::makeRunFolder(folder);
+        bench::Runner runner(min_sec, filter);
+        bench::timingClock(runner);
+        bench::audioPulse(runner);
+        bench::audioTimestamps(runner, run_folder);
+        bench::displayCompose(runner);
+        bench::videoWrite(runner, run_folder);
+        misc::removeDirectory(run_folder);
+        if (made_parent)
+        {
+            // only removed when empty
+            boost::system::error_code ignored;
+            boost::filesystem::remove(folder, ignored);
+        }
+        runner.writeJson(json_file);
+    } catch (const std::exception &err)
+    {
+        std::cerr << err.what() << std::endl;
+        return 1;
+    }
+}
@@ -10,10 +10,18 @@
 #ifndef __COGDEVCAM_AUDIO_H
 #define __COGDEVCAM_AUDIO_H
 
+#include "backends.h"
+#include "buffers.h"
+#include "formats.h"
+#include "metrics.h"
+#include "mixer.h"
 #include "options.h"
 #include "tools.h"
+#include "trace.h"
 #include <RtAudio.h>
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
 #include <fstream>
 #include <functional>
 #include <iostream>
@@ -309,6 +317,8 @@ class AudioTimeFile
 
 struct TimeRow
 {
+    TimeRow() = default;
+
     explicit TimeRow(uint64_t      _buff,
                      unsigned      _size,
                      AudioTimeType _audio,
@@ -321,12 +331,12 @@ struct TimeRow
         stream_time(std::move(_stream)),
         master_time(std::move(_master)),
         status(std::move(_err)){};
-    uint64_t      buffer;
-    unsigned      size;
-    AudioTimeType audio_time;
-    AudioTimeType stream_time;
-    AudioTimeType master_time;
-    int           status;
+    uint64_t      buffer      = 0;
+    unsigned      size        = 0;
+    AudioTimeType audio_time  = 0;
+    AudioTimeType stream_time = 0;
+    AudioTimeType master_time = 0;
+    int           status      = 0;
 };
 
 double
@@ -347,9 +357,9 @@ class CallbackTimestamps
     AudioClock            stream_clock;
     AudioTimeType         stream_ts     = 0;
     AudioTimeType         master_ts     = 0;
-    size_t                flush_buffer  = 1;
     uint64_t              buffer_sample = 1;
-    futures::SharedFuture future;
+    // filled by the callback, emptied by the disk writer thread
+    buffers::SpscRing<TimeRow> rows;
 
     explicit CallbackTimestamps(const timing::TimePoint &tp,
                                 unsigned                 sample_rate,
@@ -357,7 +367,6 @@ class CallbackTimestamps
                                 double                   time_threshold)
       : master_clock(tp),
         stream_clock(tp),
-        future(futures::makeVoidFutureValid<futures::SharedFuture>()),
         timeout_reached(static_cast<double>(timeout_interval)),
         timeout_thresh(static_cast<double>(timeout_interval * time_threshold))
     {
@@ -406,6 +415,28 @@ class CallbackTimestamps
         return timeoutDecrement(size);
     }
 
+    /**
+     * Step frame by frame until the pulse timer runs out on a frame or
+     * n_frames have passed. Stepping one frame at a time keeps every edge on
+     * the frame the per-frame countdown puts it on.
+     * @param timed_out set if the last frame passed is where the timer ran out
+     * @return frames passed
+     */
+    uint64_t
+    framesUpdate(uint64_t n_frames, bool &timed_out)
+    {
+        for (uint64_t frame = 1; frame <= n_frames; ++frame)
+        {
+            if (frameUpdate())
+            {
+                timed_out = true;
+                return frame;
+            }
+        }
+        timed_out = false;
+        return n_frames;
+    };
+
     void
     streamTimeIncrement(unsigned size = 1)
     {
@@ -439,62 +470,46 @@ class CallbackTimestamps
         stream_ts = stream_clock.elapsed();
     };
 
-    // add/write data
-    void
+    /// queue a row for the timestamp file, false if the writer fell behind
+    bool
     addTimestamp(int err = 0)
     {
-        setElapsed();
-        rows_fill.emplace_back(TimeRow(
-          buffer_sample, last_buff_size, audio_ts, stream_ts, master_ts, err));
+        return addTimestamp(err, last_buff_size);
     };
 
+    /// same, with n_frames in the size column instead of the buffer size
     bool
-    swapRowsBuffer(bool force)
+    addTimestamp(int err, unsigned n_frames)
     {
-        auto n_rows = rows_fill.size();
-        if (force || (n_rows >= 0 && n_rows >= flush_buffer))
-        {
-            // wait for row data to be done writing before clearing
-            future.wait();
-            rows_write.clear();
-            rows_write.swap(rows_fill);
-            return true;
-        } else
-        {
-            return false;
-        }
+        setElapsed();
+        return rows.push(TimeRow(buffer_sample,
+                                 n_frames,
+                                 audio_ts,
+                                 stream_ts,
+                                 master_ts,
+                                 err));
     };
 
-    void
-    clearBuffers()
-    {
-        future.wait();
-        rows_write.clear();
-        rows_fill.clear();
-        rows_write.shrink_to_fit();
-        rows_fill.shrink_to_fit();
-    }
-
     void
     setFilePtr()
     {
-        // wait for ofstream to be done before using stream again
-        future.wait();
         file_ptr = file.streamPtr();
     };
 
     std::shared_ptr<std::ofstream>
     getFilePtr()
     {
-        future.wait();
         return file_ptr;
     };
 
     static void
-    writeData(std::shared_ptr<std::ofstream> _file, std::vector<TimeRow> &_rows)
+    writeData(std::shared_ptr<std::ofstream> _file,
+              const TimeRow *                _rows,
+              size_t                         n_rows)
     {
-        for (auto &row : _rows)
+        for (size_t r = 0; r < n_rows; ++r)
         {
+            const auto &row = _rows[r];
             *_file << row.buffer << "," << row.size << "," << row.audio_time
                    << "," << row.stream_time << "," << row.master_time << ","
                    << row.status << "\n";
@@ -502,20 +517,21 @@ class CallbackTimestamps
         *_file << std::flush;
     };
 
+    /// write out queued rows, call from the disk writer thread only
     void
-    writeCallbackTimes(bool force = false)
+    writeCallbackTimes()
     {
-        if (!swapRowsBuffer(force)) return;
-        future = std::async(
-          std::launch::async, [this]() { writeData(file_ptr, rows_write); });
+        if (!file_ptr) return;
+        rows.consume([this](const TimeRow *_rows, size_t n_rows) {
+            writeData(file_ptr, _rows, n_rows);
+        });
     };
 
     // misc public
     void
     close()
     {
-        writeCallbackTimes(true);
-        future.wait();
+        writeCallbackTimes();
         file.close();
     };
 
@@ -541,8 +557,6 @@ class CallbackTimestamps
 
   private:
     std::shared_ptr<std::ofstream> file_ptr;
-    std::vector<TimeRow>           rows_fill;
-    std::vector<TimeRow>           rows_write;
     AudioTimeType                  start_time      = 0;
     double                         timeout_reached = 0;
     double                         timeout_thresh  = 0;
@@ -563,8 +577,11 @@ struct CallbackOutputData
     int      pulse_count    = 0;
     unsigned n_channels     = 0;
     size_t   byte_size      = 0;
-    double   bit_mode_multi = 1;
     double   pulse_amp      = 0.93;
+    // input to output channels for PlayMode::PLAYBACK
+    audio::mix::Matrix matrix;
+    // sample bytes on their way to pcm, see DiskWriter
+    buffers::SpscRing<char> ring;
 };
 
 struct CallbackInputData
@@ -573,6 +590,8 @@ struct CallbackInputData
     wav::Wav pcm;
     unsigned n_channels = 0;
     size_t   byte_size  = 0;
+    // sample bytes on their way to pcm, see DiskWriter
+    buffers::SpscRing<char> ring;
 };
 
 struct CallbackData
@@ -597,6 +616,155 @@ struct CallbackData
     bool               verbose            = false;
     bool               aborted            = false;
     bool               write              = false;
+    threads::Placement placement;
+    // set once by the callback, logged by the disk writer
+    bool                     placed = false;
+    threads::PlacementStatus placement_status;
+    std::atomic_bool         placement_done{false};
+    // sample buffers the callback could not queue for the disk writer
+    std::atomic<uint64_t> dropped_buffers{0};
+    // set by Streams, callback times are in microseconds
+    metrics::Histogram *callback_us   = nullptr;
+    metrics::Histogram *buffer_frames = nullptr;
+    metrics::Counter *  input_xruns   = nullptr;
+    metrics::Counter *  output_xruns  = nullptr;
+    metrics::Counter *  dropped_bufs  = nullptr;
+    metrics::Counter *  dropped_rows  = nullptr;
+};
+
+/**
+ * Moves what the callback queued in the rings to the WAV and timestamp files.
+ * One thread per stream for as long as the stream is open, so the callback
+ * never writes to disk, allocates, or waits for the writes to finish.
+ */
+class DiskWriter
+{
+  public:
+    explicit DiskWriter(CallbackData &_data) : data(_data){};
+
+    DiskWriter(const DiskWriter &) = delete;
+    DiskWriter &operator=(const DiskWriter &) = delete;
+
+    void
+    start()
+    {
+        if (worker) return;
+        reported_input  = xrunCount(data.input_xruns);
+        reported_output = xrunCount(data.output_xruns);
+        worker.reset(new threads::Worker([this]() {
+            TRACE_THREAD("audio writer");
+            timing::sleep::thread(period);
+            drain();
+            logPlacement();
+        }));
+        worker->start();
+    };
+
+    /// join the thread and write whatever the callback left in the rings
+    void
+    stop()
+    {
+        if (!worker) return;
+        worker->stop();
+        worker.reset();
+        drain();
+    };
+
+    /**
+     * Allocate the rings, only while the stream and writer are stopped
+     * @param n_frames sample frames each ring holds before dropping buffers
+     * @param n_rows timestamp rows the ring holds
+     */
+    void
+    reserve(size_t n_frames, size_t n_rows)
+    {
+        data.rec.ring.reserve(data.rec.pcm.isReady() ?
+                                n_frames * data.rec.byte_size :
+                                0);
+        data.play.ring.reserve(data.play.pcm.isReady() ?
+                                 n_frames * data.play.byte_size :
+                                 0);
+        data.ts.rows.reserve(n_rows);
+    };
+
+    /// sample buffers lost because the rings were full
+    uint64_t
+    getDroppedBuffers() const
+    {
+        return data.dropped_buffers.load(std::memory_order_relaxed);
+    };
+
+    /// timestamp rows lost because the ring was full
+    uint64_t
+    getDroppedRows() const
+    {
+        return data.ts.rows.getDropped();
+    };
+
+  private:
+    CallbackData &                   data;
+    std::unique_ptr<threads::Worker> worker;
+    std::chrono::milliseconds        period{10};
+    uint64_t                         reported_input  = 0;
+    uint64_t                         reported_output = 0;
+
+    /// the callback cannot log, report how it was placed once it has been
+    void
+    logPlacement()
+    {
+        if (!data.placement_done.exchange(false, std::memory_order_acquire))
+        {
+            return;
+        }
+        threads::logPlacement(
+          data.placement, data.placement_status, "audio callback");
+    };
+
+    void
+    drain()
+    {
+        TRACE_SCOPE("audio", "disk write");
+        writeSamples(data.rec.ring, data.rec.pcm);
+        writeSamples(data.play.ring, data.play.pcm);
+        data.ts.writeCallbackTimes();
+        if (data.verbose) logXruns();
+    };
+
+    static uint64_t
+    xrunCount(const metrics::Counter *counter)
+    {
+        return counter ? counter->get() : 0;
+    };
+
+    /// the callback cannot print, report the xruns it counted since last time
+    void
+    logXruns()
+    {
+        auto n_input  = xrunCount(data.input_xruns);
+        auto n_output = xrunCount(data.output_xruns);
+        if (n_input > reported_input)
+        {
+            std::cout << "Input data was discarded because of an overflow "
+                         "condition at the driver (buffers: "
+                      << n_input - reported_input << ").\n";
+        }
+        if (n_output > reported_output)
+        {
+            std::cout << "The output buffer ran low, likely producing a break "
+                         "in the output sound (buffers: "
+                      << n_output - reported_output << ").\n";
+        }
+        reported_input  = n_input;
+        reported_output = n_output;
+    };
+
+    static void
+    writeSamples(buffers::SpscRing<char> &ring, wav::Wav &pcm)
+    {
+        ring.consume([&pcm](const char *bytes, size_t n_bytes) {
+            if (pcm.isReady()) pcm.file.write(bytes, n_bytes);
+        });
+    };
 };
 };  // namespace data
 
@@ -622,93 +790,67 @@ int2format(unsigned format_size)
 std::size_t
 format2sizeof(RtAudioFormat fmt)
 {
-    std::size_t size;
-    switch (fmt)
-    {
-        case RTAUDIO_SINT8: size = sizeof(char); break;
-        case RTAUDIO_SINT16: size = sizeof(signed short); break;
-        case RTAUDIO_SINT24: size = sizeof(S24); break;
-        case RTAUDIO_SINT32: size = sizeof(int); break;
-        case RTAUDIO_FLOAT32: size = sizeof(float); break;
-        case RTAUDIO_FLOAT64: size = sizeof(double); break;
-        default:
-            throw err::Runtime("Unknown RtAudioFormat (--abits): " +
-                               std::to_string(fmt));
-    }
-    return size;
+    return traits::dispatch(
+      fmt, [](auto format) { return decltype(format)::size; });
 };
 
 uint32_t
 format2bits(RtAudioFormat fmt)
 {
-    uint32_t bit_depth;
-    switch (fmt)
-    {
-        case RTAUDIO_SINT8: bit_depth = 8; break;
-        case RTAUDIO_SINT16: bit_depth = 16; break;
-        case RTAUDIO_SINT24: bit_depth = 24; break;
-        case RTAUDIO_SINT32: bit_depth = 32; break;
-        case RTAUDIO_FLOAT32: bit_depth = 32; break;
-        case RTAUDIO_FLOAT64: bit_depth = 64; break;
-        default:
-            throw err::Runtime("Unknown RtAudioFormat (--abits): " +
-                               std::to_string(fmt));
-    }
-    return bit_depth;
+    return traits::dispatch(
+      fmt, [](auto format) { return decltype(format)::bits; });
 };
 
 double
 format2scale(RtAudioFormat fmt)
 {
-    double scale;
-    switch (fmt)
-    {
-        case RTAUDIO_SINT8: scale = 127.0; break;
-        case RTAUDIO_SINT16: scale = 32767.0; break;
-        case RTAUDIO_SINT24: scale = 8388607.0; break;
-        case RTAUDIO_SINT32: scale = 2147483647.0; break;
-        case RTAUDIO_FLOAT32: scale = 1.0; break;
-        case RTAUDIO_FLOAT64: scale = 1.0; break;
-        default:
-            throw err::Runtime("Unknown RtAudioFormat (--abits): " +
-                               std::to_string(fmt));
-    }
-    return scale;
+    return traits::dispatch(
+      fmt, [](auto format) { return decltype(format)::scale; });
 };
 
 std::string
 format2string(RtAudioFormat fmt)
 {
-    RtAudioFormat fmt_sint8   = RTAUDIO_SINT8;
-    RtAudioFormat fmt_sint16  = RTAUDIO_SINT16;
-    RtAudioFormat fmt_sint24  = RTAUDIO_SINT24;
-    RtAudioFormat fmt_sint32  = RTAUDIO_SINT32;
-    RtAudioFormat fmt_float32 = RTAUDIO_FLOAT32;
-    RtAudioFormat fmt_float64 = RTAUDIO_FLOAT64;
-    std::string   size;
-    switch (fmt)
-    {
-        case RTAUDIO_SINT8:
-        case RTAUDIO_SINT16:
-        case RTAUDIO_SINT24:
-        case RTAUDIO_SINT32: size = "sint"; break;
-        case RTAUDIO_FLOAT32:
-        case RTAUDIO_FLOAT64: size = "float"; break;
-        default:
-            throw err::Runtime("Unknown RtAudioFormat (--abits): " +
-                               std::to_string(fmt));
-    }
-    return size;
+    return traits::dispatch(fmt, [](auto format) {
+        return std::string(decltype(format)::kind);
+    });
+};
+
+/// count a timestamp row lost because the disk writer fell behind
+void
+rowPushed(audio::data::CallbackData *data, bool pushed)
+{
+    if (!pushed && data->dropped_rows) data->dropped_rows->add();
+};
+
+/// add a timestamp row if recording
+void
+addTimestamp(audio::data::CallbackData *data, int err = 0)
+{
+    if (data->write) rowPushed(data, data->ts.addTimestamp(err));
+};
+
+/**
+ * Count a sample buffer lost because the disk writer fell behind and mark
+ * the gap in the timestamp file, status -3 with the lost frames as its size
+ */
+void
+bufferPushed(audio::data::CallbackData *data, bool pushed)
+{
+    if (pushed) return;
+    data->dropped_buffers.fetch_add(1, std::memory_order_relaxed);
+    if (data->dropped_bufs) data->dropped_bufs->add();
+    rowPushed(data, data->ts.addTimestamp(-3, data->buffer_len_now));
 };
 
 int
 saveRecorded(audio::data::CallbackData *data, void *buffer_data)
 {
-    auto *byte_buffer_out = static_cast<char *>(buffer_data);
+    auto *byte_buffer_out = static_cast<const char *>(buffer_data);
     auto  size            = data->rec.byte_size * data->buffer_len_now;
     if (data->rec.pcm.isReady() && data->write)
     {
-        data->rec.pcm.file.write(byte_buffer_out, size);
+        bufferPushed(data, data->rec.ring.push(byte_buffer_out, size));
     }
     return 0;
 };
@@ -716,65 +858,100 @@ saveRecorded(audio::data::CallbackData *data, void *buffer_data)
 int
 savePlayback(audio::data::CallbackData *data, void *buffer_data)
 {
-    auto *byte_buffer_out = static_cast<char *>(buffer_data);
+    auto *byte_buffer_out = static_cast<const char *>(buffer_data);
     auto  size            = data->play.byte_size * data->buffer_len_now;
     if (data->play.pcm.isReady() && data->write)
     {
-        data->play.pcm.file.write(byte_buffer_out, size);
+        bufferPushed(data, data->play.ring.push(byte_buffer_out, size));
     }
     return 0;
 };
 
+/**
+ * Write frames of the current pulse state, on while pulse_count lasts then off.
+ * Every channel gets the same value, so each state is one contiguous run.
+ */
 template<typename T>
-int
-playPulse(audio::data::CallbackData *data, T *byte_buffer_ptr)
+T *
+fillPulseRun(audio::data::CallbackOutputData &play,
+             T *                              out,
+             uint64_t                         n_frames,
+             size_t                           channels,
+             T                                on,
+             T                                off)
 {
-    unsigned frame = 0;
-    unsigned chan  = 0;
-    T        sample;
-    auto     on       = static_cast<T>(data->play.pulse_amp);
-    auto     off      = static_cast<T>(-data->play.pulse_amp);
-    auto     channels = static_cast<unsigned>(data->play.n_channels *
-                                          data->play.bit_mode_multi);
+    auto n_on = std::min(
+      n_frames, static_cast<uint64_t>(std::max(play.pulse_count, 0)));
+    play.pulse_count -= static_cast<int>(n_on);
+    out = std::fill_n(out, n_on * channels, on);
+    return std::fill_n(out, (n_frames - n_on) * channels, off);
+};
 
-    for (frame = 0; frame < data->buffer_len_now; ++frame)
-    {
-        if (data->ts.frameUpdate())
-        {
-            data->play.pulse_count = data->play.pulse_width;
-            if (data->write) data->ts.addTimestamp();
-        }
-        if (data->play.pulse_count > 0)
-        {
-            sample = on;
-            data->play.pulse_count -= 1;
-        } else
-        {
-            sample = off;
-        }
-        for (chan = 0; chan < channels; ++chan)
+/**
+ * Fill the buffer run by run. The pulse timer is still stepped per frame, so
+ * rising edges are where they always were, but samples are only written once
+ * the run up to the next edge is known, with no per-channel loop.
+ * @tparam F stream format, pulses are +/- pulse_amp of its full scale
+ */
+template<RtAudioFormat F>
+int
+playPulse(audio::data::CallbackData *       data,
+          typename traits::Format<F>::type *byte_buffer_ptr)
+{
+    auto     on       = traits::Format<F>::fromUnit(data->play.pulse_amp);
+    auto     off      = traits::Format<F>::fromUnit(-data->play.pulse_amp);
+    size_t   channels = data->play.n_channels;
+    uint64_t n_frames = data->buffer_len_now;
+    uint64_t frame    = 0;
+
+    while (frame < n_frames)
+    {
+        bool edge = false;
+        auto run  = data->ts.framesUpdate(n_frames - frame, edge);
+        frame += run;
+        if (!edge)
         {
-            *byte_buffer_ptr++ = sample;
+            fillPulseRun(data->play, byte_buffer_ptr, run, channels, on, off);
+            break;
         }
+        byte_buffer_ptr =
+          fillPulseRun(data->play, byte_buffer_ptr, run - 1, channels, on, off);
+        data->play.pulse_count = data->play.pulse_width;
+        audio::rt::addTimestamp(data);
+        byte_buffer_ptr =
+          fillPulseRun(data->play, byte_buffer_ptr, 1, channels, on, off);
     }
 
     return 0;
 };
 
+/**
+ * Fill one raw output buffer with pulses
+ * @tparam F stream format of the buffer
+ * @param out raw output buffer of data->buffer_len_now frames
+ * @return callback status from playPulse
+ */
+template<RtAudioFormat F>
+int
+playPulseBuffer(audio::data::CallbackData *data, void *out)
+{
+    return audio::rt::playPulse<F>(
+      data, static_cast<typename traits::Format<F>::type *>(out));
+};
+
+/**
+ * Copy or mix the input buffer into the output buffer through play.matrix
+ * @tparam F stream format of both buffers
+ */
+template<RtAudioFormat F>
 int
 playBack(audio::data::CallbackData *data, void *in, void *out)
 {
-    data->ts.addTimestamp();
-    auto size = data->play.byte_size * data->buffer_len_now;
-    if (data->rec.n_channels == data->play.n_channels)
-    {
-        memcpy(out, in, size);
-    } else
-    {
-        throw err::Runtime(
-          "Cannot copy audio input/output with different channel numbers");
-        // TODO: handle different channels for input/output
-    }
+    using sample_t = typename traits::Format<F>::type;
+    audio::rt::addTimestamp(data);
+    data->play.matrix.apply<F>(static_cast<const sample_t *>(in),
+                               static_cast<sample_t *>(out),
+                               data->buffer_len_now);
     return 0;
 };
 
@@ -790,7 +967,9 @@ playBack(audio::data::CallbackData *data, void *in, void *out)
  * @param status buffer under/overflow error
  * @param userData data passed to callback to be casted
  * @return error code (1= stop and clear, 2= stop abruptly)
+ * @tparam F stream format, one instantiation per format, see callbackFor
  */
+template<RtAudioFormat F>
 int
 callback(void *              outputBuffer,
          void *              inputBuffer,
@@ -799,22 +978,29 @@ callback(void *              outputBuffer,
          RtAudioStreamStatus status,
          void *              userData)
 {
-    auto *data = static_cast<audio::data::CallbackData *>(userData);
+    auto *               data = static_cast<audio::data::CallbackData *>(userData);
+    metrics::ScopedTimer timed(data->callback_us);
+    TRACE_THREAD("audio callback");
+    TRACE_SCOPE("audio", "callback");
+    if (!data->placed)
+    {
+        // the callback thread belongs to the audio API, pin it from inside
+        data->placement_status = threads::placeThread(data->placement);
+        data->placed           = true;
+        data->placement_done.store(true, std::memory_order_release);
+    }
     data->ts.streamSync(streamTime);
     data->ts.setBufferSize(nFrames);
     data->buffer_len_now = nFrames;
+    if (data->buffer_frames) data->buffer_frames->record(nFrames);
     int return_value     = nFrames > data->buffer_max_allowed ? 1 : 0;
-    data->ts.addTimestamp(1);
+    audio::rt::addTimestamp(data, 1);
     if (data->rec.in_use)
     {
         if (status == RTAUDIO_INPUT_OVERFLOW)
         {
-            if (data->verbose)
-            {
-                std::cout << "Input data was discarded because of an overflow "
-                             "condition at the driver.\n";
-            }
-            data->ts.addTimestamp(-1);
+            audio::rt::addTimestamp(data, -1);
+            if (data->input_xruns) data->input_xruns->add();
         }
         return_value += saveRecorded(data, inputBuffer);
     }
@@ -822,28 +1008,16 @@ callback(void *              outputBuffer,
     {
         if (status == RTAUDIO_OUTPUT_UNDERFLOW)
         {
-            if (data->verbose)
-            {
-                std::cout << "The output buffer ran low, "
-                             "likely producing a break in the output sound.\n";
-            }
-            data->ts.addTimestamp(-2);
+            audio::rt::addTimestamp(data, -2);
             data->play.pulse_count = 0;
+            if (data->output_xruns) data->output_xruns->add();
         }
         if (data->play.mode == audio::data::PlayMode::PULSE)
         {
-            if (data->format_sizeof < 32)
-            {
-                return_value += audio::rt::playPulse(
-                  data, static_cast<float *>(outputBuffer));
-            } else
-            {
-                return_value += audio::rt::playPulse(
-                  data, static_cast<double *>(outputBuffer));
-            }
+            return_value += audio::rt::playPulseBuffer<F>(data, outputBuffer);
         } else if (data->play.mode == audio::data::PlayMode::PLAYBACK)
         {
-            return_value += audio::rt::playBack(
+            return_value += audio::rt::playBack<F>(
               data, inputBuffer, outputBuffer);
         }
         savePlayback(data, outputBuffer);
@@ -855,17 +1029,19 @@ callback(void *              outputBuffer,
         return 1;
     }
 
-    if (data->write)
-    {
-        data->ts.writeCallbackTimes();
-        ++data->ts.buffer_sample;
-    } else
-    {
-        data->ts.clearBuffers();
-    }
+    if (data->write) ++data->ts.buffer_sample;
 
     return return_value;
 };
+
+/// the callback compiled for the stream format
+RtAudioCallback
+callbackFor(RtAudioFormat fmt)
+{
+    return traits::dispatch(fmt, [](auto format) -> RtAudioCallback {
+        return &audio::rt::callback<decltype(format)::format>;
+    });
+};
 };  // namespace rt
 
 /**
@@ -941,12 +1117,12 @@ getAPI(unsigned api)
  * @return
  */
 std::vector<audio::data::Device>
-getRtDeviceInfo(int _play, int _rec, RtAudio *audio)
+getRtDeviceInfo(int _play, int _rec, audio::Backend *audio)
 {
     // check if any audio devices
     auto n_devices = audio->getDeviceCount();
     if (n_devices == 0) throw err::Runtime("No audio devices found!!");
-    std::cout << "\n  - rtaudio_api: " << audio->getCurrentApi()
+    std::cout << "\n  - rtaudio_api: " << audio->name()
               << "\n  - max_audio_device_index: " << n_devices - 1;
 
     audio::data::Device              play_device;
@@ -1122,6 +1298,11 @@ setFlagsOptions(const param::data::Audio &audio,
     if (audio.min_latency) flags = flags | RTAUDIO_MINIMIZE_LATENCY;
     if (audio.linux_default) flags = flags | RTAUDIO_ALSA_USE_DEFAULT;
     if (audio.hog_device) flags = flags | RTAUDIO_HOG_DEVICE;
+    if (audio.callback_priority > 0)
+    {
+        flags             = flags | RTAUDIO_SCHEDULE_REALTIME;
+        options->priority = audio.callback_priority;
+    }
 
     options->numberOfBuffers = 2;
     options->flags           = flags;
@@ -1208,11 +1389,12 @@ class StreamData
      * @param opts Command line options object
      */
     explicit StreamData(const opts::Pars &opts)
-      : main_audio(getAPI(opts.audio.api_enumerator))
+      : main_audio(
+          makeBackend(opts.audio, getAPI(opts.audio.api_enumerator)))
     {
         verbose = opts.basic.verbose;
-        if (verbose) main_audio.showWarnings(true);
-        api           = main_audio.getCurrentApi();
+        if (verbose) main_audio->showWarnings(true);
+        api           = main_audio->getCurrentApi();
         playback_mode = getPlayMode(opts.audio.playback_mode);
         audio_mode    = getAudioMode(
           opts.audio.playback.device_id, opts.audio.record.device_id);
@@ -1220,7 +1402,7 @@ class StreamData
         {
             info = getRtDeviceInfo(opts.audio.playback.device_id,
                                    opts.audio.record.device_id,
-                                   &main_audio);
+                                   main_audio.get());
             fixConflictingOptions(opts.audio);
             setFlagsOptions(opts.audio, &options);
             use_input_device  = isRecording(audio_mode);
@@ -1232,6 +1414,8 @@ class StreamData
             pulse_width         = opts.audio.pulse_width;
             record_duration_sec = opts.audio.record_duration_sec;
             save_playback       = opts.audio.save_playback;
+            callback_core       = opts.audio.callback_core;
+            channel_map         = opts.audio.channel_map;
         } else
         {
             use_audio = false;
@@ -1241,7 +1425,7 @@ class StreamData
     };
 
     // Data needed for RtAudio open/close streams
-    RtAudio                    main_audio{};
+    std::unique_ptr<Backend>   main_audio;
     audio::data::StreamMode    audio_mode{audio::data::StreamMode::NONE};
     audio::data::PlayMode      playback_mode{audio::data::PlayMode::NONE};
     RtAudio::Api               api = RtAudio::UNSPECIFIED;
@@ -1261,6 +1445,8 @@ class StreamData
     bool                       use_output_device   = false;
     bool                       save_playback       = false;
     bool                       verbose             = false;
+    int                        callback_core       = -1;
+    std::string                channel_map         = "";
     std::string                timestamp_filename  = "";
     std::string                recording_filename  = "";
     std::string                playback_filename   = "";
@@ -1328,6 +1514,7 @@ class Streams : public StreamData
 {
   public:
     audio::data::CallbackData callback;
+    audio::data::DiskWriter   disk_writer{callback};
 
     /**
      * Construct object using user-specified command line options
@@ -1351,8 +1538,10 @@ class Streams : public StreamData
     open(double start_time = 0)
     {
         if (!use_audio) return;
+        disk_writer.stop();
         openStream();
         updateCallback();
+        disk_writer.start();
         start(start_time);
     };
 
@@ -1372,7 +1561,7 @@ class Streams : public StreamData
         if (!use_audio) return;
         if (isOpen())
         {
-            if (main_audio.isStreamRunning())
+            if (main_audio->isStreamRunning())
             {
                 if (verbose) std::cout << "\nStream already started.\n";
                 return;
@@ -1380,8 +1569,8 @@ class Streams : public StreamData
             try
             {
                 setTime(start_time);
-                main_audio.startStream();
-                if (!main_audio.isStreamRunning())
+                main_audio->startStream();
+                if (!main_audio->isStreamRunning())
                 {
                     std::cerr << "\nStream was not started\n";
                 }
@@ -1402,12 +1591,12 @@ class Streams : public StreamData
         if (!use_audio) return;
         if (isOpen())
         {
-            if (main_audio.isStreamRunning())
+            if (main_audio->isStreamRunning())
             {
                 if (verbose) std::cout << "\nAttempting to stop stream.\n";
                 try
                 {
-                    main_audio.stopStream();
+                    main_audio->stopStream();
                 } catch (RtAudioError &err)
                 {
                     throw err::Runtime(err);
@@ -1418,7 +1607,7 @@ class Streams : public StreamData
                 if (verbose) std::cout << "\nClosing stream.\n";
                 try
                 {
-                    main_audio.closeStream();
+                    main_audio->closeStream();
                 } catch (RtAudioError &err)
                 {
                     throw err::Runtime(err);
@@ -1450,9 +1639,18 @@ class Streams : public StreamData
     {
         if (!use_audio) return;
         stop(true);
+        disk_writer.stop();
         callback.ts.close();
         callback.rec.pcm.close();
         callback.play.pcm.close();
+        auto lost_buffers = disk_writer.getDroppedBuffers();
+        auto lost_rows    = disk_writer.getDroppedRows();
+        if (lost_buffers > 0 || lost_rows > 0)
+        {
+            std::cerr << "\nAudio disk writer fell behind, " << lost_buffers
+                      << " sample buffers and " << lost_rows
+                      << " timestamp rows were lost\n";
+        }
     };
 
     bool
@@ -1465,14 +1663,14 @@ class Streams : public StreamData
             close();
             return false;
         }
-        return main_audio.isStreamRunning();
+        return main_audio->isStreamRunning();
     };
 
     bool
     isOpen()
     {
         if (!use_audio) return false;
-        return main_audio.isStreamOpen();
+        return main_audio->isStreamOpen();
     };
 
     uint64_t
@@ -1489,11 +1687,33 @@ class Streams : public StreamData
     };
 
   private:
+    double disk_ring_sec = 2;
+
     void
     init()
     {
         if (!use_audio) return;
-        callback.verbose = verbose;
+        callback.verbose        = verbose;
+        callback.placement.core = callback_core;
+        auto &reg               = metrics::registry();
+        callback.callback_us    = &reg.histogram(
+          "cogdevcam_audio_callback_us", "Time spent in the audio callback");
+        callback.buffer_frames = &reg.histogram(
+          "cogdevcam_audio_buffer_frames", "Frames per audio callback");
+        callback.input_xruns = &reg.counter("cogdevcam_audio_xruns_total",
+                                            "Input overflows and output "
+                                            "underflows",
+                                            {{"direction", "input"}});
+        callback.output_xruns = &reg.counter("cogdevcam_audio_xruns_total",
+                                             "Input overflows and output "
+                                             "underflows",
+                                             {{"direction", "output"}});
+        callback.dropped_bufs = &reg.counter(
+          "cogdevcam_audio_disk_dropped_buffers_total",
+          "Audio sample buffers lost because the disk writer fell behind");
+        callback.dropped_rows = &reg.counter(
+          "cogdevcam_audio_disk_dropped_rows_total",
+          "Audio timestamp rows lost because the disk writer fell behind");
         callback.ts.file.init(timestamp_filename);
         callback.ts.setFilePtr();
         callback.format_sizeof      = audio::rt::format2sizeof(rt_format);
@@ -1535,26 +1755,26 @@ class Streams : public StreamData
         checkStreamValues(playback_ptr, record_ptr, sample_rate);
         try
         {
-            main_audio.openStream(
+            main_audio->openStream(
               playback_ptr,
               record_ptr,
               rt_format,
               sample_rate,
               &buffer_size,
-              static_cast<RtAudioCallback>(&audio::rt::callback),
+              audio::rt::callbackFor(rt_format),
               &callback,
-              &options,
-              nullptr);
+              &options);
             if (isOpen())
             {
                 std::cout
                   << "\n  - output_device: " << playback.deviceId
                   << "\n  - input_device: " << record.deviceId
-                  << "\n  - stream_time_sec: " << main_audio.getStreamTime()
-                  << "\n  - stream_latency: " << main_audio.getStreamLatency()
+                  << "\n  - stream_time_sec: " << main_audio->getStreamTime()
+                  << "\n  - stream_latency: " << main_audio->getStreamLatency()
                   << "\n  - stream_sample_rate: "
-                  << main_audio.getStreamSampleRate()
+                  << main_audio->getStreamSampleRate()
                   << "\n  - stream_num_buffers: " << options.numberOfBuffers
+                  << "\n  - stream_priority: " << options.priority
                   << std::endl;
             } else
             {
@@ -1570,8 +1790,8 @@ class Streams : public StreamData
     double
     setTime(double sec = -1)
     {
-        if (sec >= 0) main_audio.setStreamTime(sec);
-        auto stream_time_now = main_audio.getStreamTime();
+        if (sec >= 0) main_audio->setStreamTime(sec);
+        auto stream_time_now = main_audio->getStreamTime();
         callback.ts.streamSync(stream_time_now);
         callback.ts.update();
         return stream_time_now;
@@ -1584,7 +1804,7 @@ class Streams : public StreamData
     void
     updateCallback()
     {
-        sample_rate             = main_audio.getStreamSampleRate();
+        sample_rate             = main_audio->getStreamSampleRate();
         callback.rec.in_use     = use_input_device;
         callback.play.in_use    = use_output_device;
         callback.play.mode      = playback_mode;
@@ -1593,21 +1813,30 @@ class Streams : public StreamData
         callback.stop_after     = timeToBuffers();
         callback.ts.setSampleTime(sample_rate);
         playBackUpdates();
+        reserveDiskRings();
     }
 
+    /**
+     * Room for disk_ring_sec of samples and rows, the longest the disk can
+     * stall before the callback starts dropping buffers. A row is added per
+     * callback, per pulse, and per xrun.
+     */
+    void
+    reserveDiskRings()
+    {
+        auto per_sec  = 3.0 * sample_rate / std::max(buffer_size, 1u) +
+                       pulse_rate;
+        auto n_frames = static_cast<size_t>(
+          std::ceil(sample_rate * disk_ring_sec));
+        auto n_rows = static_cast<size_t>(std::ceil(per_sec * disk_ring_sec));
+        disk_writer.reserve(n_frames, n_rows);
+    };
+
     void
     playBackUpdates()
     {
         if (callback.play.mode == audio::data::PlayMode::PULSE)
         {
-            callback.ts.flush_buffer = static_cast<size_t>(
-              std::round(pulse_rate));
-
-            if (rt_format == RTAUDIO_FLOAT64)
-            {
-                callback.play.bit_mode_multi = 2;
-                callback.play.pulse_amp *= 2;
-            }
             if (sample_rate / pulse_rate < 2)
             {
                 throw err::Runtime("Pulse rate too high for on/off samples");
@@ -1616,6 +1845,16 @@ class Streams : public StreamData
             {
                 throw err::Runtime("Pulse width too high for given pulse rate");
             }
+        } else if (callback.play.mode == audio::data::PlayMode::PLAYBACK)
+        {
+            callback.play.matrix.set(channel_map,
+                                     callback.rec.n_channels,
+                                     callback.play.n_channels,
+                                     rt_format);
+            callback.play.matrix.reserve(
+              std::max(buffer_size, callback.buffer_max_allowed));
+            std::cout << "  - channel_map: "
+                      << callback.play.matrix.describe() << std::endl;
         }
     };
 
@@ -0,0 +1,641 @@
+/**
+    project: cogdevcam
+    source file: backends
+    description: devices that audio streams are opened on
+
+    @author Joseph M. Burling
+    @version 0.9.2 12/19/2017
+*/
+
+#ifndef COGDEVCAM_BACKENDS_H
+#define COGDEVCAM_BACKENDS_H
+
+#include "formats.h"
+#include "options.h"
+#include "tools.h"
+#include <RtAudio.h>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace audio {
+
+/// --aapi value that selects the simulated device instead of an RtAudio API
+const unsigned sim_api = 10;
+
+/**
+ * The parts of RtAudio used by audio::Streams, so real devices and the
+ * simulated device are opened and driven the same way. Errors from RtAudio
+ * are thrown as RtAudioError, errors from the simulator as err::Runtime.
+ */
+class Backend
+{
+  public:
+    virtual ~Backend() = default;
+
+    virtual RtAudio::Api
+    getCurrentApi() = 0;
+
+    /// API name used in messages
+    virtual std::string
+    name() = 0;
+
+    virtual void
+    showWarnings(bool on) = 0;
+
+    virtual unsigned int
+    getDeviceCount() = 0;
+
+    virtual RtAudio::DeviceInfo
+    getDeviceInfo(unsigned int device) = 0;
+
+    virtual void
+    openStream(RtAudio::StreamParameters *output,
+               RtAudio::StreamParameters *input,
+               RtAudioFormat              format,
+               unsigned int               sample_rate,
+               unsigned int *             buffer_frames,
+               RtAudioCallback            callback,
+               void *                     user_data,
+               RtAudio::StreamOptions *   options) = 0;
+
+    virtual void
+    closeStream() = 0;
+
+    virtual void
+    startStream() = 0;
+
+    virtual void
+    stopStream() = 0;
+
+    virtual bool
+    isStreamOpen() = 0;
+
+    virtual bool
+    isStreamRunning() = 0;
+
+    virtual double
+    getStreamTime() = 0;
+
+    virtual void
+    setStreamTime(double sec) = 0;
+
+    virtual long
+    getStreamLatency() = 0;
+
+    virtual unsigned int
+    getStreamSampleRate() = 0;
+};
+
+/// sound devices through one of the compiled RtAudio APIs
+class RtBackend : public Backend
+{
+  public:
+    explicit RtBackend(RtAudio::Api api) : audio(api){};
+
+    RtAudio::Api
+    getCurrentApi() override
+    {
+        return audio.getCurrentApi();
+    };
+
+    std::string
+    name() override
+    {
+        return "rtaudio:" + std::to_string(audio.getCurrentApi());
+    };
+
+    void
+    showWarnings(bool on) override
+    {
+        audio.showWarnings(on);
+    };
+
+    unsigned int
+    getDeviceCount() override
+    {
+        return audio.getDeviceCount();
+    };
+
+    RtAudio::DeviceInfo
+    getDeviceInfo(unsigned int device) override
+    {
+        return audio.getDeviceInfo(device);
+    };
+
+    void
+    openStream(RtAudio::StreamParameters *output,
+               RtAudio::StreamParameters *input,
+               RtAudioFormat              format,
+               unsigned int               sample_rate,
+               unsigned int *             buffer_frames,
+               RtAudioCallback            callback,
+               void *                     user_data,
+               RtAudio::StreamOptions *   options) override
+    {
+        audio.openStream(output,
+                         input,
+                         format,
+                         sample_rate,
+                         buffer_frames,
+                         callback,
+                         user_data,
+                         options,
+                         nullptr);
+    };
+
+    void
+    closeStream() override
+    {
+        audio.closeStream();
+    };
+
+    void
+    startStream() override
+    {
+        audio.startStream();
+    };
+
+    void
+    stopStream() override
+    {
+        audio.stopStream();
+    };
+
+    bool
+    isStreamOpen() override
+    {
+        return audio.isStreamOpen();
+    };
+
+    bool
+    isStreamRunning() override
+    {
+        return audio.isStreamRunning();
+    };
+
+    double
+    getStreamTime() override
+    {
+        return audio.getStreamTime();
+    };
+
+    void
+    setStreamTime(double sec) override
+    {
+        audio.setStreamTime(sec);
+    };
+
+    long
+    getStreamLatency() override
+    {
+        return audio.getStreamLatency();
+    };
+
+    unsigned int
+    getStreamSampleRate() override
+    {
+        return audio.getStreamSampleRate();
+    };
+
+  private:
+    RtAudio audio;
+};
+
+namespace sim {
+
+struct Settings
+{
+    /// sine:HZ, noise, silence, or the path of a WAV file
+    std::string input     = "sine:1000";
+    double      jitter_ms = 0;
+    double      xrun_rate = 0;
+    unsigned    seed      = 1;
+};
+
+size_t
+sampleBytes(RtAudioFormat format)
+{
+    return traits::dispatch(format,
+                            [](auto fmt) { return decltype(fmt)::size; });
+};
+
+/**
+ * Store one sample in the stream format, little endian like the devices
+ * @param value between -1 and 1
+ */
+void
+writeSample(RtAudioFormat format, double value, char *dst)
+{
+    traits::dispatch(format, [value, dst](auto fmt) {
+        decltype(fmt)::store(value, dst);
+    });
+};
+
+/// what the simulated device records
+class Signal
+{
+  public:
+    /**
+     * @param spec sine:HZ, noise, silence, or a WAV file path
+     * @param seed seed for noise
+     */
+    Signal(const std::string &_spec, unsigned seed) : spec(_spec), rng(seed){};
+
+    /// check the spec against the stream and load the file, if any
+    void
+    prepare(RtAudioFormat _format, unsigned _n_channels, unsigned _rate)
+    {
+        format       = _format;
+        n_channels   = _n_channels;
+        sample_rate  = _rate;
+        sample_bytes = sampleBytes(format);
+        phase        = 0;
+        file_pos     = 0;
+        if (spec == "noise" || spec == "silence") return;
+        if (spec.compare(0, 5, "sine:") == 0)
+        {
+            frequency = std::stod(spec.substr(5));
+            return;
+        }
+        loadWav(spec);
+    };
+
+    /// fill n_frames interleaved frames
+    void
+    fill(char *dst, unsigned n_frames)
+    {
+        auto n_bytes = static_cast<size_t>(n_frames) * n_channels *
+                       sample_bytes;
+        if (!pcm.empty())
+        {
+            for (size_t b = 0; b < n_bytes; ++b)
+            {
+                dst[b]   = pcm[file_pos];
+                file_pos = file_pos + 1 == pcm.size() ? 0 : file_pos + 1;
+            }
+            return;
+        }
+        if (spec == "silence")
+        {
+            std::memset(dst, 0, n_bytes);
+            return;
+        }
+        std::uniform_real_distribution<double> noise(-0.5, 0.5);
+        double step = two_pi * frequency / sample_rate;
+        for (unsigned f = 0; f < n_frames; ++f)
+        {
+            double value = spec == "noise" ? 0 : 0.5 * std::sin(phase);
+            phase        = std::fmod(phase + step, two_pi);
+            for (unsigned c = 0; c < n_channels; ++c)
+            {
+                if (spec == "noise") value = noise(rng);
+                writeSample(format, value, dst);
+                dst += sample_bytes;
+            }
+        }
+    };
+
+  private:
+    const double      two_pi = 6.283185307179586;
+    std::string       spec;
+    std::mt19937      rng;
+    RtAudioFormat     format       = RTAUDIO_SINT16;
+    unsigned          n_channels   = 0;
+    unsigned          sample_rate  = 1;
+    size_t            sample_bytes = 2;
+    double            frequency    = 1000;
+    double            phase        = 0;
+    std::vector<char> pcm;
+    size_t            file_pos = 0;
+
+    static uint32_t
+    readLE(const std::vector<char> &bytes, size_t pos, size_t n_bytes)
+    {
+        uint32_t value = 0;
+        for (size_t b = 0; b < n_bytes; ++b)
+        {
+            value |= static_cast<uint32_t>(
+                       static_cast<unsigned char>(bytes[pos + b]))
+                     << (8 * b);
+        }
+        return value;
+    };
+
+    /// samples of a WAV file in the stream format, see wav::writeHeader
+    void
+    loadWav(const std::string &filename)
+    {
+        std::ifstream file(filename, std::ios::binary);
+        if (!file.is_open())
+        {
+            throw err::Runtime("Simulated audio input must be sine:HZ, noise, "
+                               "silence, or a WAV file, got: " +
+                               filename);
+        }
+        std::vector<char> bytes((std::istreambuf_iterator<char>(file)),
+                                std::istreambuf_iterator<char>());
+        if (bytes.size() < 12 || std::string(bytes.data(), 4) != "RIFF" ||
+            std::string(bytes.data() + 8, 4) != "WAVE")
+        {
+            throw err::Runtime("Not a WAV file: " + filename);
+        }
+
+        uint32_t channels = 0, bits = 0, code = 0;
+        size_t   pos = 12;
+        while (pos + 8 <= bytes.size())
+        {
+            std::string id(bytes.data() + pos, 4);
+            size_t      size = readLE(bytes, pos + 4, 4);
+            pos += 8;
+            if (id == "fmt " && pos + 16 <= bytes.size())
+            {
+                code     = readLE(bytes, pos, 2);
+                channels = readLE(bytes, pos + 2, 2);
+                bits     = readLE(bytes, pos + 14, 2);
+            } else if (id == "data")
+            {
+                // size is 0 if the recording was never closed
+                if (size == 0 || pos + size > bytes.size())
+                {
+                    size = bytes.size() - pos;
+                }
+                pcm.assign(bytes.begin() + pos, bytes.begin() + pos + size);
+                break;
+            }
+            pos += size + (size & 1);
+        }
+
+        bool is_float = traits::dispatch(
+          format, [](auto fmt) { return decltype(fmt)::is_float; });
+        if (channels != n_channels || bits != 8 * sample_bytes ||
+            (code == 3) != is_float)
+        {
+            throw err::Runtime(
+              "Simulated audio input " + filename + " has " +
+              std::to_string(channels) + " channels of " +
+              std::to_string(bits) + "-bit " + (code == 3 ? "float" : "int") +
+              " samples, which does not match the input stream");
+        }
+        auto frame_bytes = n_channels * sample_bytes;
+        pcm.resize(pcm.size() - pcm.size() % frame_bytes);
+        if (pcm.empty())
+        {
+            throw err::Runtime("No samples in WAV file: " + filename);
+        }
+    };
+};
+
+/**
+ * Calls the stream callback from a timer thread at the pace a sound card
+ * would, one buffer per period, with optional late callbacks and xruns.
+ * Stream time counts frames, like a device clock, so timestamp accuracy can
+ * be measured against the master clock. Output samples are discarded.
+ */
+class Device : public Backend
+{
+  public:
+    explicit Device(const Settings &_settings)
+      : settings(_settings),
+        signal(_settings.input, _settings.seed),
+        rng(_settings.seed){};
+
+    ~Device() override
+    {
+        closeStream();
+    };
+
+    RtAudio::Api
+    getCurrentApi() override
+    {
+        return static_cast<RtAudio::Api>(sim_api);
+    };
+
+    std::string
+    name() override
+    {
+        return "simulated";
+    };
+
+    void
+    showWarnings(bool on) override{};
+
+    unsigned int
+    getDeviceCount() override
+    {
+        return 1;
+    };
+
+    RtAudio::DeviceInfo
+    getDeviceInfo(unsigned int device) override
+    {
+        RtAudio::DeviceInfo info;
+        if (device != 0) return info;
+        info.probed              = true;
+        info.name                = "cogdevcam simulated device";
+        info.outputChannels      = 2;
+        info.inputChannels       = 2;
+        info.duplexChannels      = 2;
+        info.isDefaultOutput     = true;
+        info.isDefaultInput      = true;
+        info.sampleRates         = {
+          8000, 16000, 22050, 44100, 48000, 96000, 192000};
+        info.preferredSampleRate = 48000;
+        info.nativeFormats = RTAUDIO_SINT8 | RTAUDIO_SINT16 | RTAUDIO_SINT24 |
+                             RTAUDIO_SINT32 | RTAUDIO_FLOAT32 | RTAUDIO_FLOAT64;
+        return info;
+    };
+
+    void
+    openStream(RtAudio::StreamParameters *output,
+               RtAudio::StreamParameters *input,
+               RtAudioFormat              _format,
+               unsigned int               _sample_rate,
+               unsigned int *             buffer_frames,
+               RtAudioCallback            _callback,
+               void *                     _user_data,
+               RtAudio::StreamOptions *   options) override
+    {
+        closeStream();
+        if (_sample_rate == 0 || !buffer_frames || *buffer_frames == 0)
+        {
+            throw err::Runtime("Simulated audio needs a sample rate and buffer "
+                               "size");
+        }
+        format      = _format;
+        sample_rate = _sample_rate;
+        n_frames    = *buffer_frames;
+        callback    = _callback;
+        user_data   = _user_data;
+        n_out       = output ? output->nChannels : 0;
+        n_in        = input ? input->nChannels : 0;
+        auto bytes  = sampleBytes(format);
+        out_buffer.assign(static_cast<size_t>(n_frames) * n_out * bytes, 0);
+        in_buffer.assign(static_cast<size_t>(n_frames) * n_in * bytes, 0);
+        if (n_in > 0) signal.prepare(format, n_in, sample_rate);
+        n_streamed  = 0;
+        time_offset = 0;
+        stream_open = true;
+    };
+
+    void
+    closeStream() override
+    {
+        stopStream();
+        stream_open = false;
+    };
+
+    void
+    startStream() override
+    {
+        if (!stream_open) throw err::Runtime("Simulated stream is not open");
+        if (running) return;
+        stopStream();
+        ticks.reset(std::chrono::duration_cast<timing::Duration>(
+          std::chrono::duration<double>(static_cast<double>(n_frames) /
+                                        sample_rate)));
+        running = true;
+        worker.reset(new threads::Worker([this]() { period(); }));
+        worker->start();
+    };
+
+    void
+    stopStream() override
+    {
+        running = false;
+        if (!worker) return;
+        worker->stop();
+        worker.reset();
+    };
+
+    bool
+    isStreamOpen() override
+    {
+        return stream_open;
+    };
+
+    bool
+    isStreamRunning() override
+    {
+        return running;
+    };
+
+    double
+    getStreamTime() override
+    {
+        return static_cast<double>(n_streamed.load()) / sample_rate +
+               time_offset.load();
+    };
+
+    void
+    setStreamTime(double sec) override
+    {
+        time_offset = sec - static_cast<double>(n_streamed.load()) / sample_rate;
+    };
+
+    long
+    getStreamLatency() override
+    {
+        return static_cast<long>(n_frames);
+    };
+
+    unsigned int
+    getStreamSampleRate() override
+    {
+        return sample_rate;
+    };
+
+  private:
+    Settings                         settings;
+    Signal                           signal;
+    std::mt19937                     rng;
+    RtAudioFormat                    format      = RTAUDIO_SINT16;
+    unsigned int                     sample_rate = 0;
+    unsigned int                     n_frames    = 0;
+    unsigned int                     n_out       = 0;
+    unsigned int                     n_in        = 0;
+    RtAudioCallback                  callback    = nullptr;
+    void *                           user_data   = nullptr;
+    std::vector<char>                out_buffer;
+    std::vector<char>                in_buffer;
+    std::atomic<uint64_t>            n_streamed{0};
+    std::atomic<double>              time_offset{0};
+    std::atomic_bool                 stream_open{false};
+    std::atomic_bool                 running{false};
+    timing::Periodic                 ticks;
+    std::unique_ptr<threads::Worker> worker;
+
+    /// one buffer, runs on the worker thread
+    void
+    period()
+    {
+        if (!running)
+        {
+            // the callback asked to stop, wait for stopStream()
+            timing::sleep::thread(std::chrono::milliseconds(1));
+            return;
+        }
+        auto n_missed = ticks.wait();
+        if (settings.jitter_ms > 0)
+        {
+            std::uniform_real_distribution<double> late(0, settings.jitter_ms);
+            timing::sleep::thread(
+              std::chrono::duration<double, std::milli>(late(rng)));
+        }
+
+        // frames of missed periods are lost, like a device that overran
+        n_streamed += static_cast<uint64_t>(n_missed) * n_frames;
+        RtAudioStreamStatus status = 0;
+        std::uniform_real_distribution<double> chance(0, 1);
+        if (n_missed > 0 ||
+            (settings.xrun_rate > 0 && chance(rng) < settings.xrun_rate))
+        {
+            bool input = n_in > 0 && (n_out == 0 || chance(rng) < 0.5);
+            status     = input ? RTAUDIO_INPUT_OVERFLOW : RTAUDIO_OUTPUT_UNDERFLOW;
+        }
+
+        if (n_in > 0) signal.fill(in_buffer.data(), n_frames);
+        auto stream_time = getStreamTime();
+        int  result      = callback(n_out > 0 ? out_buffer.data() : nullptr,
+                              n_in > 0 ? in_buffer.data() : nullptr,
+                              n_frames,
+                              stream_time,
+                              status,
+                              user_data);
+        n_streamed += n_frames;
+
+        // 1 drains and 2 aborts, either way nothing more is called
+        if (result != 0) running = false;
+    };
+};
+};  // namespace sim
+
+/**
+ * The device an audio stream runs on
+ * @param audio options, --aapi=10 picks the simulated device
+ * @param api compiled RtAudio API to use otherwise
+ */
+std::unique_ptr<Backend>
+makeBackend(const param::data::Audio &audio, RtAudio::Api api)
+{
+    if (audio.api_enumerator == sim_api)
+    {
+        sim::Settings settings;
+        settings.input     = audio.sim_input;
+        settings.jitter_ms = audio.sim_jitter_ms;
+        settings.xrun_rate = audio.sim_xrun_rate;
+        settings.seed      = audio.sim_seed;
+        return std::unique_ptr<Backend>(new sim::Device(settings));
+    }
+    return std::unique_ptr<Backend>(new RtBackend(api));
+};
+};  // namespace audio
+
+#endif  // COGDEVCAM_BACKENDS_H
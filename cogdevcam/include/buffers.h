@@ -0,0 +1,773 @@
+/**
+    project: cogdevcam
+    source file: buffers
+    description: containers for passing frames between threads
+
+    @author Joseph M. Burling
+    @version 0.9.2 12/19/2017
+*/
+
+#ifndef COGDEVCAM_BUFFERS_H
+#define COGDEVCAM_BUFFERS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "tools.h"
+
+namespace buffers {
+
+/**
+ * Bounded single producer, single consumer ring that never blocks either side.
+ * When the ring is full the producer overwrites the oldest entry and counts
+ * it as overwritten.
+ *
+ * Items live in nodes, capacity + 2 of them, and each cell holds the index of
+ * a node. The producer and consumer each keep one spare node. Both move items
+ * by exchanging their spare into a cell, which hands them sole ownership of
+ * the node that was there, so neither ever touches a node the other is using.
+ * The producer only moves write_pos and the consumer only moves read_pos;
+ * overwriting needs no help from the consumer.
+ * @tparam T movable item type
+ */
+template<typename T>
+class FrameRing
+{
+  public:
+    /**
+     * @param capacity number of cells, rounded up to the next power of two
+     */
+    explicit FrameRing(size_t capacity = 8)
+    {
+        size_t n_cells = 2;
+        while (n_cells < capacity) n_cells <<= 1;
+        mask  = n_cells - 1;
+        cells = std::unique_ptr<std::atomic<uint32_t>[]>(
+          new std::atomic<uint32_t>[n_cells]);
+        nodes = std::unique_ptr<Node[]>(new Node[n_cells + 2]);
+        for (size_t i = 0; i < n_cells; ++i)
+        {
+            cells[i].store(static_cast<uint32_t>(i), std::memory_order_relaxed);
+        }
+        producer_spare = static_cast<uint32_t>(n_cells);
+        consumer_spare = static_cast<uint32_t>(n_cells + 1);
+    };
+
+    FrameRing(const FrameRing &) = delete;
+    FrameRing &operator=(const FrameRing &) = delete;
+
+    /**
+     * Add an item, overwriting the oldest item if the ring is full. Call from
+     * the producer thread only.
+     * @param item item to move into the ring
+     * @return false if an item was overwritten to make room
+     */
+    bool
+    push(T item)
+    {
+        n_pushed.fetch_add(1, std::memory_order_relaxed);
+        auto  pos  = write_pos.load(std::memory_order_relaxed);
+        Node &node = nodes[producer_spare];
+        node.data  = std::move(item);
+        node.pos   = pos;
+        node.full  = true;
+        producer_spare =
+          cells[pos & mask].exchange(producer_spare, std::memory_order_acq_rel);
+        write_pos.store(pos + 1, std::memory_order_release);
+
+        Node &old = nodes[producer_spare];
+        if (!old.full) return true;
+        old.data = T();
+        old.full = false;
+        n_overwritten.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    };
+
+    /**
+     * Take the oldest item from the ring. Call from the consumer thread only.
+     * @param item filled with the popped item
+     * @return false if ring was empty
+     */
+    bool
+    pop(T &item)
+    {
+        auto read  = read_pos.load(std::memory_order_relaxed);
+        auto write = write_pos.load(std::memory_order_acquire);
+        if (read == write) return false;
+        // entries older than capacity were overwritten, skip to the oldest left
+        if (write - read > mask + 1) read = write - mask - 1;
+        consumer_spare =
+          cells[read & mask].exchange(consumer_spare, std::memory_order_acq_rel);
+        Node &node = nodes[consumer_spare];
+        if (!node.full) return false;
+        // the producer may have lapped the ring since write_pos was read, the
+        // node then holds a newer entry and the ones between are skipped
+        read_pos.store(std::max(read, node.pos) + 1, std::memory_order_relaxed);
+        item      = std::move(node.data);
+        node.data = T();
+        node.full = false;
+        return true;
+    };
+
+    /**
+     * Drain the ring and keep only the newest item
+     * @param item filled with the newest item
+     * @return false if ring was empty
+     */
+    bool
+    popLatest(T &item)
+    {
+        bool found = false;
+        while (pop(item))
+        {
+            found = true;
+        }
+        return found;
+    };
+
+    size_t
+    size() const
+    {
+        auto w = write_pos.load(std::memory_order_acquire);
+        auto r = read_pos.load(std::memory_order_relaxed);
+        return w >= r ? std::min<size_t>(w - r, mask + 1) : 0;
+    };
+
+    size_t
+    capacity() const
+    {
+        return mask + 1;
+    };
+
+    uint64_t
+    getPushed() const
+    {
+        return n_pushed.load(std::memory_order_relaxed);
+    };
+
+    uint64_t
+    getOverwritten() const
+    {
+        return n_overwritten.load(std::memory_order_relaxed);
+    };
+
+  private:
+    struct Node
+    {
+        T      data;
+        size_t pos  = 0;
+        bool   full = false;
+    };
+
+    using Padding = char[64];
+
+    std::unique_ptr<std::atomic<uint32_t>[]> cells;
+    std::unique_ptr<Node[]>                  nodes;
+    size_t                                   mask = 0;
+    Padding                                  pad_0{};
+    std::atomic<size_t>                      write_pos{0};
+    uint32_t                                 producer_spare = 0;
+    Padding                                  pad_1{};
+    std::atomic<size_t>                      read_pos{0};
+    uint32_t                                 consumer_spare = 0;
+    Padding                                  pad_2{};
+    std::atomic<uint64_t>                    n_pushed{0};
+    std::atomic<uint64_t>                    n_overwritten{0};
+};
+
+/**
+ * Preallocated ring for exactly one producer and one consumer. Neither side
+ * locks, waits, or allocates, so the producer can be a real-time thread.
+ * Unlike FrameRing, the producer never reclaims anything: when there is no
+ * room the new items are discarded and counted as dropped.
+ * @tparam T trivially copyable item type, e.g. char for sample bytes
+ */
+template<typename T>
+class SpscRing
+{
+  public:
+    explicit SpscRing(size_t capacity = 0)
+    {
+        reserve(capacity);
+    };
+
+    SpscRing(const SpscRing &) = delete;
+    SpscRing &operator=(const SpscRing &) = delete;
+
+    /**
+     * Make room for at least capacity items and empty the ring. Only call
+     * while neither the producer nor the consumer is using it.
+     * @param capacity rounded up to the next power of two
+     */
+    void
+    reserve(size_t capacity)
+    {
+        size_t n_items = 2;
+        while (n_items < capacity) n_items <<= 1;
+        if (capacity == 0)
+        {
+            items.reset();
+            mask = 0;
+        } else if (n_items != this->capacity())
+        {
+            items = std::unique_ptr<T[]>(new T[n_items]);
+            mask  = n_items - 1;
+        }
+        write_pos.store(0, std::memory_order_relaxed);
+        read_pos.store(0, std::memory_order_relaxed);
+    };
+
+    /// add one item, call from the producer thread only
+    bool
+    push(const T &item)
+    {
+        return push(&item, 1);
+    };
+
+    /**
+     * Add all items or none of them. Call from the producer thread only.
+     * @return false if there was not enough room, the items are dropped
+     */
+    bool
+    push(const T *src, size_t n_items)
+    {
+        auto w = write_pos.load(std::memory_order_relaxed);
+        auto r = read_pos.load(std::memory_order_acquire);
+        if (capacity() - (w - r) < n_items)
+        {
+            n_dropped.fetch_add(n_items, std::memory_order_relaxed);
+            return false;
+        }
+        auto start = w & mask;
+        auto first = std::min(n_items, mask + 1 - start);
+        std::copy(src, src + first, items.get() + start);
+        std::copy(src + first, src + n_items, items.get());
+        write_pos.store(w + n_items, std::memory_order_release);
+        return true;
+    };
+
+    /**
+     * Hand everything in the ring to func, at most two calls since the items
+     * may wrap around the end. Call from the consumer thread only.
+     * @param func called as func(const T *items, size_t n_items)
+     * @return number of items consumed
+     */
+    template<typename F>
+    size_t
+    consume(F &&func)
+    {
+        auto r       = read_pos.load(std::memory_order_relaxed);
+        auto w       = write_pos.load(std::memory_order_acquire);
+        auto n_items = w - r;
+        if (n_items == 0) return 0;
+        auto start = r & mask;
+        auto first = std::min(n_items, mask + 1 - start);
+        func(items.get() + start, first);
+        if (first < n_items) func(items.get(), n_items - first);
+        read_pos.store(w, std::memory_order_release);
+        return n_items;
+    };
+
+    size_t
+    size() const
+    {
+        return write_pos.load(std::memory_order_acquire) -
+               read_pos.load(std::memory_order_acquire);
+    };
+
+    size_t
+    capacity() const
+    {
+        return items ? mask + 1 : 0;
+    };
+
+    uint64_t
+    getDropped() const
+    {
+        return n_dropped.load(std::memory_order_relaxed);
+    };
+
+  private:
+    using Padding = char[64];
+
+    std::unique_ptr<T[]>  items;
+    size_t                mask = 0;
+    Padding               pad_0{};
+    std::atomic<size_t>   write_pos{0};
+    Padding               pad_1{};
+    std::atomic<size_t>   read_pos{0};
+    Padding               pad_2{};
+    std::atomic<uint64_t> n_dropped{0};
+};
+
+/**
+ * Fixed set of preallocated items handed out through reference counted
+ * handles. An item goes back to the pool when its last handle is released,
+ * so a producer can never write into an item that a consumer still holds.
+ *
+ * Handle copies only touch the item's own counter. Storage is freed once the
+ * pool and every outstanding handle are gone, so a pool can be replaced while
+ * older handles are still in use.
+ * @tparam T item type, e.g. an image buffer
+ */
+template<typename T>
+class Pool
+{
+    struct Storage;
+
+    struct Slot
+    {
+        std::atomic<uint32_t> refs{0};
+        Storage *             storage = nullptr;
+        T                     item;
+    };
+
+    struct Storage
+    {
+        explicit Storage(size_t n) : n_slots(n), slots(new Slot[n])
+        {
+            for (size_t i = 0; i < n_slots; ++i) slots[i].storage = this;
+        };
+
+        std::atomic<size_t>     refs{1};
+        size_t                  n_slots = 0;
+        std::unique_ptr<Slot[]> slots;
+
+        void
+        release()
+        {
+            if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this;
+        };
+    };
+
+  public:
+    using Init = std::function<void(T &)>;
+
+    class Handle
+    {
+      public:
+        Handle() = default;
+
+        Handle(const Handle &other) : slot(other.slot)
+        {
+            if (slot) slot->refs.fetch_add(1, std::memory_order_relaxed);
+        };
+
+        Handle(Handle &&other) noexcept : slot(other.slot)
+        {
+            other.slot = nullptr;
+        };
+
+        Handle &
+        operator=(Handle other) noexcept
+        {
+            std::swap(slot, other.slot);
+            return *this;
+        };
+
+        ~Handle()
+        {
+            reset();
+        };
+
+        void
+        reset()
+        {
+            if (!slot) return;
+            if (slot->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                slot->storage->release();
+            }
+            slot = nullptr;
+        };
+
+        T &
+        operator*() const
+        {
+            return slot->item;
+        };
+
+        T *
+        operator->() const
+        {
+            return &slot->item;
+        };
+
+        explicit operator bool() const
+        {
+            return slot != nullptr;
+        };
+
+        uint32_t
+        useCount() const
+        {
+            return slot ? slot->refs.load(std::memory_order_relaxed) : 0;
+        };
+
+      private:
+        friend class Pool;
+
+        explicit Handle(Slot *_slot) : slot(_slot){};
+
+        Slot *slot = nullptr;
+    };
+
+    /**
+     * @param n_items number of items to preallocate
+     * @param _init called once on each item, e.g. to allocate image memory
+     */
+    explicit Pool(size_t n_items = 0, Init _init = Init())
+      : init(std::move(_init)), storage(new Storage(n_items))
+    {
+        for (size_t i = 0; i < n_items; ++i)
+        {
+            if (init) init(storage->slots[i].item);
+        }
+    };
+
+    Pool(const Pool &) = delete;
+    Pool &operator=(const Pool &) = delete;
+
+    ~Pool()
+    {
+        storage->release();
+    };
+
+    /**
+     * Take a free item. If every item is in use a standalone item is
+     * allocated instead and counted as a miss. Call from one thread only.
+     * @return handle holding the only reference to the item
+     */
+    Handle
+    acquire()
+    {
+        auto n_slots = storage->n_slots;
+        for (size_t i = 0; i < n_slots; ++i)
+        {
+            auto &   slot     = storage->slots[(next_slot + i) % n_slots];
+            uint32_t expected = 0;
+            if (slot.refs.compare_exchange_strong(
+                  expected, 1, std::memory_order_acquire))
+            {
+                next_slot = (next_slot + i + 1) % n_slots;
+                storage->refs.fetch_add(1, std::memory_order_relaxed);
+                return Handle(&slot);
+            }
+        }
+
+        n_misses.fetch_add(1, std::memory_order_relaxed);
+        auto *single = new Storage(1);
+        if (init) init(single->slots[0].item);
+        single->slots[0].refs = 1;
+        Handle handle(&single->slots[0]);
+        return handle;
+    };
+
+    size_t
+    size() const
+    {
+        return storage->n_slots;
+    };
+
+    size_t
+    inUse() const
+    {
+        size_t n_used = 0;
+        for (size_t i = 0; i < storage->n_slots; ++i)
+        {
+            if (storage->slots[i].refs.load(std::memory_order_relaxed) > 0)
+            {
+                ++n_used;
+            }
+        }
+        return n_used;
+    };
+
+    uint64_t
+    getMisses() const
+    {
+        return n_misses.load(std::memory_order_relaxed);
+    };
+
+  private:
+    Init                  init;
+    Storage *             storage   = nullptr;
+    size_t                next_slot = 0;
+    std::atomic<uint64_t> n_misses{0};
+};
+/// What a bounded queue does with a new item when it is full
+enum class FullPolicy
+{
+    BLOCK,        // wait for the consumer to make room
+    DROP_OLDEST,  // discard the oldest queued item
+    DROP_NEWEST   // discard the incoming item
+};
+
+/**
+ * Bounded FIFO between one producer and one blocking consumer. Storage is
+ * allocated once, and the largest depth reached and the number of dropped
+ * items are kept for reporting.
+ * @tparam T movable item type
+ */
+template<typename T>
+class BoundedQueue
+{
+  public:
+    explicit BoundedQueue(size_t     _capacity = 32,
+                          FullPolicy _policy   = FullPolicy::BLOCK)
+      : policy(_policy), slots(_capacity < 1 ? 1 : _capacity){};
+
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+    /**
+     * Add an item, applying the full policy if there is no room
+     * @param item item to move into the queue
+     * @return false if the item was dropped or the queue is closed
+     */
+    bool
+    push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (closed) return false;
+        if (count == slots.size())
+        {
+            switch (policy)
+            {
+                case FullPolicy::BLOCK:
+                    not_full.wait(
+                      lock, [this]() { return closed || count < slots.size(); });
+                    if (closed) return false;
+                    break;
+                case FullPolicy::DROP_OLDEST:
+                    slots[head] = T();
+                    head        = (head + 1) % slots.size();
+                    --count;
+                    ++n_dropped;
+                    break;
+                case FullPolicy::DROP_NEWEST: ++n_dropped; return false;
+            }
+        }
+        slots[(head + count) % slots.size()] = std::move(item);
+        ++count;
+        if (count > high_water) high_water = count;
+        lock.unlock();
+        not_empty.notify_one();
+        return true;
+    };
+
+    /**
+     * Take the oldest item, waiting for one to arrive
+     * @param item filled with the popped item
+     * @param wait longest time to wait for an item
+     * @return false if nothing arrived in time or the queue is closed and empty
+     */
+    template<typename Rep, typename Period>
+    bool
+    pop(T &item, const std::chrono::duration<Rep, Period> &wait)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!not_empty.wait_for(
+              lock, wait, [this]() { return closed || count > 0; }))
+        {
+            return false;
+        }
+        return popLocked(item, lock);
+    };
+
+    /// take the oldest item without waiting
+    bool
+    pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        return popLocked(item, lock);
+    };
+
+    /// wake up anyone waiting, refuse new items. Queued items can still be popped
+    void
+    close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        not_empty.notify_all();
+        not_full.notify_all();
+    };
+
+    /// accept items again after close()
+    void
+    reopen()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = false;
+    };
+
+    size_t
+    size()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return count;
+    };
+
+    size_t
+    capacity() const
+    {
+        return slots.size();
+    };
+
+    size_t
+    getHighWater()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return high_water;
+    };
+
+    uint64_t
+    getDropped()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return n_dropped;
+    };
+
+  private:
+    FullPolicy              policy;
+    std::vector<T>          slots;
+    size_t                  head       = 0;
+    size_t                  count      = 0;
+    size_t                  high_water = 0;
+    uint64_t                n_dropped  = 0;
+    bool                    closed     = false;
+    std::mutex              mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+
+    bool
+    popLocked(T &item, std::unique_lock<std::mutex> &lock)
+    {
+        if (count == 0) return false;
+        item        = std::move(slots[head]);
+        slots[head] = T();
+        head        = (head + 1) % slots.size();
+        --count;
+        lock.unlock();
+        not_full.notify_one();
+        return true;
+    };
+};
+/**
+ * Short history of items kept in the order they were stamped, which can be
+ * searched by time. The oldest item is replaced once the history is full.
+ * Guarded by a mutex so one thread can add items while another looks them up.
+ * @tparam T copyable item type
+ * @tparam Time timestamp type, items must be added in increasing time
+ */
+template<typename T, typename Time = double>
+class TimedRing
+{
+  public:
+    explicit TimedRing(size_t _capacity = 16)
+      : entries(_capacity < 1 ? 1 : _capacity){};
+
+    TimedRing(const TimedRing &) = delete;
+    TimedRing &operator=(const TimedRing &) = delete;
+
+    void
+    push(const Time &ts, T item)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Entry &entry = entries[(head + count) % entries.size()];
+        if (count == entries.size())
+        {
+            head = (head + 1) % entries.size();
+        } else
+        {
+            ++count;
+        }
+        entry.ts   = ts;
+        entry.item = std::move(item);
+    };
+
+    /**
+     * Find the item stamped closest to a time, O(log n)
+     * @param ts time to match
+     * @param item filled with a copy of the nearest item
+     * @param item_ts filled with the time of the nearest item
+     * @return false if the history is empty
+     */
+    bool
+    nearest(const Time &ts, T &item, Time &item_ts)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (count == 0) return false;
+        const Entry &entry = at(misc::findNearestTimeStamp(ts, Times{*this}));
+        item    = entry.item;
+        item_ts = entry.ts;
+        return true;
+    };
+
+    void
+    clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &entry : entries) entry.item = T();
+        head  = 0;
+        count = 0;
+    };
+
+    size_t
+    size()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return count;
+    };
+
+    size_t
+    capacity() const
+    {
+        return entries.size();
+    };
+
+  private:
+    struct Entry
+    {
+        Time ts{};
+        T    item;
+    };
+
+    /// timestamps in stamped order, as seen by the search
+    struct Times
+    {
+        const TimedRing &ring;
+
+        size_t
+        size() const
+        {
+            return ring.count;
+        };
+
+        const Time &operator[](size_t i) const { return ring.at(i).ts; };
+    };
+
+    std::vector<Entry> entries;
+    size_t             head  = 0;
+    size_t             count = 0;
+    std::mutex         mutex;
+
+    const Entry &
+    at(size_t i) const
+    {
+        return entries[(head + i) % entries.size()];
+    };
+};
+};  // namespace buffers
+
+#endif  // COGDEVCAM_BUFFERS_H
@@ -11,22 +11,19 @@
 #define COGDEVCAM_COGDEVCAM_H
 
 #include "audio.h"
+#include "control.h"
 #include "imagegui.h"
+#include "metrics.h"
+#include "trace.h"
 #include "video.h"
 
-struct Image
-{
-    cv::Mat              img;
-    video::VideoTimeType ts = 0;
-    Image()                 = default;
-    Image(cv::Mat _img, video::VideoTimeType _ts)
-      : img(std::move(_img)), ts(_ts){};
-};
-
 class CogDevCam
 {
     timing::Clock<timing::unit_ms_flt> master_clock;
-    timing::Clock<timing::unit_ms_flt> display_clock;
+    timing::Periodic                   display_ticks;
+    timing::Periodic                   grab_ticks;
+    timing::Periodic                   sync_ticks;
+    timing::Periodic                   watchdog_ticks;
     imagegui::WinShow                  display_out;
     audio::Streams                     audio_stream;
     std::vector<video::IO>             video_streams;
@@ -35,61 +32,108 @@ class CogDevCam
     bool                               use_video;
 
   public:
-    using FutureImage = std::future<void>;
+    using CaptureWorker = std::unique_ptr<threads::Worker>;
 
     explicit CogDevCam(const opts::Pars &options)
       : program_opts(options),
         audio_stream(options),
         video_streams(
           std::move(video::factory::multiIO(options, master_clock))),
-        pause_threads(options.video.n_devices),
         record_mode(false)
     {
         n_devices = program_opts.video.n_devices;
         use_video = n_devices > 0;
         use_audio = audio_stream.use_audio;
 
-        display_fps   = program_opts.video.display_feed_fps;
-        auto img_wait = static_cast<timing::unit_ms_flt::rep>(
-          display_clock.getSecondsMultiplier() / display_fps);
-        double thresh = 1;
-        display_clock.setTimeout(img_wait, thresh);
+        display_fps = program_opts.video.display_feed_fps;
+        headless    = program_opts.basic.headless;
+        if (!program_opts.basic.control_socket.empty())
+        {
+            control_server.reset(new control::Server(
+              program_opts.basic.control_socket,
+              [this](const std::string &command) {
+                  return controlCommand(command);
+              }));
+        } else if (headless)
+        {
+            // nothing can start it later, so record from the beginning, a
+            // signal stops it, see misc::catchStopSignals()
+            headless_record = true;
+        }
+        if (program_opts.basic.metrics_sec > 0)
+        {
+            auto folder = program_opts.basic.root_save_folder + "/" +
+                          program_opts.basic.file_identifier;
+            auto prom_file = program_opts.basic.prom_file.empty() ?
+                               folder + "/metrics.prom" :
+                               program_opts.basic.prom_file;
+            metrics_out.reset(new metrics::Publisher(
+              folder + "/metrics.jsonl",
+              prom_file,
+              program_opts.basic.metrics_sec));
+        }
+        timing::sleep::setSpinTail(
+          timing::unit_us_int(program_opts.basic.spin_tail_us));
         if (program_opts.video.video_sync)
         {
-            video::VideoClock vid_clock;
-            auto              fps_dbl = static_cast<double>(
-              vid_clock.getSecondsMultiplier() /
-              program_opts.video.frames_per_second);
-
-            for (int v = 0; v < n_devices; ++v)
+            for (auto &device : video_streams)
             {
-                video_streams[v].timerSetTimeout(fps_dbl, .95);
+                device.keepHistory(sync_history);
             }
+            frame_sync.reset(new video::FrameSync(
+              video_streams,
+              program_opts.video.frames_per_second,
+              master_clock.getStartTime()));
         }
     };
 
     bool
     openDevices()
     {
+        // open everything at once, the slowest device sets the startup time
+        std::vector<std::pair<std::string, std::future<void>>> opening;
         if (use_video && !isVideoOpen())
         {
-            fillFutures(future_state);
-            for (int j = 0; j < n_devices; ++j)
+            for (auto &device : video_streams)
             {
-                video_streams[j].open(program_opts.video.n_open_attempts);
-                video_streams[j].timerTimedOut();
+                auto n_attempts = program_opts.video.n_open_attempts;
+                opening.emplace_back(
+                  device.getDeviceName(), threads::launch([&device, n_attempts]() {
+                      device.open(n_attempts);
+                      device.timerTimedOut();
+                  }));
             }
         }
 
         if (use_audio && !isAudioOpen())
         {
-            audio_stream.open(master_clock.getStartTime());
-            while (!audio_stream.isRunning())
-            {
-                timing::sleep::sec(0.01);
-            }
+            opening.emplace_back("audio", threads::launch([this]() {
+                timing::MilliClock open_clock;
+                audio_stream.open(master_clock.getStartTime());
+                while (!audio_stream.isRunning())
+                {
+                    if (open_clock.elapsed() > audio_start_timeout_ms)
+                    {
+                        throw err::Runtime("Audio stream did not start");
+                    }
+                    timing::sleep::sec(0.01);
+                }
+                audio_open_ms = static_cast<double>(open_clock.elapsed());
+            }));
         }
 
+        waitForOpen(opening);
+        for (auto &device : video_streams)
+        {
+            std::cout << "\nOpened " << device.getDeviceName() << " in "
+                      << device.getOpenTime() << " ms";
+        }
+        if (use_audio)
+        {
+            std::cout << "\nOpened audio in " << audio_open_ms << " ms";
+        }
+        std::cout << "\n";
+
         return isOpen();
     };
 
@@ -99,8 +143,18 @@ class CogDevCam
         record_mode = false;
         exit_task   = false;
 
+        TRACE_THREAD("main");
+        misc::catchStopSignals();
+        if (!program_opts.basic.trace_file.empty())
+        {
+            trace_session.start(program_opts.basic.trace_file);
+        }
         openDevices();
-        setDisplay();
+        if (!headless) setDisplay();
+        startCapture();
+        if (control_server) control_server->start();
+        if (metrics_out) metrics_out->start();
+        display_ticks.reset(timing::periodFromRate(display_fps));
 
         while (true)
         {
@@ -123,7 +177,7 @@ class CogDevCam
 
         while (true)
         {
-            if (display_out.isSliderSet())
+            if (recordSwitchOn())
             {
                 record_mode = true;
                 break;
@@ -152,10 +206,19 @@ class CogDevCam
             audio_stream.toggleSave(true, 0);
         }
         audio_capture_init = true;
+        if (program_opts.video.constant_rate)
+        {
+            // frames from before the pause should not be repeated across it
+            auto resume_ts = master_clock.elapsed();
+            for (auto &device : video_streams)
+            {
+                device.restartConstantRate(resume_ts);
+            }
+        }
 
         while (true)
         {
-            if (!display_out.isSliderSet())
+            if (!recordSwitchOn())
             {
                 record_mode = false;
                 break;
@@ -169,30 +232,168 @@ class CogDevCam
             displayImageInterrupt();
         }
     };
+    /**
+     * Wait for devices that are being opened. The first one to fail stops the
+     * rest, and the error names the device.
+     */
+    void
+    waitForOpen(std::vector<std::pair<std::string, std::future<void>>> &opening)
+    {
+        std::string failed;
+        size_t      n_done = 0;
+        while (n_done < opening.size())
+        {
+            n_done = 0;
+            for (auto &task : opening)
+            {
+                if (!task.second.valid())
+                {
+                    ++n_done;
+                    continue;
+                }
+                if (!futures::futureStatus(task.second)) continue;
+                try
+                {
+                    task.second.get();
+                } catch (const std::exception &error)
+                {
+                    if (failed.empty())
+                    {
+                        failed = task.first + ": " + error.what();
+                        for (auto &device : video_streams) device.cancelOpen();
+                    }
+                }
+            }
+            timing::sleep::thread(std::chrono::milliseconds(10));
+        }
+        if (!failed.empty())
+        {
+            throw err::Runtime("Could not open " + failed);
+        }
+    };
+
     bool
     breakRunProcess()
     {
-        bool key_pressed     = cv::waitKey(1) == exit_key;
+        bool key_pressed     = false;
         bool break_for_audio = false;
 
+        if (headless)
+        {
+            timing::sleep::thread(std::chrono::milliseconds(10));
+        } else
+        {
+            TRACE_SCOPE("display", "waitKey");
+            key_pressed = cv::waitKey(1) == exit_key;
+        }
+
         if (use_audio)
         {
             break_for_audio = !audio_stream.isRunning();
         }
 
-        return key_pressed || break_for_audio;
+        return key_pressed || quit_request || misc::stopRequested() ||
+               break_for_audio;
+    };
+
+    /// the REC trackbar, or the state set by control commands when headless
+    bool
+    recordSwitchOn()
+    {
+        int request = record_request.exchange(-1);
+        if (request >= 0)
+        {
+            if (headless)
+            {
+                headless_record = request == 1;
+                std::cout << (headless_record ? "\n...Recording started\n" :
+                                                "\n...Paused recording\n");
+            } else
+            {
+                display_out.setSlider(request == 1);
+            }
+        }
+        return headless ? headless_record : display_out.isSliderSet();
+    };
+
+    /// called on the control server's thread, see --ctl
+    std::string
+    controlCommand(const std::string &command)
+    {
+        if (command == "start")
+        {
+            record_request = 1;
+            return "ok recording";
+        }
+        if (command == "stop")
+        {
+            record_request = 0;
+            return "ok preview";
+        }
+        if (command == "quit")
+        {
+            quit_request = true;
+            return "ok quitting";
+        }
+        if (command == "status")
+        {
+            // elapsed() updates the clock, only read its start from here
+            auto elapsed =
+              std::chrono::duration_cast<std::chrono::milliseconds>(
+                timing::getPresent() - master_clock.getStartTime());
+            return std::string("ok ") +
+                   (record_mode ? "recording" : "preview") + " elapsed_ms=" +
+                   std::to_string(static_cast<int64_t>(elapsed.count())) +
+                   " devices=" + std::to_string(n_devices) +
+                   " audio=" + (use_audio ? "on" : "off");
+        }
+        return "error unknown command: " + command;
     };
 
     int
     closeAll()
     {
-        futureWait(future_state, true);
+        if (control_server) control_server->stop();
+        stopCapture();
         audio_stream.close();
         for (auto &vid : video_streams)
         {
             vid.close();
         }
-        display_out.closeWindow();
+        if (metrics_out) metrics_out->stop();
+        trace_session.stop();
+        for (size_t n = 0; n < video_streams.size(); ++n)
+        {
+            std::cout << "\n  - video_" << n << "_reconnects: "
+                      << video_streams[n].getReconnects()
+                      << "\n  - video_" << n << "_previews_overwritten: "
+                      << video_streams[n].getOverwritten()
+                      << "\n  - video_" << n << "_frame_pool_misses: "
+                      << video_streams[n].getPoolMisses();
+        }
+        if (frame_sync)
+        {
+            std::cout << "\n  - sync_sets_written: "
+                      << frame_sync->getSetsWritten()
+                      << "\n  - sync_sets_skipped: "
+                      << frame_sync->getSetsSkipped()
+                      << "\n  - sync_offset_ms_mean: "
+                      << frame_sync->getMeanOffset()
+                      << "\n  - sync_offset_ms_max: "
+                      << frame_sync->getMaxOffset();
+        }
+        printJitter("display", display_ticks);
+        if (frame_sync) printJitter("sync", sync_ticks);
+        if (program_opts.video.sync_grab) printJitter("grab", grab_ticks);
+        if (n_grab_sweeps > 0)
+        {
+            std::cout << "\n  - grab_sweep_ms_mean: "
+                      << grab_sweep_sum / n_grab_sweeps
+                      << "\n  - grab_sweep_ms_max: " << grab_sweep_max;
+        }
+        std::cout << "\n  - threads_created: " << threads::getCreated()
+                  << "\n";
+        if (!headless) display_out.closeWindow();
         for (auto &vid : video_streams)
         {
             // delete empty file
@@ -212,16 +413,45 @@ class CogDevCam
     };
 
   private:
-    std::vector<cv::Mat>          img_set;
-    std::vector<Image>            fill_buffer;
-    std::vector<FutureImage>      future_state;
-    std::vector<std::atomic_bool> pause_threads;
-    std::atomic_bool              record_mode;
-    bool                          audio_capture_init = false;
-    bool                          exit_task          = false;
-    int                           exit_key           = 27;
-    size_t                        n_devices          = 0;
-    size_t                        display_fps        = 30;
+    /// devices grabbed back to back at each tick, see --vgrab
+    struct Sweep
+    {
+        explicit Sweep(std::vector<size_t> _devices)
+          : devices(std::move(_devices)), barrier(devices.size() + 1){};
+
+        std::vector<size_t> devices;
+        threads::Barrier    barrier;
+        std::atomic_bool    dropped{false};
+    };
+
+    std::vector<cv::Mat>                img_set;
+    std::vector<uint64_t>               img_ids;
+    std::vector<video::FrameRef>        img_buffers;
+    std::vector<CaptureWorker>          capture_workers;
+    CaptureWorker                       grab_coordinator;
+    CaptureWorker                       sync_writer;
+    CaptureWorker                       watchdog;
+    std::unique_ptr<video::FrameSync>   frame_sync;
+    std::shared_ptr<Sweep>              grab_sweep;
+    std::atomic_bool                    record_mode;
+    std::atomic_int                     record_request{-1};
+    std::atomic_bool                    quit_request{false};
+    std::unique_ptr<control::Server>    control_server;
+    std::unique_ptr<metrics::Publisher> metrics_out;
+    trace::Session                      trace_session;
+    bool                                headless               = false;
+    bool                                headless_record        = false;
+    double                              grab_sweep_sum         = 0;
+    double                              grab_sweep_max         = 0;
+    uint64_t                            n_grab_sweeps          = 0;
+    bool                                audio_capture_init     = false;
+    size_t                              sync_history           = 16;
+    double                              audio_open_ms          = 0;
+    double                              audio_start_timeout_ms = 5000;
+    bool                                exit_task              = false;
+    int                                 exit_key               = 27;
+    size_t                              n_devices              = 0;
+    size_t                              display_fps            = 30;
 
     bool
     isOpen()
@@ -246,7 +476,7 @@ class CogDevCam
     };
 
     void
-    setDisplay(int ncols = -1, int nrows = -1, double rescale = -1)
+    setDisplay(int ncols = -1, int nrows = -1)
     {
         if (!display_out.isWindowOpen())
         {
@@ -255,9 +485,8 @@ class CogDevCam
 
         if (!use_video)
         {
-            ncols   = 1;
-            nrows   = 1;
-            rescale = 1;
+            ncols = 1;
+            nrows = 1;
         }
 
         if (!display_out.isDisplaySet())
@@ -268,8 +497,8 @@ class CogDevCam
             }
             if (ncols < 0) ncols = program_opts.video.display_feed_cols;
             if (nrows < 0) nrows = program_opts.video.display_feed_rows;
-            if (rescale < 0) rescale = program_opts.video.display_feed_scale;
-            display_out.videoDisplaySetup(img_set, ncols, nrows, rescale);
+            // capture threads already scale their previews, see setPreview
+            display_out.videoDisplaySetup(img_set, ncols, nrows, 1);
         }
     };
 
@@ -280,15 +509,13 @@ class CogDevCam
         {
             if (record_mode)
                 throw err::Runtime("Video devices already in use.");
-            futureWait(future_state, true);
-            fill_buffer.clear();
             img_set.clear();
             for (auto d = 0; d < n_devices; ++d)
             {
-                Image img(video_streams[d].readTemp(), 0);
-                display_out.colorizeMat(img.img);
-                fill_buffer.emplace_back(img);
-                img_set.push_back(img.img.clone());
+                // placeholder at the preview size until the first frame
+                cv::Mat img(video_streams[d].getPreviewSize(), CV_8UC3);
+                display_out.colorizeMat(img);
+                img_set.push_back(img);
             }
         } else
         {
@@ -297,79 +524,354 @@ class CogDevCam
             display_out.colorizeMat(mat);
             img_set.push_back(mat);
         }
+        img_ids.assign(img_set.size(), 0);
+        img_buffers.assign(img_set.size(), video::FrameRef());
     };
 
     void
     displayImageInterrupt()
     {
-        if (use_video && display_clock.timeout())
+        if (use_video && !headless && display_ticks.due())
         {
+            TRACE_SCOPE("display", "collect previews");
+            // capture loops keep running, only take the previews they made
+            video::Preview preview;
             for (size_t n = 0; n < n_devices; ++n)
             {
-                pause_threads[n] = true;
-                future_state[n].wait();
-                img_set[n] = fill_buffer[n].img.clone();
-                // img_set[n] = fill_buffer[n].img;
-                pause_threads[n] = false;
-                fillBuffer(n);
+                if (video_streams[n].popLatest(preview))
+                {
+                    // hold the pooled buffer so it is not reused while shown
+                    img_set[n]     = preview.img;
+                    img_buffers[n] = std::move(preview.buffer);
+                    ++img_ids[n];
+                }
             }
         }
     };
 
+    void
+    printJitter(const std::string &name, const timing::Periodic &ticks)
+    {
+        std::cout << "\n  - " << name
+                  << "_jitter_ms_mean: " << ticks.getMeanJitter() << "\n  - "
+                  << name << "_jitter_ms_max: " << ticks.getMaxJitter()
+                  << "\n  - " << name
+                  << "_deadlines_skipped: " << ticks.getSkipped();
+    };
+
     void
     showDisplayImages()
     {
-        if (!img_set.empty()) display_out.showImages(img_set);
+        if (headless || img_set.empty()) return;
+        display_out.showImages(img_set, img_ids);
+    };
+
+    void
+    startCapture()
+    {
+        if (!use_video) return;
+        bool sync_grab = program_opts.video.sync_grab;
+        auto tick      = timing::periodFromRate(
+          program_opts.video.frames_per_second);
+        grab_ticks.reset(tick);
+        sync_ticks.reset(tick, master_clock.getStartTime());
+        if (capture_workers.empty())
+        {
+            if (frame_sync)
+            {
+                sync_writer.reset(new threads::Worker(syncWriteTask()));
+            }
+            if (program_opts.video.watchdog_periods > 0)
+            {
+                watchdog.reset(new threads::Worker(watchdogTask()));
+            }
+            capture_workers.resize(n_devices);
+            if (sync_grab)
+            {
+                std::vector<size_t> all;
+                for (size_t n = 0; n < n_devices; ++n) all.push_back(n);
+                makeSweep(all);
+            } else
+            {
+                for (size_t n = 0; n < n_devices; ++n)
+                {
+                    capture_workers[n] = makeCaptureWorker(n, false);
+                }
+            }
+        }
+        for (auto &worker : capture_workers)
+        {
+            worker->start();
+        }
+        if (grab_coordinator) grab_coordinator->start();
+        if (sync_writer) sync_writer->start();
+        if (watchdog)
+        {
+            watchdog_ticks.reset(std::chrono::milliseconds(100));
+            watchdog->start();
+        }
+    };
+
+    void
+    stopCapture()
+    {
+        if (watchdog) watchdog->stop();
+        // a capture thread stuck in a driver call must not come back to a
+        // device that is being closed
+        for (auto &device : video_streams)
+        {
+            device.cutOffCapture();
+        }
+        dropSweep();
+        if (sync_writer) sync_writer->stop();
+        for (auto &worker : capture_workers)
+        {
+            letGo(worker);
+        }
+        capture_workers.clear();
+        sync_writer.reset();
+        watchdog.reset();
+    };
+
+    /// a capture loop for one device on its current connection
+    CaptureWorker
+    makeCaptureWorker(size_t index, bool in_sweep)
+    {
+        CaptureWorker worker(new threads::Worker(
+          in_sweep ? syncedCaptureTask(index) : captureTask(index)));
+        worker->setPlacement(video_streams[index].getCapturePlacement(),
+                             "capture " + video_streams[index].getDeviceName());
+        return worker;
     };
 
+    /// the coordinator and decode loops of a sweep over some devices
     void
-    fillBuffer(size_t index)
-    {
-        future_state[index] = std::async(
-          std::launch::async,
-          [](video::IO &             device,
-             Image &                 buff,
-             const std::atomic_bool &pause_for_update,
-             const std::atomic_bool &record_switch_on) {
-              while (!pause_for_update)
-              {
-                  // TODO: add buffer to video class and match with time for sync mode
-                  device.read();
-                  buff = Image(std::move(device.getLastImage()),
-                               device.getLastImageTime());
-                  if (record_switch_on && device.timerTimedOut())
-                  {
-                      device.write(buff.img, buff.ts);
-                  }
-              }
-          },
-          std::ref(video_streams[index]),
-          std::ref(fill_buffer[index]),
-          std::ref(pause_threads[index]),
-          std::ref(record_mode));
+    makeSweep(const std::vector<size_t> &devices)
+    {
+        if (devices.empty()) return;
+        grab_sweep = std::make_shared<Sweep>(devices);
+        grab_coordinator.reset(new threads::Worker(grabSweepTask()));
+        // the sweep paces every capture thread, schedule it like them
+        auto sweep_place = video::factory::getPlacement(
+          {},
+          0,
+          program_opts.basic.rt_policy,
+          program_opts.video.capture_priority);
+        grab_coordinator->setPlacement(sweep_place, "grab sweep");
+        for (auto n : devices)
+        {
+            capture_workers[n] = makeCaptureWorker(n, true);
+        }
     };
 
+    /// stop the sweep and its decode loops, leaving stuck threads behind
     void
-    fillFutures(std::vector<FutureImage> &_futures)
+    dropSweep()
     {
-        _futures.clear();
-        for (int j = 0; j < n_devices; ++j)
+        if (!grab_sweep) return;
+        grab_sweep->dropped = true;
+        grab_sweep->barrier.cancel();
+        letGo(grab_coordinator);
+        for (auto n : grab_sweep->devices)
         {
-            _futures.emplace_back(
-              futures::makeFutureValid<FutureImage, void>());
-            _futures[j].wait();
+            letGo(capture_workers[n]);
         }
+        grab_sweep.reset();
     };
 
+    bool
+    inSweep(size_t index) const
+    {
+        return grab_sweep && std::find(grab_sweep->devices.begin(),
+                                       grab_sweep->devices.end(),
+                                       index) != grab_sweep->devices.end();
+    };
+
+    /**
+     * Take a device that is being reconnected out of the sweep, so a grab
+     * stuck on it stops holding up the others. The sweep goes on without it
+     * and the device is captured on its own from then on.
+     */
     void
-    futureWait(std::vector<FutureImage> &_futures, bool pauseThread = false)
+    leaveSweep(size_t index)
     {
-        for (int f = 0; f < _futures.size(); ++f)
+        std::vector<size_t> rest;
+        for (auto n : grab_sweep->devices)
+        {
+            if (n != index) rest.push_back(n);
+        }
+        dropSweep();
+        makeSweep(rest);
+        for (auto n : rest)
         {
-            if (pauseThread) pause_threads[f] = true;
-            _futures[f].wait();
-            if (pauseThread) pause_threads[f] = false;
+            capture_workers[n]->start();
         }
+        if (grab_coordinator) grab_coordinator->start();
+    };
+
+    /// start a new capture loop on a device's new connection
+    void
+    restartCapture(size_t index)
+    {
+        letGo(capture_workers[index]);
+        capture_workers[index] = makeCaptureWorker(index, false);
+        capture_workers[index]->start();
+    };
+
+    /// stop a capture thread, or leave it behind if a driver call holds it
+    static void
+    letGo(CaptureWorker &worker)
+    {
+        if (!worker) return;
+        if (!worker->stopWithin(std::chrono::milliseconds(200)))
+        {
+            std::cerr << "A capture thread is stuck in the driver, left it\n";
+        }
+        worker.reset();
+    };
+
+    /**
+     * One iteration of the read/write loop, called repeatedly by a worker.
+     * The loop reads the connection the device had when it was made; once a
+     * reconnect retires it the loop is done and must not touch the device.
+     */
+    threads::Worker::Task
+    captureTask(size_t index)
+    {
+        video::IO &             device           = video_streams[index];
+        video::ConnectionRef    conn             = device.getConnection();
+        const std::atomic_bool &record_switch_on = record_mode;
+        bool                    write_frames     = !frame_sync;
+        std::string             label = "capture " + device.getDeviceName();
+        return [&device, conn, &record_switch_on, write_frames, label]() {
+            TRACE_THREAD(label);
+            if (!device.read(*conn))
+            {
+                // failing or cut off, leave it to the watchdog without spinning
+                timing::sleep::thread(std::chrono::milliseconds(5));
+                return;
+            }
+            if (!write_frames) return;
+            if (record_switch_on && device.timerTimedOut())
+            {
+                device.write();
+            }
+        };
+    };
+
+    /// decode the frame grabbed by the coordinator, in parallel with others
+    threads::Worker::Task
+    syncedCaptureTask(size_t index)
+    {
+        video::IO &             device           = video_streams[index];
+        video::ConnectionRef    conn             = device.getConnection();
+        std::shared_ptr<Sweep>  sweep            = grab_sweep;
+        const std::atomic_bool &record_switch_on = record_mode;
+        bool                    write_frames     = !frame_sync;
+        std::string             label = "capture " + device.getDeviceName();
+        return [&device, conn, sweep, &record_switch_on, write_frames,
+                label]() {
+            TRACE_THREAD(label);
+            if (!sweep->barrier.arriveAndWait()) return;
+            bool is_new = device.retrieve(*conn);
+            if (conn->retired) return;
+            if (!sweep->barrier.arriveAndWait()) return;
+            if (is_new && write_frames && record_switch_on) device.write();
+        };
+    };
+
+    /// reconnect devices that stopped giving frames, see --vwatchdog
+    threads::Worker::Task
+    watchdogTask()
+    {
+        std::vector<double> max_wait;
+        for (auto &device : video_streams)
+        {
+            double fps = device.getReaderProperties().fps;
+            if (fps <= 0) fps = program_opts.video.frames_per_second;
+            if (fps <= 0) fps = 30;
+            max_wait.push_back(program_opts.video.watchdog_periods * 1000 / fps);
+        }
+        return [this, max_wait]() {
+            watchdog_ticks.wait();
+            // a device stuck in the driver holds up the whole sweep, the
+            // others look stalled too but only that one is reconnected
+            bool sweep_held = false;
+            for (size_t n = 0; n < video_streams.size(); ++n)
+            {
+                if (inSweep(n) && video_streams[n].getCallTime() > max_wait[n])
+                {
+                    sweep_held = true;
+                }
+            }
+            for (size_t n = 0; n < video_streams.size(); ++n)
+            {
+                auto &device = video_streams[n];
+                bool  swept  = inSweep(n);
+                if (swept && sweep_held && device.getCallTime() <= max_wait[n])
+                {
+                    continue;
+                }
+                if (device.watch(max_wait[n]) && swept) leaveSweep(n);
+                if (device.takeReconnect()) restartCapture(n);
+            }
+        };
+    };
+
+    /// write matched frame sets at the common frame rate, see --vsync
+    threads::Worker::Task
+    syncWriteTask()
+    {
+        video::FrameSync &      sync             = *frame_sync;
+        timing::Periodic &      ticks            = sync_ticks;
+        const std::atomic_bool &record_switch_on = record_mode;
+        return [&sync, &ticks, &record_switch_on]() {
+            ticks.wait();
+            sync.update(record_switch_on);
+        };
+    };
+
+    /**
+     * At each tick grab every device back to back so the time between
+     * cameras is only the length of the sweep, then release the device
+     * workers to do the slow decode in parallel and wait for them.
+     */
+    threads::Worker::Task
+    grabSweepTask()
+    {
+        std::shared_ptr<Sweep>            sweep = grab_sweep;
+        std::vector<video::ConnectionRef> conns;
+        for (auto n : sweep->devices)
+        {
+            conns.push_back(video_streams[n].getConnection());
+        }
+        return [this, sweep, conns]() {
+            TRACE_THREAD("grab sweep");
+            grab_ticks.wait();
+            if (sweep->dropped) return;
+            {
+                TRACE_SCOPE("video", "grab sweep");
+                for (size_t k = 0; k < conns.size(); ++k)
+                {
+                    video_streams[sweep->devices[k]].grab(*conns[k]);
+                    // this thread may have been left behind in that grab
+                    if (sweep->dropped) return;
+                }
+            }
+            auto first = video_streams[sweep->devices.front()].getGrabTime();
+            auto last  = first;
+            for (auto n : sweep->devices)
+            {
+                first = std::min(first, video_streams[n].getGrabTime());
+                last  = std::max(last, video_streams[n].getGrabTime());
+            }
+            grab_sweep_sum += last - first;
+            grab_sweep_max = std::max(grab_sweep_max, last - first);
+            ++n_grab_sweeps;
+
+            if (!sweep->barrier.arriveAndWait()) return;
+            sweep->barrier.arriveAndWait();
+        };
     };
 };
 
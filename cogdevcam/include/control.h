@@ -0,0 +1,169 @@
+/**
+    project: cogdevcam
+    source file: control
+    description: local socket for starting and stopping recording remotely
+
+    @author Joseph M. Burling
+    @version 0.9.2 12/19/2017
+*/
+
+#ifndef COGDEVCAM_CONTROL_H
+#define COGDEVCAM_CONTROL_H
+
+#include "tools.h"
+#include <atomic>
+#include <cerrno>
+#include <functional>
+#include <memory>
+#include <string>
+#ifdef __unix__
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace control {
+
+/**
+ * Listens on a UNIX domain socket for one command per line and answers each
+ * with one line. Commands are handed to a handler on the server's own thread,
+ * so the handler must only set state that the main loop picks up.
+ * One client is served at a time.
+ *
+ *   $ echo start | nc -U /tmp/cogdevcam.sock
+ *   ok recording
+ */
+class Server
+{
+  public:
+    /// takes a command without its newline and returns the reply
+    using Handler = std::function<std::string(const std::string &)>;
+
+    Server(std::string _path, Handler _handler)
+      : path(std::move(_path)), handler(std::move(_handler)){};
+
+    Server(const Server &) = delete;
+    Server &operator=(const Server &) = delete;
+
+    ~Server()
+    {
+        stop();
+    };
+
+    /// bind the socket, replacing one left over from an earlier run
+    void
+    start()
+    {
+#ifdef __unix__
+        if (listen_fd >= 0) return;
+        sockaddr_un address{};
+        if (path.size() >= sizeof(address.sun_path))
+        {
+            throw err::Runtime("Control socket path is too long: " + path);
+        }
+        address.sun_family = AF_UNIX;
+        path.copy(address.sun_path, path.size());
+        ::unlink(path.c_str());
+
+        listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd < 0 ||
+            ::bind(listen_fd,
+                   reinterpret_cast<sockaddr *>(&address),
+                   sizeof(address)) != 0 ||
+            ::listen(listen_fd, 4) != 0)
+        {
+            std::string reason = std::strerror(errno);
+            closeSocket(listen_fd);
+            throw err::Runtime("Could not listen on control socket " + path +
+                               ": " + reason);
+        }
+        stopping = false;
+        worker.reset(new threads::Worker([this]() { serveOnce(); }));
+        worker->start();
+        std::cout << "\nListening for commands on " << path << "\n";
+#else
+        throw err::Runtime("Control sockets need a UNIX system");
+#endif
+    };
+
+    void
+    stop()
+    {
+#ifdef __unix__
+        stopping = true;
+        if (worker) worker->stop();
+        worker.reset();
+        if (listen_fd < 0) return;
+        closeSocket(listen_fd);
+        ::unlink(path.c_str());
+#endif
+    };
+
+  private:
+    std::string                      path;
+    Handler                          handler;
+    int                              listen_fd = -1;
+    std::atomic_bool                 stopping{false};
+    std::unique_ptr<threads::Worker> worker;
+    int                              poll_ms = 100;
+
+#ifdef __unix__
+    static void
+    closeSocket(int &fd)
+    {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+    };
+
+    /// true once fd has data, false on timeout
+    bool
+    waitReadable(int fd) const
+    {
+        pollfd ready{fd, POLLIN, 0};
+        return ::poll(&ready, 1, poll_ms) > 0;
+    };
+
+    /// wait a little for a client and serve it until it hangs up
+    void
+    serveOnce()
+    {
+        if (!waitReadable(listen_fd)) return;
+        int client = ::accept(listen_fd, nullptr, nullptr);
+        if (client < 0) return;
+        serveClient(client);
+        closeSocket(client);
+    };
+
+    void
+    serveClient(int client)
+    {
+        std::string pending;
+        char        chunk[256];
+        while (!stopping)
+        {
+            if (!waitReadable(client)) continue;
+            auto n_read = ::recv(client, chunk, sizeof(chunk), 0);
+            if (n_read <= 0) return;
+            pending.append(chunk, static_cast<size_t>(n_read));
+
+            size_t line_end;
+            while ((line_end = pending.find('\n')) != std::string::npos)
+            {
+                auto command = pending.substr(0, line_end);
+                pending.erase(0, line_end + 1);
+                if (!command.empty() && command.back() == '\r')
+                {
+                    command.pop_back();
+                }
+                if (command.empty()) continue;
+                auto reply = handler(command) + "\n";
+                ::send(client, reply.data(), reply.size(), MSG_NOSIGNAL);
+            }
+        }
+    };
+#endif
+};
+};  // namespace control
+
+#endif  // COGDEVCAM_CONTROL_H
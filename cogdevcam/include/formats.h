@@ -0,0 +1,189 @@
+/**
+    project: cogdevcam
+    source file: formats
+    description: compile time sample types of the RtAudio stream formats
+
+    @author Joseph M. Burling
+    @version 0.9.2 12/19/2017
+*/
+
+#ifndef COGDEVCAM_FORMATS_H
+#define COGDEVCAM_FORMATS_H
+
+#include "tools.h"
+#include <RtAudio.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+namespace audio {
+namespace traits {
+
+/// integer sample from a rounded value, S24 is packed so it's set by bytes
+template<typename T>
+T
+intSample(long value)
+{
+    return static_cast<T>(value);
+};
+
+template<>
+S24
+intSample<S24>(long value)
+{
+    S24 sample;
+    sample = static_cast<int>(value);
+    return sample;
+};
+
+template<typename T>
+long
+sampleInt(T sample)
+{
+    return static_cast<long>(sample);
+};
+
+long
+sampleInt(S24 sample)
+{
+    return sample.asInt();
+};
+
+/// signed integer samples, full scale is 2^(bits-1) - 1
+template<RtAudioFormat F, typename T, unsigned B>
+struct IntFormat
+{
+    using type     = T;
+    // float holds 24 bits exactly, wider samples are mixed in double
+    using mix_type = typename std::conditional<(B > 24), double, float>::type;
+    static constexpr RtAudioFormat format   = F;
+    static constexpr unsigned      bits     = B;
+    static constexpr size_t        size     = sizeof(T);
+    static constexpr double        scale    = (int64_t(1) << (B - 1)) - 1;
+    static constexpr bool          is_float = false;
+    static constexpr const char *  kind     = "sint";
+
+    /// sample for a value between -1 and 1, clipped outside that range
+    static type
+    fromUnit(double value)
+    {
+        value = std::max(-1.0, std::min(1.0, value));
+        return intSample<type>(std::lround(value * scale));
+    };
+
+    static double
+    toUnit(type sample)
+    {
+        return static_cast<double>(sampleInt(sample)) / scale;
+    };
+
+    /// write one sample to an unaligned byte buffer, little endian like RtAudio
+    static void
+    store(double value, char *dst)
+    {
+        auto sample = fromUnit(value);
+        std::memcpy(dst, &sample, size);
+    };
+};
+
+/// float samples between -1 and 1
+template<RtAudioFormat F, typename T>
+struct FloatFormat
+{
+    using type     = T;
+    using mix_type = T;
+    static constexpr RtAudioFormat format   = F;
+    static constexpr unsigned      bits     = 8 * sizeof(T);
+    static constexpr size_t        size     = sizeof(T);
+    static constexpr double        scale    = 1.0;
+    static constexpr bool          is_float = true;
+    static constexpr const char *  kind     = "float";
+
+    static type
+    fromUnit(double value)
+    {
+        return static_cast<type>(value);
+    };
+
+    static double
+    toUnit(type sample)
+    {
+        return static_cast<double>(sample);
+    };
+
+    static void
+    store(double value, char *dst)
+    {
+        auto sample = fromUnit(value);
+        std::memcpy(dst, &sample, size);
+    };
+};
+
+/**
+ * Sample type, size, and conversions of an RtAudioFormat, e.g.,
+ * Format<RTAUDIO_SINT16>::type is int16_t. Kernels templated on a format are
+ * compiled once per format, so they never branch on it.
+ */
+template<RtAudioFormat F>
+struct Format;
+
+template<>
+struct Format<RTAUDIO_SINT8> : IntFormat<RTAUDIO_SINT8, int8_t, 8>
+{
+};
+
+template<>
+struct Format<RTAUDIO_SINT16> : IntFormat<RTAUDIO_SINT16, int16_t, 16>
+{
+};
+
+template<>
+struct Format<RTAUDIO_SINT24> : IntFormat<RTAUDIO_SINT24, S24, 24>
+{
+};
+
+template<>
+struct Format<RTAUDIO_SINT32> : IntFormat<RTAUDIO_SINT32, int32_t, 32>
+{
+};
+
+template<>
+struct Format<RTAUDIO_FLOAT32> : FloatFormat<RTAUDIO_FLOAT32, float>
+{
+};
+
+template<>
+struct Format<RTAUDIO_FLOAT64> : FloatFormat<RTAUDIO_FLOAT64, double>
+{
+};
+
+/**
+ * Call func with the Format of a run time format, e.g.,
+ * dispatch(fmt, [](auto format) { return decltype(format)::size; })
+ * @param fmt one of the six RtAudioFormat values, not a combination
+ */
+template<typename Func>
+auto
+dispatch(RtAudioFormat fmt, Func &&func)
+  -> decltype(func(Format<RTAUDIO_SINT8>{}))
+{
+    switch (fmt)
+    {
+        case RTAUDIO_SINT8: return func(Format<RTAUDIO_SINT8>{});
+        case RTAUDIO_SINT16: return func(Format<RTAUDIO_SINT16>{});
+        case RTAUDIO_SINT24: return func(Format<RTAUDIO_SINT24>{});
+        case RTAUDIO_SINT32: return func(Format<RTAUDIO_SINT32>{});
+        case RTAUDIO_FLOAT32: return func(Format<RTAUDIO_FLOAT32>{});
+        case RTAUDIO_FLOAT64: return func(Format<RTAUDIO_FLOAT64>{});
+        default:
+            throw err::Runtime("Unknown RtAudioFormat (--abits): " +
+                               std::to_string(fmt));
+    }
+};
+};  // namespace traits
+};  // namespace audio
+
+#endif  // COGDEVCAM_FORMATS_H
@@ -11,6 +11,7 @@
 #define COGDEVCAM_IMAGEGUI_H
 
 #include "tools.h"
+#include "trace.h"
 #include <opencv2/opencv.hpp>
 #include <string>
 #include <vector>
@@ -33,6 +34,15 @@ class WinShow
         return slider_state == 1;
     };
 
+    /// move the REC trackbar, call from the thread that shows the window
+    void
+    setSlider(bool on)
+    {
+        if (!isWindowOpen()) return;
+        cv::setTrackbarPos("REC", window_name, on ? 1 : 0);
+        slider_state = on ? 1 : 0;
+    };
+
     bool
     isWindowOpen() const
     {
@@ -52,6 +62,9 @@ class WinShow
         slider_state = 0;
         window_open  = false;
         display_size = cv::Size();
+        tiles.clear();
+        tile_ids.clear();
+        canvas.release();
     };
 
     void
@@ -144,85 +157,108 @@ class WinShow
           static_cast<int>(std::ceil(img_height + m_rows)));
 
         display_layout = cv::Size(n_cols, m_rows);
+
+        // destination of each image, rows are as tall as their tallest image
+        // with a one pixel border around every tile
+        tiles.clear();
+        int y = 1;
+        for (int m = 0; m < m_rows; ++m)
+        {
+            int x = 1;
+            for (int n = 0; n < n_cols; ++n)
+            {
+                int w = static_cast<int>(tmp_widths.at<double>(m, n));
+                int h = static_cast<int>(tmp_heights.at<double>(m, n));
+                if (w < 1 || h < 1) continue;
+                tiles.emplace_back(x, y, w, h);
+                x += w + 1;
+            }
+            y += static_cast<int>(max_row[m]) + 1;
+        }
+        tile_ids.assign(tiles.size(), no_frame_id);
+        canvas = cv::Mat::zeros(display_size, CV_8UC3);
+
         std::cout << "\nDisplayed images frame dimensions:\n  Width="
                   << display_size.width << ", Height=" << display_size.height
                   << "\nGrid size:\n  Columns=" << display_layout.width
                   << ", Rows=" << display_layout.height << "\n";
     };
 
+    /**
+     * Draw every image into its tile and show the window
+     * @param image_vec images in the order given to videoDisplaySetup()
+     * @return the window contents without the recording badge, valid until
+     * the next call
+     */
     cv::Mat
     showImages(const std::vector<cv::Mat> &image_vec)
     {
+        return showImages(image_vec, {});
+    };
+
+    /**
+     * Draw only the tiles whose image changed and show the window
+     * @param image_vec images in the order given to videoDisplaySetup()
+     * @param frame_ids one id per image, a tile is redrawn when its id differs
+     * from the last call. Empty to redraw everything
+     * @return the window contents without the recording badge, valid until
+     * the next call
+     */
+    cv::Mat
+    showImages(const std::vector<cv::Mat> & image_vec,
+               const std::vector<uint64_t> &frame_ids)
+    {
+        TRACE_SCOPE("display", "showImages");
         if (!isWindowOpen()) initWindow();
+        composeImages(image_vec, frame_ids);
+
+        if (!isSliderSet())
+        {
+            cv::imshow(window_name, canvas);
+            return canvas;
+        }
+
+        // draw the overlay over a saved patch so the tile under it stays clean
+        cv::Rect badge = cv::Rect(0, 0, 64, 32) &
+                         cv::Rect(cv::Point(), display_size);
+        canvas(badge).copyTo(under_badge);
+        circle(canvas, cv::Point(15, 15), 14, cv::Scalar(0, 0, 255), -1, 8);
+        putText(canvas,
+                "REC",
+                cv::Point(30, 20),
+                cv::FONT_HERSHEY_SIMPLEX,
+                0.5,
+                cv::Scalar(255, 255, 255));
+        cv::imshow(window_name, canvas);
+        under_badge.copyTo(canvas(badge));
+        return canvas;
+    };
+
+    /**
+     * Draw the tiles whose image changed without touching the window, see
+     * showImages()
+     * @return the window contents, valid until the next call
+     */
+    cv::Mat
+    composeImages(const std::vector<cv::Mat> & image_vec,
+                  const std::vector<uint64_t> &frame_ids = {})
+    {
         if (display_size.empty()) throw err::Runtime("Display not set");
 
-        cv::Mat out_img = cv::Mat::zeros(
-          display_size.height, display_size.width, CV_8UC3);
-
-        auto n_images    = static_cast<int>(image_vec.size());
-        int  img_idx     = 0;
-        int  out_h_start = 1;
-        int  out_w_start;
-        int  out_h_end    = 0;
-        int  out_w_end    = 0;
-        bool no_more_imgs = false;
-        for (auto m = 0; m < display_layout.height; ++m)
+        auto n_tiles = std::min(image_vec.size(), tiles.size());
+        for (size_t t = 0; t < n_tiles; ++t)
         {
-            out_w_start = 1;
-            for (auto n = 0; n < display_layout.width; ++n, ++img_idx)
+            if (t < frame_ids.size())
             {
-                if (img_idx < n_images)
-                {
-                    cv::Mat in_img;
-                    if (display_scale == 1)
-                    {
-                        in_img = image_vec[img_idx];
-                    } else
-                    {
-                        cv::resize(image_vec[img_idx],
-                                   in_img,
-                                   cv::Size(),
-                                   display_scale,
-                                   display_scale,
-                                   cv::INTER_NEAREST);
-                    }
-
-                    cv::Size in_img_sz  = in_img.size();
-                    out_h_end           = out_h_start + (in_img_sz.height - 1);
-                    out_w_end           = out_w_start + (in_img_sz.width - 1);
-                    cv::Range in_roi_h  = cv::Range(0, in_img_sz.height - 1);
-                    cv::Range in_roi_w  = cv::Range(0, in_img_sz.width - 1);
-                    cv::Range out_roi_w = cv::Range(out_w_start, out_w_end);
-                    cv::Range out_roi_h = cv::Range(out_h_start, out_h_end);
-
-                    in_img(in_roi_h, in_roi_w)
-                      .copyTo(out_img(out_roi_h, out_roi_w));
-                } else
-                {
-                    no_more_imgs = true;
-                    break;
-                }
-                out_w_start = out_w_end + 2;
-            }
-            if (no_more_imgs)
+                if (frame_ids[t] == tile_ids[t]) continue;
+                tile_ids[t] = frame_ids[t];
+            } else
             {
-                break;
+                tile_ids[t] = no_frame_id;
             }
-            out_h_start = out_h_end + 2;
-        }
-        if (isSliderSet())
-        {
-            circle(
-              out_img, cv::Point(15, 15), 14, cv::Scalar(0, 0, 255), -1, 8);
-            putText(out_img,
-                    "REC",
-                    cv::Point(30, 20),
-                    cv::FONT_HERSHEY_SIMPLEX,
-                    0.5,
-                    cv::Scalar(255, 255, 255));
+            drawTile(image_vec[t], canvas(tiles[t]));
         }
-        cv::imshow(window_name, out_img);
-        return out_img;
+        return canvas;
     };
 
     void
@@ -247,6 +283,34 @@ class WinShow
     cv::Size    display_size;
     double      display_scale;
 
+    uint64_t              no_frame_id = ~uint64_t(0);
+    std::vector<cv::Rect> tiles;
+    std::vector<uint64_t> tile_ids;
+    cv::Mat               canvas;
+    cv::Mat               under_badge;
+
+    /// scale straight into the canvas, no intermediate image
+    static void
+    drawTile(const cv::Mat &img, cv::Mat tile)
+    {
+        if (img.empty()) return;
+        cv::Mat bgr = img;
+        if (img.type() == CV_8UC1)
+        {
+            cv::cvtColor(img, bgr, cv::COLOR_GRAY2BGR);
+        } else if (img.type() != CV_8UC3)
+        {
+            return;
+        }
+        if (bgr.size() == tile.size())
+        {
+            bgr.copyTo(tile);
+        } else
+        {
+            cv::resize(bgr, tile, tile.size(), 0, 0, cv::INTER_NEAREST);
+        }
+    };
+
     void
     initWindow(std::string name = "")
     {
@@ -0,0 +1,594 @@
+/**
+    project: cogdevcam
+    source file: metrics
+    description: live counters and histograms published while running
+
+    @author Joseph M. Burling
+    @version 0.9.2 12/19/2017
+*/
+
+#ifndef COGDEVCAM_METRICS_H
+#define COGDEVCAM_METRICS_H
+
+#include "tools.h"
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace metrics {
+
+/// only ever goes up, safe to add to from any thread
+class Counter
+{
+  public:
+    void
+    add(uint64_t n = 1)
+    {
+        value.fetch_add(n, std::memory_order_relaxed);
+    };
+
+    uint64_t
+    get() const
+    {
+        return value.load(std::memory_order_relaxed);
+    };
+
+  private:
+    std::atomic<uint64_t> value{0};
+};
+
+/// last value set, safe to set from any thread
+class Gauge
+{
+  public:
+    void
+    set(int64_t _value)
+    {
+        value.store(_value, std::memory_order_relaxed);
+    };
+
+    int64_t
+    get() const
+    {
+        return value.load(std::memory_order_relaxed);
+    };
+
+  private:
+    std::atomic<int64_t> value{0};
+};
+
+/**
+ * Log-linear histogram of non-negative integers, in the style of
+ * HdrHistogram. Each power of two is split into 8 buckets, so a value is
+ * known to within 1/8 of itself. Values below 8 are exact. record() is lock
+ * free and can be called from the audio callback.
+ */
+class Histogram
+{
+  public:
+    static constexpr int sub_bits  = 3;
+    static constexpr int n_sub     = 1 << sub_bits;
+    static constexpr int n_buckets = (64 - sub_bits + 1) * n_sub;
+
+    /// counts copied out of a histogram at one moment
+    struct Snapshot
+    {
+        std::vector<uint64_t> counts;
+        uint64_t              count  = 0;
+        uint64_t              sum    = 0;
+        double                sum_sq = 0;
+
+        /// what was recorded after an earlier snapshot of the same histogram
+        Snapshot
+        since(const Snapshot &earlier) const
+        {
+            Snapshot delta = *this;
+            if (earlier.counts.size() != counts.size()) return delta;
+            for (size_t i = 0; i < counts.size(); ++i)
+            {
+                delta.counts[i] -= earlier.counts[i];
+            }
+            delta.count -= earlier.count;
+            delta.sum -= earlier.sum;
+            delta.sum_sq -= earlier.sum_sq;
+            return delta;
+        };
+
+        double
+        mean() const
+        {
+            return count == 0 ? 0 : static_cast<double>(sum) / count;
+        };
+
+        double
+        stddev() const
+        {
+            if (count < 2) return 0;
+            double mu = mean();
+            return std::sqrt(std::max(0.0, sum_sq / count - mu * mu));
+        };
+
+        /**
+         * Value below which a fraction of the recorded values fall
+         * @param q fraction between 0 and 1, e.g., .99
+         * @return upper edge of the bucket holding that value
+         */
+        uint64_t
+        quantile(double q) const
+        {
+            if (count == 0) return 0;
+            auto     rank = static_cast<uint64_t>(std::ceil(q * count));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < counts.size(); ++i)
+            {
+                seen += counts[i];
+                if (seen >= std::max<uint64_t>(rank, 1))
+                {
+                    return upperEdge(static_cast<int>(i));
+                }
+            }
+            return upperEdge(n_buckets - 1);
+        };
+
+        uint64_t
+        max() const
+        {
+            for (size_t i = counts.size(); i > 0; --i)
+            {
+                if (counts[i - 1] > 0)
+                {
+                    return upperEdge(static_cast<int>(i - 1));
+                }
+            }
+            return 0;
+        };
+    };
+
+    Histogram()
+    {
+        for (auto &bucket : buckets) bucket.store(0, std::memory_order_relaxed);
+    };
+
+    void
+    record(uint64_t value)
+    {
+        buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(value, std::memory_order_relaxed);
+        squares.fetch_add(value * value, std::memory_order_relaxed);
+        n_values.fetch_add(1, std::memory_order_relaxed);
+    };
+
+    Snapshot
+    snapshot() const
+    {
+        Snapshot snap;
+        snap.counts.resize(n_buckets);
+        for (int i = 0; i < n_buckets; ++i)
+        {
+            snap.counts[i] = buckets[i].load(std::memory_order_relaxed);
+        }
+        snap.count  = n_values.load(std::memory_order_relaxed);
+        snap.sum    = total.load(std::memory_order_relaxed);
+        snap.sum_sq = static_cast<double>(
+          squares.load(std::memory_order_relaxed));
+        return snap;
+    };
+
+    static int
+    bucketOf(uint64_t value)
+    {
+        if (value < n_sub) return static_cast<int>(value);
+        int top = highestBit(value);
+        int sub = static_cast<int>((value >> (top - sub_bits)) & (n_sub - 1));
+        return (top - sub_bits + 1) * n_sub + sub;
+    };
+
+    /// largest value that lands in a bucket
+    static uint64_t
+    upperEdge(int bucket)
+    {
+        if (bucket < n_sub) return static_cast<uint64_t>(bucket);
+        int      shift = bucket / n_sub - 1;
+        uint64_t sub   = static_cast<uint64_t>(bucket % n_sub);
+        uint64_t lower = (n_sub + sub) << shift;
+        return lower + ((uint64_t(1) << shift) - 1);
+    };
+
+  private:
+    std::array<std::atomic<uint64_t>, n_buckets> buckets;
+    std::atomic<uint64_t>                        n_values{0};
+    std::atomic<uint64_t>                        total{0};
+    std::atomic<uint64_t>                        squares{0};
+
+    static int
+    highestBit(uint64_t value)
+    {
+        int bit = 0;
+        for (int step = 32; step > 0; step >>= 1)
+        {
+            if (value >> step)
+            {
+                value >>= step;
+                bit += step;
+            }
+        }
+        return bit;
+    };
+};
+
+/// whole microseconds from a time point until now
+uint64_t
+microsSince(const timing::TimePoint &start)
+{
+    auto us = std::chrono::duration_cast<timing::unit_us_int>(
+                timing::getPresent() - start)
+                .count();
+    return us < 0 ? 0 : static_cast<uint64_t>(us);
+};
+
+/// records how long a scope took, in microseconds, if given a histogram
+class ScopedTimer
+{
+  public:
+    explicit ScopedTimer(Histogram *_histogram)
+      : histogram(_histogram),
+        start(_histogram ? timing::getPresent() : timing::TimePoint()){};
+
+    ~ScopedTimer()
+    {
+        if (histogram) histogram->record(microsSince(start));
+    };
+
+  private:
+    Histogram *       histogram;
+    timing::TimePoint start;
+};
+
+/// label name and value pairs, e.g., {{"device", "usb00"}}
+using Labels = std::map<std::string, std::string>;
+
+/**
+ * Owns every metric by name and labels. Asking for the same name and labels
+ * twice returns the same metric. Registering takes a lock, updating a metric
+ * does not, so look metrics up once and keep the reference.
+ */
+class Registry
+{
+  public:
+    enum class Kind
+    {
+        COUNTER,
+        GAUGE,
+        HISTOGRAM
+    };
+
+    struct Entry
+    {
+        std::string                name;
+        std::string                help;
+        Labels                     labels;
+        Kind                       kind = Kind::COUNTER;
+        std::unique_ptr<Counter>   counter;
+        std::unique_ptr<Gauge>     gauge;
+        std::unique_ptr<Histogram> histogram;
+    };
+
+    Counter &
+    counter(const std::string &name,
+            const std::string &help,
+            const Labels &     labels = {})
+    {
+        return *find(name, help, labels, Kind::COUNTER).counter;
+    };
+
+    Gauge &
+    gauge(const std::string &name,
+          const std::string &help,
+          const Labels &     labels = {})
+    {
+        return *find(name, help, labels, Kind::GAUGE).gauge;
+    };
+
+    Histogram &
+    histogram(const std::string &name,
+              const std::string &help,
+              const Labels &     labels = {})
+    {
+        return *find(name, help, labels, Kind::HISTOGRAM).histogram;
+    };
+
+    /// call func for every entry, grouped by name
+    template<typename F>
+    void
+    forEach(F &&func)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &named : entries)
+        {
+            for (auto &entry : named.second) func(*entry);
+        }
+    };
+
+  private:
+    std::mutex mutex;
+    std::map<std::string, std::vector<std::unique_ptr<Entry>>> entries;
+
+    Entry &
+    find(const std::string &name,
+         const std::string &help,
+         const Labels &     labels,
+         Kind               kind)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &                      named = entries[name];
+        for (auto &entry : named)
+        {
+            if (entry->labels != labels) continue;
+            if (entry->kind != kind)
+            {
+                throw err::Runtime("Metric registered twice as different "
+                                   "kinds: " +
+                                   name);
+            }
+            return *entry;
+        }
+        named.emplace_back(new Entry());
+        auto &entry  = *named.back();
+        entry.name   = name;
+        entry.help   = help;
+        entry.labels = labels;
+        entry.kind   = kind;
+        switch (kind)
+        {
+            case Kind::COUNTER: entry.counter.reset(new Counter()); break;
+            case Kind::GAUGE: entry.gauge.reset(new Gauge()); break;
+            case Kind::HISTOGRAM: entry.histogram.reset(new Histogram()); break;
+        }
+        return entry;
+    };
+};
+
+/// registry the whole program records into
+Registry &
+registry()
+{
+    static Registry metrics_registry;
+    return metrics_registry;
+};
+
+/**
+ * Writes every metric in a registry at a fixed interval. Each write appends
+ * one JSON object per line with values and rates over the last interval, and
+ * replaces a Prometheus text file, e.g., for node_exporter's textfile
+ * collector. Histograms are in the units they were recorded in.
+ */
+class Publisher
+{
+  public:
+    /**
+     * @param _json_file JSON lines file to append to, empty to skip
+     * @param _prom_file Prometheus text file to replace, empty to skip
+     * @param interval_sec seconds between writes
+     */
+    Publisher(std::string _json_file,
+              std::string _prom_file,
+              double      interval_sec,
+              Registry &  _registry = registry())
+      : json_file(std::move(_json_file)),
+        prom_file(std::move(_prom_file)),
+        reg(_registry),
+        period(timing::periodFromRate(1.0 / interval_sec))
+    {
+        if (!json_file.empty()) json_out.open(json_file, std::ios::app);
+    };
+
+    Publisher(const Publisher &) = delete;
+    Publisher &operator=(const Publisher &) = delete;
+
+    ~Publisher()
+    {
+        stop();
+    };
+
+    void
+    start()
+    {
+        if (worker) return;
+        last_publish = timing::getPresent();
+        ticks.reset(period);
+        worker.reset(new threads::Worker([this]() {
+            ticks.wait();
+            publish();
+        }));
+        worker->start();
+        std::cout << "\nPublishing metrics to " << json_file << " and "
+                  << prom_file << "\n";
+    };
+
+    /// stop the thread and write the final values
+    void
+    stop()
+    {
+        if (!worker) return;
+        worker->stop();
+        worker.reset();
+        publish();
+    };
+
+    void
+    publish()
+    {
+        auto   now         = timing::getPresent();
+        double interval_ms = std::chrono::duration_cast<timing::unit_ms_flt>(
+                               now - last_publish)
+                               .count();
+        last_publish = now;
+        double per_sec = interval_ms > 0 ? 1000.0 / interval_ms : 0;
+
+        std::stringstream json;
+        std::stringstream prom;
+        std::string       last_name;
+        json << "{\"time_ms\":"
+             << std::chrono::duration_cast<timing::unit_ms_int>(
+                  now.time_since_epoch())
+                  .count()
+             << ",\"interval_ms\":" << interval_ms << ",\"metrics\":[";
+        bool first = true;
+
+        reg.forEach([&](const Registry::Entry &entry) {
+            auto key = entry.name + labelText(entry.labels);
+            if (!first) json << ",";
+            first = false;
+            json << "{\"name\":\"" << entry.name << "\",\"labels\":{";
+            bool first_label = true;
+            for (auto &label : entry.labels)
+            {
+                if (!first_label) json << ",";
+                first_label = false;
+                json << "\"" << label.first << "\":\"" << label.second << "\"";
+            }
+            json << "}";
+
+            if (entry.name != last_name)
+            {
+                prom << "# HELP " << entry.name << " " << entry.help << "\n"
+                     << "# TYPE " << entry.name << " "
+                     << kindName(entry.kind) << "\n";
+                last_name = entry.name;
+            }
+
+            switch (entry.kind)
+            {
+                case Registry::Kind::COUNTER:
+                {
+                    auto value = entry.counter->get();
+                    auto rate  = (value - last_counts[key]) * per_sec;
+                    last_counts[key] = value;
+                    json << ",\"value\":" << value << ",\"rate\":" << rate;
+                    prom << key << " " << value << "\n";
+                    break;
+                }
+                case Registry::Kind::GAUGE:
+                {
+                    auto value = entry.gauge->get();
+                    json << ",\"value\":" << value;
+                    prom << key << " " << value << "\n";
+                    break;
+                }
+                case Registry::Kind::HISTOGRAM:
+                {
+                    auto snap     = entry.histogram->snapshot();
+                    auto interval = snap.since(last_snapshots[key]);
+                    last_snapshots[key] = snap;
+                    json << ",\"count\":" << snap.count
+                         << ",\"rate\":" << interval.count * per_sec
+                         << ",\"mean\":" << interval.mean()
+                         << ",\"stddev\":" << interval.stddev()
+                         << ",\"p50\":" << interval.quantile(.5)
+                         << ",\"p99\":" << interval.quantile(.99)
+                         << ",\"max\":" << interval.max();
+                    writePromHistogram(prom, entry, snap);
+                    break;
+                }
+            }
+            json << "}";
+        });
+        json << "]}\n";
+
+        if (json_out.is_open())
+        {
+            json_out << json.str() << std::flush;
+        }
+        if (!prom_file.empty())
+        {
+            // replace in one step so a collector never reads half a file
+            auto tmp_file = prom_file + ".tmp";
+            {
+                std::ofstream out(tmp_file, std::ios::trunc);
+                out << prom.str();
+            }
+            std::rename(tmp_file.c_str(), prom_file.c_str());
+        }
+    };
+
+  private:
+    std::string                                  json_file;
+    std::string                                  prom_file;
+    Registry &                                   reg;
+    std::ofstream                                json_out;
+    timing::Duration                             period;
+    timing::Periodic                             ticks;
+    timing::TimePoint                            last_publish;
+    std::map<std::string, uint64_t>              last_counts;
+    std::map<std::string, Histogram::Snapshot>   last_snapshots;
+    std::unique_ptr<threads::Worker>             worker;
+
+    static const char *
+    kindName(Registry::Kind kind)
+    {
+        switch (kind)
+        {
+            case Registry::Kind::COUNTER: return "counter";
+            case Registry::Kind::GAUGE: return "gauge";
+            default: return "histogram";
+        }
+    };
+
+    static std::string
+    labelText(const Labels &labels, const std::string &extra = "")
+    {
+        if (labels.empty() && extra.empty()) return "";
+        std::string text = "{";
+        for (auto &label : labels)
+        {
+            if (text.size() > 1) text += ",";
+            text += label.first + "=\"" + label.second + "\"";
+        }
+        if (!extra.empty())
+        {
+            if (text.size() > 1) text += ",";
+            text += extra;
+        }
+        return text + "}";
+    };
+
+    /// cumulative buckets at each power of two, up to the largest value seen
+    static void
+    writePromHistogram(std::stringstream &              prom,
+                       const Registry::Entry &          entry,
+                       const Histogram::Snapshot &snap)
+    {
+        uint64_t cumulative = 0;
+        auto     top        = Histogram::bucketOf(snap.max());
+        for (int i = 0; i < Histogram::n_buckets; ++i)
+        {
+            cumulative += snap.counts[i];
+            bool power_edge = i % Histogram::n_sub == Histogram::n_sub - 1;
+            if (!power_edge || i > top + Histogram::n_sub) continue;
+            prom << entry.name << "_bucket"
+                 << labelText(entry.labels,
+                              "le=\"" +
+                                std::to_string(Histogram::upperEdge(i)) + "\"")
+                 << " " << cumulative << "\n";
+        }
+        prom << entry.name << "_bucket"
+             << labelText(entry.labels, "le=\"+Inf\"") << " " << snap.count
+             << "\n"
+             << entry.name << "_sum" << labelText(entry.labels) << " "
+             << snap.sum << "\n"
+             << entry.name << "_count" << labelText(entry.labels) << " "
+             << snap.count << "\n";
+    };
+};
+};  // namespace metrics
+
+#endif  // COGDEVCAM_METRICS_H
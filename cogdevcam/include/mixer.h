@@ -0,0 +1,389 @@
+/**
+    project: cogdevcam
+    source file: mixer
+    description: map audio input channels onto output channels
+
+    @author Joseph M. Burling
+    @version 0.9.2 12/19/2017
+*/
+
+#ifndef COGDEVCAM_MIXER_H
+#define COGDEVCAM_MIXER_H
+
+#include "formats.h"
+#include "tools.h"
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace audio {
+namespace mix {
+
+/// one input channel of an output channel
+struct Term
+{
+    unsigned input = 0;
+    double   gain  = 1;
+};
+
+/**
+ * The gains from each input channel to each output channel of PLAYBACK mode.
+ * Everything is worked out when the stream opens; apply() only reads the
+ * matrix and its scratch buffers, so it never allocates or throws.
+ *
+ * Three kernels, the cheapest that fits:
+ *  - copy, same channels in and out, no gains
+ *  - route, each output is one input or silent, samples are copied as is,
+ *    e.g., mono fan-out or a subset of channels
+ *  - mix, anything with gains or sums, e.g., downmix. Used inputs are
+ *    converted to planes of the format's mix_type, float up to 24 bits or
+ *    double for 32 bit integers and 64 bit floats. Each output is summed
+ *    plane by plane, which vectorizes, then converted back into the
+ *    interleaved output.
+ */
+class Matrix
+{
+  public:
+    Matrix() = default;
+
+    /**
+     * Build the matrix, call before the stream starts
+     * @param spec --amap value, empty for the default mapping
+     * @param _n_in input channels
+     * @param _n_out output channels
+     * @param fmt stream format apply() is called with
+     */
+    void
+    set(const std::string &spec,
+        unsigned           _n_in,
+        unsigned           _n_out,
+        RtAudioFormat      fmt)
+    {
+        format = fmt;
+        n_in  = _n_in;
+        n_out = _n_out;
+        rows.assign(n_out, {});
+        if (spec.empty())
+        {
+            setDefault();
+        } else
+        {
+            parse(spec);
+        }
+        setKind();
+        reserve(block);
+    };
+
+    /**
+     * Room for mixing buffers of up to n_frames at once, larger buffers are
+     * mixed in pieces. Only the scratch of the stream format's mix_type is
+     * allocated.
+     */
+    void
+    reserve(size_t n_frames)
+    {
+        block          = std::max<size_t>(n_frames, 1);
+        float_scratch  = {};
+        double_scratch = {};
+        if (kind != Kind::MIX) return;
+        traits::dispatch(format, [this](auto fmt) {
+            using mix_t = typename decltype(fmt)::mix_type;
+            auto &buffers = scratch(mix_t());
+            buffers.planes.assign(n_in * block, 0);
+            buffers.sum.assign(block, 0);
+        });
+    };
+
+    /**
+     * Fill n_frames of interleaved output from interleaved input
+     * @tparam F stream format of both buffers
+     * @param in input buffer, or nullptr for silence
+     */
+    template<RtAudioFormat F>
+    void
+    apply(const typename traits::Format<F>::type *in,
+          typename traits::Format<F>::type *      out,
+          size_t                                  n_frames) const
+    {
+        auto silent = traits::Format<F>::fromUnit(0);
+        if (in == nullptr || n_in == 0)
+        {
+            std::fill_n(out, n_frames * n_out, silent);
+            return;
+        }
+        switch (kind)
+        {
+            case Kind::COPY: std::copy_n(in, n_frames * n_in, out); break;
+            case Kind::ROUTE: applyRoute<F>(in, out, n_frames, silent); break;
+            case Kind::MIX:
+                for (size_t done = 0; done < n_frames; done += block)
+                {
+                    auto n = std::min(block, n_frames - done);
+                    applyMix<F>(in + done * n_in, out + done * n_out, n);
+                }
+                break;
+        }
+    };
+
+    /// the matrix in --amap syntax
+    std::string
+    describe() const
+    {
+        std::ostringstream text;
+        for (unsigned o = 0; o < n_out; ++o)
+        {
+            if (o > 0) text << ",";
+            if (rows[o].empty()) text << "-";
+            for (size_t t = 0; t < rows[o].size(); ++t)
+            {
+                if (t > 0) text << "+";
+                text << rows[o][t].input;
+                if (rows[o][t].gain != 1) text << "*" << rows[o][t].gain;
+            }
+        }
+        return text.str();
+    };
+
+    unsigned
+    inputs() const
+    {
+        return n_in;
+    };
+
+    unsigned
+    outputs() const
+    {
+        return n_out;
+    };
+
+  private:
+    enum class Kind
+    {
+        COPY,
+        ROUTE,
+        MIX
+    };
+
+    /// one plane per input channel and the output being summed
+    template<typename T>
+    struct Scratch
+    {
+        std::vector<T> planes;
+        std::vector<T> sum;
+    };
+
+    Kind                           kind   = Kind::COPY;
+    RtAudioFormat                  format = RTAUDIO_FLOAT32;
+    unsigned                       n_in   = 0;
+    unsigned                       n_out  = 0;
+    size_t                         block  = 1024;
+    std::vector<std::vector<Term>> rows;
+    std::vector<int>               route;
+    std::vector<bool>              used;
+    // scratch for the mix kernel, mutable so apply() can stay const
+    mutable Scratch<float>  float_scratch;
+    mutable Scratch<double> double_scratch;
+
+    Scratch<float> &
+    scratch(float) const
+    {
+        return float_scratch;
+    };
+
+    Scratch<double> &
+    scratch(double) const
+    {
+        return double_scratch;
+    };
+
+    /**
+     * Fewer outputs than inputs: output o is the average of inputs o,
+     * o + n_out, ..., so 2 to 1 is a mono downmix. More outputs than inputs:
+     * output o repeats input o % n_in, so 1 to 2 is a mono fan-out.
+     */
+    void
+    setDefault()
+    {
+        if (n_in == 0) return;
+        for (unsigned o = 0; o < n_out; ++o)
+        {
+            if (n_in <= n_out)
+            {
+                rows[o].push_back({o % n_in, 1});
+                continue;
+            }
+            for (unsigned i = o; i < n_in; i += n_out)
+            {
+                rows[o].push_back({i, 1});
+            }
+            for (auto &term : rows[o]) term.gain = 1.0 / rows[o].size();
+        }
+    };
+
+    /**
+     * One entry per output channel separated by commas. An entry is an input
+     * channel, inputs joined by +, which are averaged, or - for silence. An
+     * input followed by *GAIN uses that gain instead, e.g., 0*0.7+1*0.7
+     */
+    void
+    parse(const std::string &spec)
+    {
+        auto entries = split(spec, ',');
+        if (entries.size() != n_out)
+        {
+            throw err::Runtime("--amap has " + std::to_string(entries.size()) +
+                               " entries, the output has " +
+                               std::to_string(n_out) + " channels");
+        }
+        for (unsigned o = 0; o < n_out; ++o)
+        {
+            if (entries[o] == "-") continue;
+            auto terms = split(entries[o], '+');
+            for (const auto &text : terms)
+            {
+                rows[o].push_back(parseTerm(text, 1.0 / terms.size()));
+            }
+        }
+    };
+
+    /// split on sep, dropping spaces, keeping empty parts
+    static std::vector<std::string>
+    split(const std::string &text, char sep)
+    {
+        std::vector<std::string> parts(1);
+        for (auto c : text)
+        {
+            if (c == sep)
+            {
+                parts.emplace_back();
+            } else if (c != ' ')
+            {
+                parts.back() += c;
+            }
+        }
+        return parts;
+    };
+
+    Term
+    parseTerm(const std::string &text, double average)
+    {
+        Term term;
+        auto star = text.find('*');
+        try
+        {
+            size_t end   = 0;
+            auto   index = text.substr(0, star);
+            if (index.empty() ||
+                index.find_first_not_of("0123456789") != std::string::npos)
+            {
+                throw std::invalid_argument(index);
+            }
+            term.input = static_cast<unsigned>(std::stoul(index));
+            term.gain  = star == std::string::npos ?
+                          average :
+                          std::stod(text.substr(star + 1), &end);
+            if (star != std::string::npos && end != text.size() - star - 1)
+            {
+                throw std::invalid_argument(text);
+            }
+        } catch (const std::logic_error &)
+        {
+            throw err::Runtime("--amap: cannot read \"" + text +
+                               "\", expected INPUT or INPUT*GAIN");
+        }
+        if (term.input >= n_in)
+        {
+            throw err::Runtime("--amap: input channel " +
+                               std::to_string(term.input) +
+                               " does not exist, the input has " +
+                               std::to_string(n_in) + " channels");
+        }
+        if (!std::isfinite(term.gain))
+        {
+            throw err::Runtime("--amap: gain of \"" + text +
+                               "\" is not finite");
+        }
+        return term;
+    };
+
+    void
+    setKind()
+    {
+        bool is_route = true;
+        bool is_copy  = n_in == n_out;
+        route.assign(n_out, -1);
+        used.assign(n_in, false);
+        for (unsigned o = 0; o < n_out; ++o)
+        {
+            for (const auto &term : rows[o]) used[term.input] = true;
+            if (rows[o].size() > 1 ||
+                (rows[o].size() == 1 && rows[o][0].gain != 1))
+            {
+                is_route = false;
+            } else if (rows[o].size() == 1)
+            {
+                route[o] = static_cast<int>(rows[o][0].input);
+            }
+            if (route[o] != static_cast<int>(o)) is_copy = false;
+        }
+        kind = !is_route ? Kind::MIX : is_copy ? Kind::COPY : Kind::ROUTE;
+    };
+
+    template<RtAudioFormat F>
+    void
+    applyRoute(const typename traits::Format<F>::type *in,
+               typename traits::Format<F>::type *      out,
+               size_t                                  n_frames,
+               typename traits::Format<F>::type        silent) const
+    {
+        for (size_t f = 0; f < n_frames; ++f, in += n_in)
+        {
+            for (unsigned o = 0; o < n_out; ++o)
+            {
+                *out++ = route[o] < 0 ? silent : in[route[o]];
+            }
+        }
+    };
+
+    template<RtAudioFormat F>
+    void
+    applyMix(const typename traits::Format<F>::type *in,
+             typename traits::Format<F>::type *      out,
+             size_t                                  n_frames) const
+    {
+        using format  = traits::Format<F>;
+        using mix_t   = typename format::mix_type;
+        auto &buffers = scratch(mix_t());
+        for (unsigned i = 0; i < n_in; ++i)
+        {
+            if (!used[i]) continue;
+            mix_t *plane = &buffers.planes[i * block];
+            for (size_t f = 0; f < n_frames; ++f)
+            {
+                plane[f] = static_cast<mix_t>(format::toUnit(in[f * n_in + i]));
+            }
+        }
+        mix_t *acc = buffers.sum.data();
+        for (unsigned o = 0; o < n_out; ++o)
+        {
+            std::fill_n(acc, n_frames, mix_t(0));
+            for (const auto &term : rows[o])
+            {
+                const mix_t *plane = &buffers.planes[term.input * block];
+                const mix_t  gain  = static_cast<mix_t>(term.gain);
+                for (size_t f = 0; f < n_frames; ++f) acc[f] += gain * plane[f];
+            }
+            for (size_t f = 0; f < n_frames; ++f)
+            {
+                out[f * n_out + o] = format::fromUnit(acc[f]);
+            }
+        }
+    };
+};
+};  // namespace mix
+};  // namespace audio
+
+#endif  // COGDEVCAM_MIXER_H
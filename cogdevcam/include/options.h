@@ -167,6 +167,13 @@ struct General
     std::string file_identifier  = "";
     std::string root_save_folder = ".";
     bool        verbose          = false;
+    unsigned    spin_tail_us     = 200;
+    std::string rt_policy        = "other";
+    bool        headless         = false;
+    std::string control_socket   = "";
+    double      metrics_sec      = 0;
+    std::string prom_file        = "";
+    std::string trace_file       = "";
 };
 /// Contains user defined audio options and defaults
 struct Audio
@@ -192,11 +199,24 @@ struct Audio
     unsigned    pulse_width         = 1;
     double      record_duration_sec = 0;
     bool        save_playback       = false;
+    int         callback_core       = -1;
+    int         callback_priority   = 0;
+    std::string channel_map         = "";
+    std::string sim_input           = "sine:1000";
+    double      sim_jitter_ms       = 0;
+    double      sim_xrun_rate       = 0;
+    unsigned    sim_seed            = 1;
 };
 /// Contains user defined video options and defaults
 struct Video
 {
     bool                     video_sync          = false;
+    bool                     sync_grab           = false;
+    bool                     constant_rate       = false;
+    bool                     passthrough         = false;
+    unsigned                 watchdog_periods    = 30;
+    int                      capture_priority    = 0;
+    int                      encode_priority     = 0;
     size_t                   n_usb               = 0;
     size_t                   n_url               = 0;
     size_t                   n_devices           = 0;
@@ -205,12 +225,18 @@ struct Video
     std::string              video_container_ext = ".avi";
     double                   frames_per_second   = 30;
     size_t                   display_feed_fps    = 12;
+    size_t                   writer_queue_depth  = 32;
+    std::string              writer_queue_policy = "block";
     std::string              display_feed_name   = "VIDEO_FEED";
     double                   display_feed_scale  = 0.5;
     unsigned int             display_feed_rows   = 0;
     unsigned int             display_feed_cols   = 0;
     std::vector<int>         device_ids;
     std::vector<std::string> ip_urls;
+    std::vector<std::string> synth_specs;
+    std::vector<std::string> replay_specs;
+    std::vector<int>         capture_cores;
+    std::vector<int>         encode_cores;
     std::vector<double>      set_capture_fps;
     std::vector<int>         set_capture_height;
     std::vector<int>         set_capture_width;
@@ -400,6 +426,70 @@ class GeneralParser : virtual public OptionsBase
           "print additional information to command line interface\n"
           "\n\n  e.g., --verbose or -v\n",
           "v");
+        helper::newDefaultOption<unsigned>(
+          general.help,
+          "spin",
+          general.store.spin_tail_us,
+          "SLEEP SPIN TAIL: "
+          "Microseconds at the end of each timed wait spent spinning instead "
+          "of sleeping. Larger values wake closer to the deadline, smaller "
+          "values use less CPU."
+          "\n\n  e.g., --spin=200\n");
+        helper::newDefaultOption<std::string>(
+          general.help,
+          "rtpolicy",
+          general.store.rt_policy,
+          "THREAD SCHEDULING POLICY: "
+          "Scheduling for capture and encoder threads, one of other, fifo, or "
+          "rr. fifo and rr use the priorities from --vprio and --veprio and "
+          "usually need CAP_SYS_NICE or an rtprio limit. Linux only."
+          "\n\n  e.g., --rtpolicy=fifo\n");
+        helper::newBoolOption(
+          general.help,
+          "headless",
+          general.store.headless,
+          "HEADLESS MODE: "
+          "Run without the preview window. Recording is started and stopped "
+          "through --ctl, or starts right away if no control socket is given. "
+          "Ctrl+C or SIGTERM stops the session and closes its files."
+          "\n\n  e.g., --headless\n");
+        helper::newDefaultOption<std::string>(
+          general.help,
+          "ctl",
+          general.store.control_socket,
+          "CONTROL SOCKET: "
+          "Path of a UNIX domain socket that takes one command per line: "
+          "start, stop, status, or quit. Works with or without the window."
+          "\n\n  e.g., --ctl=/tmp/cogdevcam.sock\n");
+        helper::newDefaultOption<double>(
+          general.help,
+          "metrics",
+          general.store.metrics_sec,
+          "METRICS INTERVAL: "
+          "Seconds between writes of live frame rates, drops, and timing "
+          "histograms for each device and the audio callback. Written as JSON "
+          "lines to metrics.jsonl in the save folder and as a Prometheus text "
+          "file. 0 turns it off."
+          "\n\n  e.g., --metrics=5\n");
+        helper::newDefaultOption<std::string>(
+          general.help,
+          "promfile",
+          general.store.prom_file,
+          "PROMETHEUS FILE: "
+          "Where to write the Prometheus text file for --metrics, e.g., a "
+          "node_exporter textfile directory. Defaults to metrics.prom in the "
+          "save folder."
+          "\n\n  e.g., --promfile=/var/lib/node_exporter/cogdevcam.prom\n");
+        helper::newDefaultOption<std::string>(
+          general.help,
+          "trace",
+          general.store.trace_file,
+          "TRACE FILE: "
+          "Record when grab, retrieve, encode, display, and audio callback "
+          "work starts and ends on each thread, as a Chrome trace file for "
+          "chrome://tracing or ui.perfetto.dev. Needs a build with "
+          "-DWITH_TRACE=ON."
+          "\n\n  e.g., --trace=session_trace.json\n");
     };
 
     void
@@ -409,6 +499,12 @@ class GeneralParser : virtual public OptionsBase
         {
             general.store.file_identifier = misc::filePrefix();
         }
+        if (!misc::is_member<std::string>(general.store.rt_policy,
+                                          {"other", "fifo", "rr"}))
+        {
+            throw err::Runtime("Thread scheduling policy must be one of: "
+                               "other, fifo, rr");
+        }
         std::string parent;
         std::string stem;
         std::tie(parent, stem) = misc::makeDirectory(
@@ -463,7 +559,8 @@ class AudioParser : virtual public OptionsBase
           "  6=The Microsoft WASAPI API.\n"
           "  7=The Steinberg Audio stream I/O API.\n"
           "  8=The Microsoft Direct Sound API.\n"
-          "  9=A compilable but non-functional API.\n");
+          "  9=A compilable but non-functional API.\n"
+          " 10=Simulated device driven by a timer thread, see --asim*.\n");
         helper::newDefaultOption<unsigned>(
           audio.help,
           "abuffer",
@@ -495,6 +592,22 @@ class AudioParser : virtual public OptionsBase
           "AUDIO STREAM OPEN DURATION: "
           "Open the audio stream for x amount of seconds only"
           "\n\n  e.g., --aforsec=5\n");
+        helper::newDefaultOption<int>(
+          audio.help,
+          "acore",
+          audio.store.callback_core,
+          "AUDIO CALLBACK CORE: "
+          "Pin the audio callback thread to this core. -1 lets the OS choose."
+          "\n\n  e.g., --acore=7\n");
+        helper::newDefaultOption<int>(
+          audio.help,
+          "aprio",
+          audio.store.callback_priority,
+          "AUDIO CALLBACK PRIORITY: "
+          "Ask the audio API to run its callback thread with real-time "
+          "scheduling at this priority, by setting the flag "
+          "RTAUDIO_SCHEDULE_REALTIME. 0 leaves the default scheduling."
+          "\n\n  e.g., --aprio=90\n");
         helper::newBoolOption(audio.help,
                               "ahog",
                               audio.store.hog_device,
@@ -607,6 +720,52 @@ class AudioParser : virtual public OptionsBase
                               "AUDIO PLAYBACK WAV: "
                               "Save the playback output buffer to a wav file."
                               "\n\n  e.g., --aplaywav");
+        helper::newDefaultOption<std::string>(
+          audio.help,
+          "amap",
+          audio.store.channel_map,
+          "AUDIO CHANNEL MAP: "
+          "Input channels played on each output channel when --aomode=input, "
+          "one comma separated entry per output channel. Inputs joined by + "
+          "are averaged, INPUT*GAIN sets the gain, and - is silence. Without "
+          "it, channels are copied when the counts match, the input is "
+          "repeated across extra outputs, and extra inputs are averaged into "
+          "the outputs."
+          "\n\n  e.g., --amap=0,0 --amap=0+1 --amap=1,- --amap=0*0.5+1*0.5\n");
+
+        // simulated device, --aapi=10
+        helper::newDefaultOption<std::string>(
+          audio.help,
+          "asimin",
+          audio.store.sim_input,
+          "SIMULATED AUDIO INPUT: "
+          "Signal the simulated device records. Either sine:HZ, noise, "
+          "silence, or a WAV file with the same channels and bit depth as "
+          "the stream, which is looped."
+          "\n\n  e.g., --asimin=sine:440 --asimin=take1.wav\n");
+        helper::newDefaultOption<double>(
+          audio.help,
+          "asimjitter",
+          audio.store.sim_jitter_ms,
+          "SIMULATED AUDIO JITTER: "
+          "Each callback of the simulated device is late by a random amount "
+          "of up to this many milliseconds."
+          "\n\n  e.g., --asimjitter=0.5\n");
+        helper::newDefaultOption<double>(
+          audio.help,
+          "asimxrun",
+          audio.store.sim_xrun_rate,
+          "SIMULATED AUDIO XRUNS: "
+          "Chance of each simulated callback reporting an input overflow or "
+          "output underflow. Callbacks that miss their deadline always do."
+          "\n\n  e.g., --asimxrun=0.001\n");
+        helper::newDefaultOption<unsigned>(
+          audio.help,
+          "asimseed",
+          audio.store.sim_seed,
+          "SIMULATED AUDIO SEED: "
+          "Seed for the simulated jitter, xruns, and noise, so runs repeat."
+          "\n\n  e.g., --asimseed=7\n");
     };
 
     void
@@ -623,6 +782,14 @@ class AudioParser : virtual public OptionsBase
               << "\nPlayback type entered but device not set! Setting device to 0\n";
             audio.store.playback.device_id = 0;
         }
+        if (audio.store.sim_xrun_rate < 0 || audio.store.sim_xrun_rate > 1)
+        {
+            throw err::Runtime("--asimxrun must be between 0 and 1");
+        }
+        if (audio.store.sim_jitter_ms < 0)
+        {
+            throw err::Runtime("--asimjitter must not be negative");
+        }
     }
 };
 
@@ -658,9 +825,82 @@ class VideoParser : virtual public OptionsBase
                               "vsync",
                               video.store.video_sync,
                               "VIDEO SYNCHRONIZATION: "
-                              "Use the FPS value as a common frame rate."
+                              "Use the FPS value as a common frame rate. "
+                              "At each tick the frame grabbed closest to it is "
+                              "written for every camera, so all files share "
+                              "the same frame index."
                               "\n\n  e.g., --vsync or -s 1",
                               "s");
+        helper::newBoolOption(video.help,
+                              "vgrab",
+                              video.store.sync_grab,
+                              "SYNCHRONIZED GRAB: "
+                              "At each FPS tick grab all cameras back to back, "
+                              "then decode their frames in parallel. "
+                              "Keeps the time between cameras to one grab sweep. "
+                              "A camera the watchdog reconnects leaves the "
+                              "sweep and is grabbed on its own."
+                              "\n\n  e.g., --vgrab\n");
+        helper::newBoolOption(video.help,
+                              "cfr",
+                              video.store.constant_rate,
+                              "CONSTANT FRAME RATE: "
+                              "Write exactly FPS frames per second of recording. "
+                              "Repeats the last frame when a camera falls behind "
+                              "and drops extra frames when it runs ahead. Each "
+                              "is noted with its time in the timestamp file."
+                              "\n\n  e.g., --cfr\n");
+        helper::newBoolOption(video.help,
+                              "passthrough",
+                              video.store.passthrough,
+                              "MJPEG PASSTHROUGH: "
+                              "Save the camera's MJPG frames to an .avi file "
+                              "as they are, without decoding and encoding "
+                              "them again. Frames are only decoded for display. "
+                              "Falls back to normal encoding for devices that "
+                              "do not give MJPG."
+                              "\n\n  e.g., --passthrough\n");
+        helper::newDefaultOption<unsigned>(
+          video.help,
+          "vwatchdog",
+          video.store.watchdog_periods,
+          "DEVICE WATCHDOG: "
+          "Reconnect a camera in the background when no frame has arrived for "
+          "this many frame periods. The missing time is marked in the "
+          "timestamp file. Set to 0 to turn off."
+          "\n\n  e.g., --vwatchdog=30\n");
+        helper::newVectorOption<std::vector<int>>(
+          video.help,
+          "vcore",
+          video.store.capture_cores,
+          "CAPTURE THREAD CORE: "
+          "Pin each device's capture thread to a core. "
+          "Order according to USB, URL, synthetic, then replay device order. "
+          "May be used multiple times."
+          "\n\n  e.g., --vcore=0 --vcore=1\n");
+        helper::newVectorOption<std::vector<int>>(
+          video.help,
+          "vecore",
+          video.store.encode_cores,
+          "ENCODER THREAD CORE: "
+          "Pin each device's encoder thread to a core, in the same order as "
+          "--vcore. May be used multiple times."
+          "\n\n  e.g., --vecore=4 --vecore=5\n");
+        helper::newDefaultOption<int>(
+          video.help,
+          "vprio",
+          video.store.capture_priority,
+          "CAPTURE THREAD PRIORITY: "
+          "Priority of capture threads when --rtpolicy is fifo or rr."
+          "\n\n  e.g., --vprio=80\n");
+        helper::newDefaultOption<int>(
+          video.help,
+          "veprio",
+          video.store.encode_priority,
+          "ENCODER THREAD PRIORITY: "
+          "Priority of encoder threads when --rtpolicy is fifo or rr. "
+          "Keep it below the capture priority."
+          "\n\n  e.g., --veprio=50\n");
 
         helper::newVectorOption<std::vector<int>>(
           video.help,
@@ -680,6 +920,26 @@ class VideoParser : virtual public OptionsBase
           "May be used multiple times."
           "\n\n  e.g., --url=http://112.0.0.1 or -i http://...\n",
           "i");
+        helper::newVectorOption<std::vector<std::string>>(
+          video.help,
+          "synth",
+          video.store.synth_specs,
+          "SYNTHETIC CAMERA: "
+          "Generated frames as WIDTHxHEIGHT@FPS, with the frame number and "
+          "time drawn into the image. Used for testing without cameras. "
+          "May be used multiple times."
+          "\n\n  e.g., --synth=1280x720@60\n");
+        helper::newVectorOption<std::vector<std::string>>(
+          video.help,
+          "replay",
+          video.store.replay_specs,
+          "REPLAY RECORDING: "
+          "Play a recorded video as a camera, releasing each frame at the time "
+          "in its timestamp file. The timestamp file defaults to the video "
+          "file name plus .ts, or can be given after a comma. "
+          "May be used multiple times."
+          "\n\n  e.g., --replay=video_usb00.avi or "
+          "--replay=a.avi,a_times.ts\n");
         helper::newDefaultOption<std::string>(
           video.help,
           "codec",
@@ -713,6 +973,22 @@ class VideoParser : virtual public OptionsBase
           "How often to display last captured frames. "
           "This will affect imshow latency."
           "\n\n  e.g., --dfps=10\n");
+        helper::newDefaultOption<size_t>(
+          video.help,
+          "wqueue",
+          video.store.writer_queue_depth,
+          "WRITER QUEUE DEPTH: "
+          "Number of frames per device that can wait for the encoder thread."
+          "\n\n  e.g., --wqueue=64\n");
+        helper::newDefaultOption<std::string>(
+          video.help,
+          "wpolicy",
+          video.store.writer_queue_policy,
+          "WRITER QUEUE POLICY: "
+          "What to do with a new frame when the writer queue is full. "
+          "\"block\" waits for the encoder, \"oldest\" drops the oldest "
+          "queued frame, \"newest\" drops the new frame."
+          "\n\n  e.g., --wpolicy=oldest\n");
         helper::newDefaultOption<size_t>(
           video.help,
           "vtries",
@@ -801,9 +1077,19 @@ class VideoParser : virtual public OptionsBase
         video.store.n_url     = video.store.ip_urls.size();
         video.store.n_usb     = video.store.device_ids.size();
         video.store.n_devices = video.store.device_ids.size() +
-                                video.store.ip_urls.size();
+                                video.store.ip_urls.size() +
+                                video.store.synth_specs.size() +
+                                video.store.replay_specs.size();
+
+        if (video.store.video_sync && video.store.constant_rate)
+        {
+            video.store.constant_rate = false;
+            std::cerr << "--vsync already writes at a constant rate, "
+                         "ignoring --cfr\n";
+        }
 
-        if (video.store.video_sync && video.store.frames_per_second <= 0)
+        if ((video.store.video_sync || video.store.sync_grab) &&
+            video.store.frames_per_second <= 0)
         {
             video.store.frames_per_second = 30.0;
             std::cerr << "Cannot sync video with 0 FPS\n";
@@ -832,6 +1118,16 @@ class VideoParser : virtual public OptionsBase
         {
             video.store.set_capture_fourcc.assign(video.store.n_devices, "");
         }
+        if (video.store.writer_queue_depth < 1)
+        {
+            video.store.writer_queue_depth = 1;
+        }
+        if (!misc::is_member<std::string>(video.store.writer_queue_policy,
+                                          {"block", "oldest", "newest"}))
+        {
+            throw err::Runtime("Writer queue policy must be one of: "
+                               "block, oldest, newest");
+        }
         if (video.store.n_devices > 0)
         {
             if (!video.store.four_cc.empty() && video.store.four_cc.size() != 4)
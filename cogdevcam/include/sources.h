@@ -0,0 +1,490 @@
+/**
+    project: cogdevcam
+    source file: sources
+    description: devices and generators that video frames are read from
+
+    @author Joseph M. Burling
+    @version 0.9.2 12/19/2017
+*/
+
+#ifndef COGDEVCAM_SOURCES_H
+#define COGDEVCAM_SOURCES_H
+
+#include "tools.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+namespace video {
+
+/**
+ * Anything frames can be read from. Has the parts of cv::VideoCapture used
+ * by the reader, so cameras and generated frames are read the same way.
+ */
+class Source
+{
+  public:
+    virtual ~Source() = default;
+
+    virtual bool
+    open() = 0;
+
+    virtual bool
+    isOpened() const = 0;
+
+    virtual void
+    release() = 0;
+
+    /// latch the next frame, blocking until one is available
+    virtual bool
+    grab() = 0;
+
+    /// copy out the latched frame
+    virtual bool
+    retrieve(cv::Mat &img) = 0;
+
+    virtual bool
+    set(int prop_id, double value) = 0;
+
+    virtual double
+    get(int prop_id) const = 0;
+
+    /// device name used in messages
+    virtual std::string
+    name() const = 0;
+
+    /// new, unopened source for the same device, used to reconnect
+    virtual std::unique_ptr<Source>
+    clone() const = 0;
+};
+
+/// USB or IP camera opened with cv::VideoCapture
+class CameraSource : public Source
+{
+  public:
+    explicit CameraSource(int _index)
+      : is_usb(true), index(_index), url(std::to_string(_index)){};
+
+    explicit CameraSource(const std::string &_url) : is_usb(false), url(_url){};
+
+    bool
+    open() override
+    {
+        return is_usb ? capture.open(index) : capture.open(url);
+    };
+
+    bool
+    isOpened() const override
+    {
+        return capture.isOpened();
+    };
+
+    void
+    release() override
+    {
+        capture.release();
+    };
+
+    bool
+    grab() override
+    {
+        return capture.grab();
+    };
+
+    bool
+    retrieve(cv::Mat &img) override
+    {
+        return capture.retrieve(img);
+    };
+
+    bool
+    set(int prop_id, double value) override
+    {
+        return capture.set(prop_id, value);
+    };
+
+    double
+    get(int prop_id) const override
+    {
+        return capture.get(prop_id);
+    };
+
+    std::string
+    name() const override
+    {
+        return url;
+    };
+
+    std::unique_ptr<Source>
+    clone() const override
+    {
+        return std::unique_ptr<Source>(
+          is_usb ? new CameraSource(index) : new CameraSource(url));
+    };
+
+  private:
+    bool             is_usb = true;
+    int              index  = -1;
+    std::string      url    = "";
+    cv::VideoCapture capture;
+};
+
+/**
+ * Generates BGR frames at an exact rate, for testing without cameras.
+ * The frame number and the time the frame was generated are drawn into the
+ * top left corner as a grid of black and white cells, see decode(). Frames
+ * that are not grabbed in time are skipped, so gaps in the frame numbers show
+ * exactly where frames were lost.
+ */
+class SynthSource : public Source
+{
+  public:
+    /**
+     * @param _spec size and rate as WIDTHxHEIGHT@FPS, e.g., 1280x720@60
+     */
+    explicit SynthSource(const std::string &_spec) : spec(_spec)
+    {
+        char tail = 0;
+        if (std::sscanf(
+              spec.c_str(), "%dx%d@%lf%c", &width, &height, &fps, &tail) != 3 ||
+            width < 64 || height < 64 || fps <= 0)
+        {
+            throw err::Runtime("Synthetic source must look like "
+                               "WIDTHxHEIGHT@FPS with at least 64x64, got: " +
+                               spec);
+        }
+        cell = std::max(2, std::min(width, height) / 32);
+    };
+
+    bool
+    open() override
+    {
+        ticks.reset(timing::periodFromRate(fps));
+        frame_number = 0;
+        opened       = true;
+        return true;
+    };
+
+    bool
+    isOpened() const override
+    {
+        return opened;
+    };
+
+    void
+    release() override
+    {
+        opened = false;
+    };
+
+    bool
+    grab() override
+    {
+        if (!opened) return false;
+        frame_number += ticks.wait() + 1;
+        generated_us = std::chrono::duration_cast<timing::unit_us_int>(
+                         timing::getPresent().time_since_epoch())
+                         .count();
+        return true;
+    };
+
+    bool
+    retrieve(cv::Mat &img) override
+    {
+        if (!opened) return false;
+        img.create(height, width, CV_8UC3);
+        img.setTo(cv::Scalar::all(static_cast<double>(frame_number % 200 + 28)));
+        drawBits(img, 0, frame_number);
+        drawBits(img, 64, static_cast<uint64_t>(generated_us));
+        return true;
+    };
+
+    bool
+    set(int prop_id, double value) override
+    {
+        return false;
+    };
+
+    double
+    get(int prop_id) const override
+    {
+        switch (prop_id)
+        {
+            case cv::CAP_PROP_FPS: return fps;
+            case cv::CAP_PROP_FRAME_WIDTH: return width;
+            case cv::CAP_PROP_FRAME_HEIGHT: return height;
+            default: return 0;
+        }
+    };
+
+    std::string
+    name() const override
+    {
+        return "synth:" + spec;
+    };
+
+    std::unique_ptr<Source>
+    clone() const override
+    {
+        return std::unique_ptr<Source>(new SynthSource(spec));
+    };
+
+    /**
+     * Read back the values drawn into a generated frame
+     * @param img frame from a synthetic source, BGR at its original size
+     * @param frame filled with the frame number
+     * @param generated_us filled with the time the frame was made, in
+     * microseconds on timing::DefaultClock
+     */
+    static void
+    decode(const cv::Mat &img, uint64_t &frame, uint64_t &generated_us)
+    {
+        int cell_size = std::max(2, std::min(img.cols, img.rows) / 32);
+        frame         = readBits(img, cell_size, 0);
+        generated_us  = readBits(img, cell_size, 64);
+    };
+
+  private:
+    static constexpr int cells_per_row = 16;
+
+    std::string      spec;
+    int              width        = 0;
+    int              height       = 0;
+    double           fps          = 0;
+    int              cell         = 2;
+    bool             opened       = false;
+    uint64_t         frame_number = 0;
+    timing::Int_t    generated_us = 0;
+    timing::Periodic ticks;
+
+    void
+    drawBits(cv::Mat &img, int first_bit, uint64_t value) const
+    {
+        for (int b = 0; b < 64; ++b)
+        {
+            int  bit   = first_bit + b;
+            auto color = (value >> b) & 1 ? cv::Scalar::all(255) :
+                                            cv::Scalar::all(0);
+            img(cv::Rect((bit % cells_per_row) * cell,
+                         (bit / cells_per_row) * cell,
+                         cell,
+                         cell))
+              .setTo(color);
+        }
+    };
+
+    static uint64_t
+    readBits(const cv::Mat &img, int cell_size, int first_bit)
+    {
+        uint64_t value = 0;
+        for (int b = 0; b < 64; ++b)
+        {
+            int  bit = first_bit + b;
+            int  x   = (bit % cells_per_row) * cell_size + cell_size / 2;
+            int  y   = (bit / cells_per_row) * cell_size + cell_size / 2;
+            auto px  = img.ptr<uint8_t>(y)[x * img.channels()];
+            if (px > 127) value |= uint64_t(1) << b;
+        }
+        return value;
+    };
+};
+
+/**
+ * Plays back a recorded video file as if it were a camera. Each frame is
+ * released at its time in the .ts file, counted from the file's first frame,
+ * on a clock that starts at the given master start time, so a session keeps
+ * the timing and jitter it was recorded with. Frames whose time has already
+ * passed are released right away. The file starts over once it runs out of
+ * frames or timestamps. A clone, e.g., after a reconnect, stays on the same
+ * clock and picks up at the first frame not yet due instead of replaying the
+ * file from the start.
+ */
+class ReplaySource : public Source
+{
+  public:
+    /**
+     * @param _spec video file, optionally followed by a comma and its .ts
+     * file. Defaults to the video file name with .ts appended
+     * @param _start_time time point the recorded timestamps are relative to
+     */
+    ReplaySource(const std::string &_spec, timing::TimePoint _start_time)
+      : spec(_spec), start_time(_start_time)
+    {
+        auto comma = spec.find(',');
+        video_file = spec.substr(0, comma);
+        ts_file    = comma == std::string::npos ? video_file + ".ts" :
+                                                  spec.substr(comma + 1);
+    };
+
+    bool
+    open() override
+    {
+        times = readTimestamps(ts_file);
+        if (times.empty())
+        {
+            std::cerr << "No timestamps found for replay in:\n " << ts_file
+                      << "\n";
+            return false;
+        }
+        // recorded times are on the old session's master clock
+        auto first = times.front();
+        for (auto &t : times) t -= first;
+        next_frame  = 0;
+        loop_offset = 0;
+        if (!capture.open(video_file)) return false;
+        if (resume) seekToNow();
+        return true;
+    };
+
+    bool
+    isOpened() const override
+    {
+        return capture.isOpened();
+    };
+
+    void
+    release() override
+    {
+        capture.release();
+    };
+
+    bool
+    grab() override
+    {
+        if (!capture.isOpened()) return false;
+        if (next_frame >= times.size() || !capture.grab())
+        {
+            if (!rewind()) return false;
+        }
+        auto release_ms = times[next_frame++] + loop_offset;
+        timing::sleep::until(
+          start_time + std::chrono::duration_cast<timing::Duration>(
+                         timing::unit_ms_flt(release_ms)));
+        return true;
+    };
+
+    bool
+    retrieve(cv::Mat &img) override
+    {
+        return capture.retrieve(img);
+    };
+
+    bool
+    set(int prop_id, double value) override
+    {
+        return false;
+    };
+
+    double
+    get(int prop_id) const override
+    {
+        return capture.get(prop_id);
+    };
+
+    std::string
+    name() const override
+    {
+        return "replay:" + video_file;
+    };
+
+    std::unique_ptr<Source>
+    clone() const override
+    {
+        auto copy    = new ReplaySource(spec, start_time);
+        copy->resume = true;
+        return std::unique_ptr<Source>(copy);
+    };
+
+    /// frame times from a .ts file, skipping notes and anything not a number
+    static std::vector<double>
+    readTimestamps(const std::string &filename)
+    {
+        std::vector<double> ts;
+        std::ifstream       file(filename);
+        std::string         line;
+        while (std::getline(file, line))
+        {
+            if (line.empty() || line[0] == '#') continue;
+            try
+            {
+                ts.push_back(std::stod(line));
+            } catch (const std::exception &)
+            {
+                continue;
+            }
+        }
+        return ts;
+    };
+
+  private:
+    std::string         spec;
+    std::string         video_file;
+    std::string         ts_file;
+    timing::TimePoint   start_time;
+    std::vector<double> times;
+    size_t              next_frame  = 0;
+    double              loop_offset = 0;
+    bool                resume      = false;
+    cv::VideoCapture    capture;
+
+    /// time between the last frame and the first of the next loop
+    double
+    loopGap() const
+    {
+        auto span = times.back() - times.front();
+        return times.size() > 1 ? span / (times.size() - 1) : 0;
+    };
+
+    /**
+     * Skip to the first frame not yet due on the clock, counting the loops
+     * played so far as if the file had run out of timestamps each time
+     */
+    void
+    seekToNow()
+    {
+        auto now_ms = std::chrono::duration_cast<timing::unit_ms_flt>(
+                        timing::getPresent() - start_time)
+                        .count();
+        auto loop_ms = times.back() - times.front() + loopGap();
+        if (loop_ms > 0 && now_ms > 0)
+        {
+            loop_offset = std::floor(now_ms / loop_ms) * loop_ms;
+        }
+        next_frame = static_cast<size_t>(
+          std::lower_bound(times.begin(), times.end(), now_ms - loop_offset) -
+          times.begin());
+        if (next_frame >= times.size())
+        {
+            next_frame = 0;
+            loop_offset += loop_ms;
+        }
+        if (next_frame == 0) return;
+        if (!capture.set(cv::CAP_PROP_POS_FRAMES,
+                         static_cast<double>(next_frame)))
+        {
+            // backends that cannot seek get there by reading
+            size_t skipped = 0;
+            while (skipped < next_frame && capture.grab()) ++skipped;
+        }
+    };
+
+    /// start the file over, continuing the clock one frame after the last
+    bool
+    rewind()
+    {
+        if (next_frame == 0) return false;
+        loop_offset += times[next_frame - 1] - times.front() + loopGap();
+        next_frame = 0;
+        capture.release();
+        return capture.open(video_file) && capture.grab();
+    };
+};
+};  // namespace video
+
+#endif  // COGDEVCAM_SOURCES_H
@@ -11,17 +11,29 @@
 #define __COGDEVCAM_TOOLS_H
 
 #include <algorithm>
+#include <atomic>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/filesystem.hpp>
 #include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <functional>
 #include <future>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <ratio>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 namespace err {
 class Runtime;
@@ -135,17 +147,32 @@ zeroPadStr(const T &value, unsigned n = 2)
     return ss.str();
 };
 
-int
-findNearestTimeStamp(double tick, std::vector<int> ticks)
+/**
+ * Binary search for the time closest to tick
+ * @param tick time to match
+ * @param ticks times in increasing order, anything with size() and operator[]
+ * @return index of the nearest time, or 0 if ticks is empty
+ */
+template<typename T, typename C>
+size_t
+findNearestTimeStamp(const T &tick, const C &ticks)
 {
-    std::vector<double> tickDiff(ticks.size());
-    for (auto i = 0; i < ticks.size(); ++i)
+    size_t lower = 0;
+    size_t upper = ticks.size();
+    while (lower < upper)
     {
-        tickDiff[i] = abs(static_cast<double>(ticks[i]) - tick);
+        size_t middle = lower + (upper - lower) / 2;
+        if (ticks[middle] < tick)
+        {
+            lower = middle + 1;
+        } else
+        {
+            upper = middle;
+        }
     }
-    auto mins      = min_element(tickDiff.begin(), tickDiff.end());
-    auto min_index = static_cast<int>(distance(tickDiff.begin(), mins));
-    return min_index;
+    if (lower == 0) return 0;
+    if (lower == ticks.size()) return lower - 1;
+    return tick - ticks[lower - 1] <= ticks[lower] - tick ? lower - 1 : lower;
 };
 
 std::string
@@ -329,6 +356,31 @@ is_member(const T &val, std::vector<T> vec)
     auto end   = vec.end();
     return std::find(begin, end, val) != end;
 };
+
+/// true once SIGINT or SIGTERM arrived, see catchStopSignals()
+std::atomic_bool &
+stopRequested()
+{
+    static std::atomic_bool requested{false};
+    return requested;
+};
+
+/**
+ * Turn the first SIGINT or SIGTERM into a stop request, so a run without a
+ * window or control socket can still close its files. A second signal ends
+ * the program as usual.
+ */
+void
+catchStopSignals()
+{
+    stopRequested() = false;
+    auto on_signal  = [](int sig) {
+        stopRequested() = true;
+        std::signal(sig, SIG_DFL);
+    };
+    std::signal(SIGINT, on_signal);
+    std::signal(SIGTERM, on_signal);
+};
 };  // namespace misc
 
 namespace timing {
@@ -539,6 +591,9 @@ class Clock
             duration_leftover = timer_duration - duration_leftover;
             if (duration_leftover < duration_leftover.zero())
             {
+                // whole periods that went by without being checked
+                timer_misses += static_cast<uint64_t>(
+                  -duration_leftover.count() / timer_duration_c);
                 timer_time_point = timer_time_point -
                                    leftOverTime(duration_leftover);
             } else
@@ -574,6 +629,13 @@ class Clock
         return start_time_point;
     };
 
+    /// timer periods that passed entirely between calls to timeout()
+    uint64_t
+    getTimerMisses() const
+    {
+        return timer_misses;
+    };
+
     const TimePoint &
     getLapTime() const
     {
@@ -610,6 +672,7 @@ class Clock
     Duration  timer_duration{0};
     Duration  timer_threshold{0};
     ctype     timer_duration_c = 0;
+    uint64_t  timer_misses     = 0;
 
     void
     setAllTimePoints(const TimePoint &tp)
@@ -640,16 +703,58 @@ constexpr auto getPast    = pastTP<SleepTimePoint, SleepDuration>;
 constexpr auto getPresent = nowTP<SleepTimePoint>;
 constexpr auto getFuture  = futureTP<SleepTimePoint, SleepDuration>;
 
+/// shared storage for the spin tail, in nanoseconds
+std::atomic<Int_t> &
+spinTailStorage()
+{
+    static std::atomic<Int_t> tail_ns(200 * nano_int / micro_int);
+    return tail_ns;
+};
+
+/// last part of every sleep that is spun on the clock instead of slept
 SleepDuration
-sec(const Float_t &sec)
+spinTail()
+{
+    return SleepDuration(static_cast<Float_t>(spinTailStorage().load()));
+};
+
+/**
+ * Longer tails wake closer to the deadline but keep the core busy longer
+ * @param tail spin time at the end of each sleep, zero to never spin
+ */
+template<typename Dur>
+void
+setSpinTail(const Dur &tail)
+{
+    spinTailStorage() = std::chrono::duration_cast<unit_nano_int>(tail).count();
+};
+
+/**
+ * Sleep with the OS until just before a deadline, then spin the rest
+ * @param sleep_end time point to wake up at
+ * @return how late the wake up was
+ */
+SleepDuration
+until(const SleepTimePoint &sleep_end)
 {
-    auto sleep_end = getFuture(SleepDuration(sec * nano_flt));
-    auto now_time  = getPresent();
+    auto now_time = getPresent();
+    auto os_sleep = sleep_end - spinTail() - now_time;
+    if (os_sleep > SleepDuration::zero())
+    {
+        std::this_thread::sleep_for(os_sleep);
+        now_time = getPresent();
+    }
     while (now_time < sleep_end)
     {
         now_time = getPresent();
     };
     return now_time - sleep_end;
+};
+
+SleepDuration
+sec(const Float_t &sec)
+{
+    return until(getFuture(SleepDuration(sec * nano_flt)));
 }
 
 template<typename Dur>
@@ -660,6 +765,122 @@ thread(const Dur &d)
 }
 };  // namespace sleep
 
+/// period of a rate given in events per second
+Duration
+periodFromRate(Float_t rate_hz)
+{
+    return std::chrono::duration_cast<Duration>(unit_sec_flt(1.0 / rate_hz));
+};
+
+/**
+ * Fixed rate deadlines on a common time base. Either block until the next
+ * deadline with wait() or poll with due(), which replaces Clock::timeout for
+ * loops that do other work between deadlines. Deadlines that pass without
+ * being handled are skipped and counted, and how late each one was handled
+ * is kept as wake up jitter.
+ */
+class Periodic
+{
+  public:
+    Periodic() = default;
+
+    /**
+     * @param _period time between deadlines
+     * @param start deadlines fall on start + k * period
+     */
+    explicit Periodic(Duration _period, TimePoint start = getPresent())
+    {
+        reset(_period, start);
+    };
+
+    /// deadlines that already passed by now are not counted as skipped
+    void
+    reset(Duration _period, TimePoint start = getPresent())
+    {
+        period   = _period;
+        deadline = start + period;
+        auto now = getPresent();
+        if (period > Duration::zero() && now > deadline)
+        {
+            deadline += period * ((now - deadline) / period + 1);
+        }
+    };
+
+    /// sleep until the next deadline, returns the number of deadlines skipped
+    size_t
+    wait()
+    {
+        size_t n_skipped = skipMissed(getPresent());
+        sleep::until(deadline);
+        advance(getPresent());
+        return n_skipped;
+    };
+
+    /// true once for each deadline that has passed, without sleeping
+    bool
+    due(TimePoint now = getPresent())
+    {
+        if (now < deadline) return false;
+        skipMissed(now);
+        advance(now);
+        return true;
+    };
+
+    const TimePoint &
+    getDeadline() const
+    {
+        return deadline;
+    };
+
+    uint64_t
+    getSkipped() const
+    {
+        return n_skipped_total;
+    };
+
+    Float_t
+    getMeanJitter() const
+    {
+        if (n_wakes == 0) return 0;
+        return std::chrono::duration_cast<unit_ms_flt>(jitter_sum).count() /
+               n_wakes;
+    };
+
+    Float_t
+    getMaxJitter() const
+    {
+        return std::chrono::duration_cast<unit_ms_flt>(jitter_max).count();
+    };
+
+  private:
+    Duration  period{0};
+    TimePoint deadline = getPresent();
+    uint64_t  n_wakes  = 0;
+    uint64_t  n_skipped_total = 0;
+    Duration  jitter_sum{0};
+    Duration  jitter_max{0};
+
+    size_t
+    skipMissed(TimePoint now)
+    {
+        if (period <= Duration::zero() || now - deadline < period) return 0;
+        auto n_skipped = static_cast<size_t>((now - deadline) / period);
+        deadline += period * n_skipped;
+        n_skipped_total += n_skipped;
+        return n_skipped;
+    };
+
+    void
+    advance(TimePoint now)
+    {
+        auto late = now - deadline;
+        jitter_sum += late;
+        jitter_max = std::max(jitter_max, late);
+        ++n_wakes;
+        deadline += period;
+    };
+};
+
 std::vector<timing::Float_t>
 test_time(const timing::Float_t &wait_sec, size_t n = 500)
 {
@@ -736,4 +957,395 @@ makeFutureValid()
 }
 };  // namespace futures
 
+namespace threads {
+
+/// number of OS threads started through this namespace
+std::atomic<uint64_t> &
+createdCounter()
+{
+    static std::atomic<uint64_t> n_created{0};
+    return n_created;
+};
+
+uint64_t
+getCreated()
+{
+    return createdCounter().load();
+};
+
+/// start a thread and count it
+template<typename F, typename... Args>
+std::thread
+spawn(F &&func, Args &&... args)
+{
+    createdCounter() += 1;
+    return std::thread(std::forward<F>(func), std::forward<Args>(args)...);
+};
+
+/// run a one off task on its own thread and count it
+template<typename F>
+std::future<void>
+launch(F &&func)
+{
+    createdCounter() += 1;
+    return std::async(std::launch::async, std::forward<F>(func));
+};
+
+/**
+ * Where a thread runs and how the OS schedules it. Defaults leave the thread
+ * alone.
+ */
+struct Placement
+{
+    /// core to pin to, -1 lets the OS choose
+    int core = -1;
+    /// scheduling policy: other, fifo, or rr
+    std::string policy = "other";
+    /// priority for fifo and rr, clamped to the range the OS allows
+    int priority = 0;
+
+    bool
+    isDefault() const
+    {
+        return core < 0 && policy == "other";
+    };
+
+    std::string
+    describe() const
+    {
+        std::stringstream ss;
+        ss << "core " << (core < 0 ? std::string("any") : std::to_string(core))
+           << ", " << policy;
+        if (policy != "other") ss << " priority " << priority;
+        return ss.str();
+    };
+};
+
+/// what placeThread() could not do, error codes are 0 on success
+struct PlacementStatus
+{
+    bool no_core     = false;
+    bool unsupported = false;
+    int  affinity    = 0;
+    int  scheduling  = 0;
+
+    bool
+    applied() const
+    {
+        return !no_core && !unsupported && affinity == 0 && scheduling == 0;
+    };
+};
+
+/**
+ * Pin the calling thread and set its scheduling policy. Does not log or
+ * allocate, so a real-time callback can call it; report the result later
+ * with logPlacement(). Real-time policies usually need CAP_SYS_NICE or an
+ * rtprio limit, on failure the thread keeps running with what it had.
+ * @param place core and policy to apply
+ */
+PlacementStatus
+placeThread(const Placement &place)
+{
+    PlacementStatus status;
+    if (place.isDefault()) return status;
+#ifdef __linux__
+    if (place.core >= CPU_SETSIZE)
+    {
+        status.no_core = true;
+    } else if (place.core >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(place.core, &cpus);
+        status.affinity =
+          pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+    if (place.policy != "other")
+    {
+        int         policy = place.policy == "fifo" ? SCHED_FIFO : SCHED_RR;
+        sched_param param{};
+        param.sched_priority = std::max(
+          sched_get_priority_min(policy),
+          std::min(place.priority, sched_get_priority_max(policy)));
+        status.scheduling =
+          pthread_setschedparam(pthread_self(), policy, &param);
+    }
+#else
+    status.unsupported = true;
+#endif
+    return status;
+};
+
+/**
+ * Log the result of placeThread(), from any thread
+ * @param label thread name used in the log
+ * @return false if any part could not be applied
+ */
+bool
+logPlacement(const Placement &      place,
+             const PlacementStatus &status,
+             const std::string &    label)
+{
+    if (place.isDefault()) return true;
+    std::stringstream log;
+    log << "Thread placement, " << label << ": " << place.describe();
+    if (status.no_core) log << " [no such core]";
+    if (status.affinity != 0)
+    {
+        log << " [affinity failed: " << std::strerror(status.affinity) << "]";
+    }
+    if (status.scheduling != 0)
+    {
+        log << " [scheduling failed: " << std::strerror(status.scheduling)
+            << "]";
+    }
+    if (status.unsupported) log << " [not supported on this platform]";
+    log << "\n";
+    (status.applied() ? std::cout : std::cerr) << log.str() << std::flush;
+    return status.applied();
+};
+
+/**
+ * Pin the calling thread and set its scheduling policy, then log the result
+ * @param place core and policy to apply
+ * @param label thread name used in the log
+ * @return false if any part could not be applied
+ */
+bool
+applyPlacement(const Placement &place, const std::string &label)
+{
+    return logPlacement(place, placeThread(place), label);
+};
+
+/**
+ * A thread that lives for the whole session and calls the same task over and
+ * over. The owner controls it with start/pause/resume/stop instead of
+ * launching a new thread each time work needs to continue.
+ */
+class Worker
+{
+  public:
+    using Task = std::function<void()>;
+
+    enum class Command
+    {
+        RUN,
+        PAUSE,
+        STOP
+    };
+
+    explicit Worker(Task _task)
+      : state(std::make_shared<State>(std::move(_task))){};
+
+    Worker(const Worker &) = delete;
+    Worker &operator=(const Worker &) = delete;
+
+    ~Worker()
+    {
+        stop();
+    };
+
+    /// create the thread if needed and begin calling the task
+    void
+    start()
+    {
+        if (!thread.joinable())
+        {
+            state->finished = false;
+            setCommand(Command::RUN);
+            thread = spawn(&Worker::loop, state);
+        } else
+        {
+            resume();
+        }
+    };
+
+    /// block until the current task call has finished and the thread is idle
+    void
+    pause()
+    {
+        if (!thread.joinable()) return;
+        setCommand(Command::PAUSE);
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->state_change.wait(lock, [this]() { return state->paused; });
+    };
+
+    void
+    resume()
+    {
+        if (!thread.joinable()) return;
+        setCommand(Command::RUN);
+    };
+
+    /// finish the current task call and join the thread
+    void
+    stop()
+    {
+        if (!thread.joinable()) return;
+        setCommand(Command::STOP);
+        thread.join();
+    };
+
+    /**
+     * Like stop(), but give up on a task call that does not finish in time,
+     * e.g., one stuck in a driver. The thread is let go and ends by itself
+     * once the call returns, so the task must not use anything the owner
+     * destroys after this.
+     * @param wait longest time to wait for the current call
+     * @return false if the thread was let go
+     */
+    bool
+    stopWithin(std::chrono::milliseconds wait)
+    {
+        if (!thread.joinable()) return true;
+        setCommand(Command::STOP);
+        bool finished;
+        {
+            std::unique_lock<std::mutex> lock(state->mutex);
+            finished = state->state_change.wait_for(
+              lock, wait, [this]() { return state->finished; });
+        }
+        if (finished)
+        {
+            thread.join();
+        } else
+        {
+            thread.detach();
+        }
+        return finished;
+    };
+
+    bool
+    isRunning() const
+    {
+        return thread.joinable() && state->command.load() == Command::RUN;
+    };
+
+    bool
+    isPaused()
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        return state->paused;
+    };
+
+    /// core and scheduling applied when the thread starts, call before start()
+    void
+    setPlacement(const Placement &_place, const std::string &_label)
+    {
+        state->place = _place;
+        state->label = _label;
+    };
+
+  private:
+    /// everything the thread uses, shared so a thread that was let go has it
+    struct State
+    {
+        explicit State(Task _task) : task(std::move(_task)){};
+
+        Task                    task;
+        Placement               place;
+        std::string             label;
+        std::atomic<Command>    command{Command::STOP};
+        std::mutex              mutex;
+        std::condition_variable state_change;
+        bool                    paused   = false;
+        bool                    finished = false;
+    };
+
+    std::shared_ptr<State> state;
+    std::thread            thread;
+
+    void
+    setCommand(Command cmd)
+    {
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->command = cmd;
+        }
+        state->state_change.notify_all();
+    };
+
+    static void
+    loop(std::shared_ptr<State> state)
+    {
+        applyPlacement(state->place, state->label);
+        while (true)
+        {
+            auto cmd = state->command.load(std::memory_order_acquire);
+            if (cmd == Command::RUN)
+            {
+                state->task();
+                continue;
+            }
+            if (cmd == Command::STOP) break;
+
+            std::unique_lock<std::mutex> lock(state->mutex);
+            state->paused = true;
+            state->state_change.notify_all();
+            state->state_change.wait(
+              lock, [&state]() { return state->command != Command::PAUSE; });
+            state->paused = false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->finished = true;
+        }
+        state->state_change.notify_all();
+    };
+};
+
+/**
+ * Reusable barrier for a fixed number of threads. Everyone who calls
+ * arriveAndWait() blocks until the last thread arrives, then all continue
+ * and the barrier is ready for the next round.
+ */
+class Barrier
+{
+  public:
+    explicit Barrier(size_t _n_threads) : n_threads(_n_threads){};
+
+    /**
+     * Wait for the other threads
+     * @return false if the barrier was cancelled
+     */
+    bool
+    arriveAndWait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (cancelled) return false;
+        auto round = generation;
+        if (++n_arrived == n_threads)
+        {
+            n_arrived = 0;
+            ++generation;
+            lock.unlock();
+            all_arrived.notify_all();
+            return true;
+        }
+        all_arrived.wait(
+          lock, [this, round]() { return cancelled || generation != round; });
+        return !cancelled;
+    };
+
+    /// release everyone and make every later wait return false
+    void
+    cancel()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cancelled = true;
+        }
+        all_arrived.notify_all();
+    };
+
+  private:
+    size_t                  n_threads  = 1;
+    size_t                  n_arrived  = 0;
+    uint64_t                generation = 0;
+    bool                    cancelled  = false;
+    std::mutex              mutex;
+    std::condition_variable all_arrived;
+};
+};  // namespace threads
+
 #endif  // __COGDEVCAM_TOOLS_H
@@ -0,0 +1,382 @@
+/**
+    project: cogdevcam
+    source file: trace
+    description: timeline of capture, encode, display, and audio work
+
+    @author Joseph M. Burling
+    @version 0.9.2 12/19/2017
+*/
+
+#ifndef COGDEVCAM_TRACE_H
+#define COGDEVCAM_TRACE_H
+
+#include "tools.h"
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * Trace points are compiled in with -DCOGDEVCAM_TRACE (cmake -DWITH_TRACE=ON)
+ * and only record once a trace::Session is started, e.g., with --trace. When
+ * compiled out they are empty statements; when compiled in but not started
+ * they cost one relaxed atomic load.
+ */
+#ifdef COGDEVCAM_TRACE
+#define TRACE_JOIN_(a, b) a##b
+#define TRACE_JOIN(a, b) TRACE_JOIN_(a, b)
+/// time the rest of the enclosing scope, category and name must be literals
+#define TRACE_SCOPE(category, name)                                            \
+    trace::Scope TRACE_JOIN(trace_scope_, __LINE__)(category, name)
+/// label the calling thread in the timeline, only the first call counts
+#define TRACE_THREAD(name) trace::nameThread(name)
+#else
+#define TRACE_SCOPE(category, name) (void)0
+#define TRACE_THREAD(name) (void)0
+#endif
+
+namespace trace {
+
+/// one finished span, names point to string literals
+struct Event
+{
+    const char *category = "";
+    const char *name     = "";
+    int64_t     start_us = 0;
+    int64_t     dur_us   = 0;
+};
+
+/**
+ * Events from one thread. The owning thread pushes, the flush thread pops,
+ * neither ever waits. Events that arrive while the buffer is full are counted
+ * and lost.
+ */
+class ThreadBuffer
+{
+  public:
+    explicit ThreadBuffer(uint64_t _tid, size_t capacity = 1 << 14)
+      : tid(_tid), events(capacity){};
+
+    bool
+    push(const Event &event)
+    {
+        auto head = write_index.load(std::memory_order_relaxed);
+        auto tail = read_index.load(std::memory_order_acquire);
+        if (head - tail >= events.size())
+        {
+            n_lost.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        events[head % events.size()] = event;
+        write_index.store(head + 1, std::memory_order_release);
+        return true;
+    };
+
+    template<typename F>
+    void
+    drain(F &&func)
+    {
+        auto tail = read_index.load(std::memory_order_relaxed);
+        auto head = write_index.load(std::memory_order_acquire);
+        for (; tail != head; ++tail) func(events[tail % events.size()]);
+        read_index.store(tail, std::memory_order_release);
+    };
+
+    void
+    setName(const std::string &_name)
+    {
+        std::lock_guard<std::mutex> lock(name_mutex);
+        name = _name;
+    };
+
+    std::string
+    getName()
+    {
+        std::lock_guard<std::mutex> lock(name_mutex);
+        return name;
+    };
+
+    const uint64_t        tid;
+    std::atomic_bool      finished{false};
+    std::atomic<uint64_t> n_lost{0};
+
+  private:
+    std::vector<Event>    events;
+    std::atomic<uint64_t> write_index{0};
+    std::atomic<uint64_t> read_index{0};
+    std::mutex            name_mutex;
+    std::string           name;
+};
+
+/// state shared by every thread that records
+struct Global
+{
+    std::atomic_bool                           enabled{false};
+    std::mutex                                 mutex;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    uint64_t                                   next_tid = 1;
+    timing::TimePoint                          epoch    = timing::getPresent();
+};
+
+Global &
+global()
+{
+    static Global trace_global;
+    return trace_global;
+};
+
+bool
+enabled()
+{
+    return global().enabled.load(std::memory_order_relaxed);
+};
+
+int64_t
+nowUs()
+{
+    return std::chrono::duration_cast<timing::unit_us_int>(
+             timing::getPresent() - global().epoch)
+      .count();
+};
+
+/// the calling thread's buffer, marked finished when the thread exits
+class ThreadSlot
+{
+  public:
+    ~ThreadSlot()
+    {
+        if (buffer) buffer->finished = true;
+    };
+
+    ThreadBuffer &
+    get()
+    {
+        if (buffer) return *buffer;
+        auto &                      state = global();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        buffer = std::make_shared<ThreadBuffer>(state.next_tid++);
+        buffer->setName(name);
+        state.buffers.push_back(buffer);
+        return *buffer;
+    };
+
+    void
+    setName(const std::string &_name)
+    {
+        if (named) return;
+        named = true;
+        name  = _name;
+        if (buffer) buffer->setName(name);
+    };
+
+  private:
+    std::shared_ptr<ThreadBuffer> buffer;
+    std::string                   name;
+    bool                          named = false;
+};
+
+ThreadSlot &
+threadSlot()
+{
+    thread_local ThreadSlot slot;
+    return slot;
+};
+
+void
+nameThread(const std::string &name)
+{
+    threadSlot().setName(name);
+};
+
+/// records the time from construction to destruction as one span
+class Scope
+{
+  public:
+    Scope(const char *_category, const char *_name)
+    {
+        if (!enabled()) return;
+        category = _category;
+        name     = _name;
+        start_us = nowUs();
+    };
+
+    ~Scope()
+    {
+        if (!name) return;
+        auto end_us = nowUs();
+        threadSlot().get().push({category, name, start_us, end_us - start_us});
+    };
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+  private:
+    const char *category = nullptr;
+    const char *name     = nullptr;
+    int64_t     start_us = 0;
+};
+
+/**
+ * Writes recorded spans to a Chrome trace-event JSON file, which opens in
+ * chrome://tracing or ui.perfetto.dev. A background thread moves events from
+ * the thread buffers to the file so recording threads never touch the disk.
+ */
+class Session
+{
+  public:
+    Session() = default;
+
+    Session(const Session &) = delete;
+    Session &operator=(const Session &) = delete;
+
+    ~Session()
+    {
+        stop();
+    };
+
+    /**
+     * Open the file and start recording
+     * @param filename trace file, e.g., trace.json
+     */
+    void
+    start(const std::string &filename)
+    {
+#ifdef COGDEVCAM_TRACE
+        if (flusher) return;
+        misc::makeDirectory(filename);
+        file.open(filename, std::ios::trunc);
+        if (!file.is_open())
+        {
+            throw err::Runtime("Could not open trace file " + filename);
+        }
+        file << "[";
+        n_written = 0;
+        global().enabled = true;
+        flusher.reset(new threads::Worker([this]() {
+            timing::sleep::thread(std::chrono::milliseconds(100));
+            flush();
+        }));
+        flusher->start();
+        std::cout << "\nRecording trace to " << filename << "\n";
+#else
+        std::cerr << "Trace points are not compiled in, rebuild with "
+                     "-DWITH_TRACE=ON to use --trace\n";
+#endif
+    };
+
+    /// stop recording and finish the file
+    void
+    stop()
+    {
+        if (!flusher) return;
+        global().enabled = false;
+        flusher->stop();
+        flusher.reset();
+        flush();
+        uint64_t n_lost = n_lost_finished;
+        {
+            std::lock_guard<std::mutex> lock(global().mutex);
+            for (auto &buffer : global().buffers) n_lost += buffer->n_lost;
+        }
+        file << "\n]\n";
+        file.close();
+        if (n_lost > 0)
+        {
+            std::cerr << "Trace buffers were full, " << n_lost
+                      << " spans were not recorded\n";
+        }
+    };
+
+  private:
+    std::ofstream                    file;
+    std::unique_ptr<threads::Worker> flusher;
+    uint64_t                         n_written       = 0;
+    uint64_t                         n_lost_finished = 0;
+    std::vector<uint64_t>            named_tids;
+
+    void
+    flush()
+    {
+        std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+        {
+            auto &                      state = global();
+            std::lock_guard<std::mutex> lock(state.mutex);
+            buffers = state.buffers;
+        }
+        for (auto &buffer : buffers)
+        {
+            writeThreadName(*buffer);
+            writeEvents(*buffer);
+        }
+        file.flush();
+        dropFinished();
+    };
+
+    void
+    writeEvents(ThreadBuffer &buffer)
+    {
+        buffer.drain([this, &buffer](const Event &event) {
+            separate();
+            file << "{\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer.tid
+                 << ",\"cat\":\"" << event.category << "\",\"name\":\""
+                 << event.name << "\",\"ts\":" << event.start_us
+                 << ",\"dur\":" << event.dur_us << "}";
+        });
+    };
+
+    void
+    separate()
+    {
+        file << (n_written++ == 0 ? "\n" : ",\n");
+    };
+
+    /// metadata event so the timeline shows names instead of numbers
+    void
+    writeThreadName(ThreadBuffer &buffer)
+    {
+        auto name = buffer.getName();
+        if (name.empty()) return;
+        std::string escaped;
+        for (auto c : name)
+        {
+            if (c == '"' || c == '\\') escaped += '\\';
+            escaped += c;
+        }
+        for (auto tid : named_tids)
+        {
+            if (tid == buffer.tid) return;
+        }
+        named_tids.push_back(buffer.tid);
+        separate();
+        file << "{\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer.tid
+             << ",\"name\":\"thread_name\",\"args\":{\"name\":\"" << escaped
+             << "\"}}";
+    };
+
+    /// forget buffers of threads that exited, after their last events
+    void
+    dropFinished()
+    {
+        auto &                      state = global();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        auto                        it = state.buffers.begin();
+        while (it != state.buffers.end())
+        {
+            if ((*it)->finished)
+            {
+                writeEvents(**it);
+                n_lost_finished += (*it)->n_lost;
+                it = state.buffers.erase(it);
+            } else
+            {
+                ++it;
+            }
+        }
+    };
+};
+};  // namespace trace
+
+#endif  // COGDEVCAM_TRACE_H
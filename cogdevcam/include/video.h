@@ -10,8 +10,16 @@
 #ifndef COGDEVCAM_VIDEO_H
 #define COGDEVCAM_VIDEO_H
 
+#include "buffers.h"
+#include "metrics.h"
+#include "sources.h"
 #include "tools.h"
+#include "trace.h"
 #include <chrono>
+#include <cmath>
+#include <fstream>
+#include <memory>
+#include <mutex>
 #include <opencv2/opencv.hpp>
 #include <string>
 #include <utility>
@@ -21,11 +29,13 @@ namespace video {
 using VideoTimeType = double;
 using VideoDuration = std::chrono::duration<VideoTimeType, timing::milli>;
 using VideoClock    = timing::Clock<VideoDuration>;
+using FramePool     = buffers::Pool<cv::Mat>;
+using FrameRef      = FramePool::Handle;
 
 class Properties;
 
 int               fourCCStr2Int(std::string &fourcc);
-video::Properties getCaptureProperties(cv::VideoCapture &reader);
+video::Properties getCaptureProperties(Source &reader);
 
 class Properties
 {
@@ -34,7 +44,7 @@ class Properties
 
     Properties(const Properties &properties) { merge(properties); };
 
-    explicit Properties(cv::VideoCapture &reader) { merge(reader); };
+    explicit Properties(Source &reader) { merge(reader); };
 
     explicit Properties(const std::string &_fourcc,
                         double             _fps          = 0,
@@ -97,7 +107,7 @@ class Properties
     };
 
     void
-    merge(cv::VideoCapture &reader, bool skip_checks = true)
+    merge(Source &reader, bool skip_checks = true)
     {
         setProps(reader, skip_checks);
     };
@@ -147,7 +157,7 @@ class Properties
     };
 
     void
-    setProps(cv::VideoCapture &reader, bool skip_checks = true)
+    setProps(Source &reader, bool skip_checks = true)
     {
         auto reader_props = getCaptureProperties(reader);
         setProps(reader_props, skip_checks);
@@ -248,7 +258,7 @@ fourCCStr2Int(std::string &fourcc)
 }
 
 void
-setCaptureProperties(cv::VideoCapture &reader, Properties &obj)
+setCaptureProperties(Source &reader, Properties &obj)
 {
     if (obj.codec != 0)
     {
@@ -269,7 +279,7 @@ setCaptureProperties(cv::VideoCapture &reader, Properties &obj)
 };
 
 Properties
-getCaptureProperties(cv::VideoCapture &reader)
+getCaptureProperties(Source &reader)
 {
     auto        codec  = reader.get(cv::CAP_PROP_FOURCC);
     auto        fps    = reader.get(cv::CAP_PROP_FPS);
@@ -302,6 +312,355 @@ getCaptureProperties(cv::VideoCapture &reader)
     return props;
 };
 
+namespace avi {
+
+/// write a value as its raw little endian bytes
+template<typename T>
+void
+put(std::ofstream &file, T value)
+{
+    file.write(reinterpret_cast<const char *>(&value), sizeof(T));
+};
+
+/// overwrite a 32 bit value at a position, then return to the end of file
+void
+patch(std::ofstream &file, std::streampos pos, uint32_t value)
+{
+    file.seekp(pos);
+    put(file, value);
+    file.seekp(0, std::ios::end);
+};
+
+/**
+ * AVI 1.0 file holding a single Motion JPEG stream. Compressed frames are
+ * stored as they are given, without decoding. Frame counts, chunk sizes, and
+ * the idx1 index are filled in by close(). The RIFF header limits a file to
+ * 4 GB, so write() refuses frames that would go past that.
+ */
+class MjpegWriter
+{
+  public:
+    MjpegWriter() = default;
+
+    /**
+     * @param filename output .avi file
+     * @param width frame width in pixels
+     * @param height frame height in pixels
+     * @param fps frame rate stored in the header, 30 if it is not positive
+     * @return false if the file could not be created
+     */
+    bool
+    open(const std::string &filename, int width, int height, double fps)
+    {
+        std::ofstream file_temp{filename, std::ios_base::binary};
+        file = std::move(file_temp);
+        if (!file.is_open()) return false;
+        if (!std::isfinite(fps) || fps <= 0) fps = 30;
+        index.clear();
+        max_frame_bytes = 0;
+        frame_rate      = fps;
+
+        auto w = static_cast<uint32_t>(width);
+        auto h = static_cast<uint32_t>(height);
+
+        file.write("RIFF", 4);
+        put<uint32_t>(file, 0);
+        file.write("AVI ", 4);
+        file.write("LIST", 4);
+        put<uint32_t>(file, 192);
+        file.write("hdrl", 4);
+
+        // main header
+        file.write("avih", 4);
+        put<uint32_t>(file, 56);
+        put<uint32_t>(file, static_cast<uint32_t>(std::round(1e6 / fps)));
+        max_bytes_pos = file.tellp();
+        put<uint32_t>(file, 0);
+        put<uint32_t>(file, 0);
+        put<uint32_t>(file, 0x10);  // AVIF_HASINDEX
+        total_frames_pos = file.tellp();
+        put<uint32_t>(file, 0);
+        put<uint32_t>(file, 0);
+        put<uint32_t>(file, 1);
+        avih_buffer_pos = file.tellp();
+        put<uint32_t>(file, 0);
+        put<uint32_t>(file, w);
+        put<uint32_t>(file, h);
+        for (int r = 0; r < 4; ++r) put<uint32_t>(file, 0);
+
+        // stream header and format
+        file.write("LIST", 4);
+        put<uint32_t>(file, 116);
+        file.write("strl", 4);
+        file.write("strh", 4);
+        put<uint32_t>(file, 56);
+        file.write("vids", 4);
+        file.write("MJPG", 4);
+        put<uint32_t>(file, 0);
+        put<uint16_t>(file, 0);
+        put<uint16_t>(file, 0);
+        put<uint32_t>(file, 0);
+        put<uint32_t>(file, 1000);
+        put<uint32_t>(file, static_cast<uint32_t>(std::round(fps * 1000)));
+        put<uint32_t>(file, 0);
+        length_pos = file.tellp();
+        put<uint32_t>(file, 0);
+        strh_buffer_pos = file.tellp();
+        put<uint32_t>(file, 0);
+        put<int32_t>(file, -1);
+        put<uint32_t>(file, 0);
+        put<uint16_t>(file, 0);
+        put<uint16_t>(file, 0);
+        put<uint16_t>(file, static_cast<uint16_t>(w));
+        put<uint16_t>(file, static_cast<uint16_t>(h));
+        file.write("strf", 4);
+        put<uint32_t>(file, 40);
+        put<uint32_t>(file, 40);
+        put<int32_t>(file, width);
+        put<int32_t>(file, height);
+        put<uint16_t>(file, 1);
+        put<uint16_t>(file, 24);
+        file.write("MJPG", 4);
+        put<uint32_t>(file, w * h * 3);
+        for (int r = 0; r < 4; ++r) put<uint32_t>(file, 0);
+
+        file.write("LIST", 4);
+        movi_size_pos = file.tellp();
+        put<uint32_t>(file, 0);
+        movi_pos = file.tellp();
+        file.write("movi", 4);
+        return file.good();
+    };
+
+    /**
+     * Append one compressed frame
+     * @param data JPEG bytes
+     * @param n_bytes size of the JPEG data
+     * @return false if the file is not open or would grow past 4 GB
+     */
+    bool
+    write(const uint8_t *data, size_t n_bytes)
+    {
+        if (!isOpen()) return false;
+        auto pos      = file.tellp();
+        auto padded   = n_bytes + (n_bytes & 1);
+        auto idx_size = (index.size() + 1) * 16 + 8;
+        if (static_cast<uint64_t>(pos) + padded + 8 + idx_size > max_bytes)
+        {
+            return false;
+        }
+        auto chunk_bytes = static_cast<uint32_t>(n_bytes);
+        file.write("00dc", 4);
+        put(file, chunk_bytes);
+        file.write(reinterpret_cast<const char *>(data), n_bytes);
+        if (padded != n_bytes) file.put(0);
+        index.emplace_back(static_cast<uint32_t>(pos - movi_pos), chunk_bytes);
+        max_frame_bytes = std::max(max_frame_bytes, chunk_bytes);
+        return true;
+    };
+
+    bool
+    isOpen() const
+    {
+        return file.is_open();
+    };
+
+    uint64_t
+    getFrameCount() const
+    {
+        return index.size();
+    };
+
+    /// write the index and final sizes
+    void
+    close()
+    {
+        if (!isOpen()) return;
+        auto movi_end = file.tellp();
+        file.write("idx1", 4);
+        put(file, static_cast<uint32_t>(index.size() * 16));
+        for (auto &entry : index)
+        {
+            file.write("00dc", 4);
+            put<uint32_t>(file, 0x10);  // AVIIF_KEYFRAME
+            put(file, entry.first);
+            put(file, entry.second);
+        }
+        auto file_end = file.tellp();
+        auto n_frames = static_cast<uint32_t>(index.size());
+
+        patch(file, 4, static_cast<uint32_t>(file_end) - 8);
+        patch(file, movi_size_pos, static_cast<uint32_t>(movi_end - movi_pos));
+        patch(file, total_frames_pos, n_frames);
+        patch(file, length_pos, n_frames);
+        patch(file, avih_buffer_pos, max_frame_bytes);
+        patch(file, strh_buffer_pos, max_frame_bytes);
+        patch(file,
+              max_bytes_pos,
+              static_cast<uint32_t>(max_frame_bytes * std::ceil(frame_rate)));
+        file.close();
+    };
+
+  private:
+    // stay clear of the 32 bit RIFF size limit
+    static constexpr uint64_t max_bytes = 0xFF000000;
+
+    std::ofstream                              file;
+    std::vector<std::pair<uint32_t, uint32_t>> index;
+    uint32_t                                   max_frame_bytes = 0;
+    double                                     frame_rate      = 0;
+    std::streampos                             max_bytes_pos;
+    std::streampos                             total_frames_pos;
+    std::streampos                             avih_buffer_pos;
+    std::streampos                             length_pos;
+    std::streampos                             strh_buffer_pos;
+    std::streampos                             movi_size_pos;
+    std::streampos                             movi_pos;
+};
+};  // namespace avi
+
+/// true if an image buffer holds an undecoded JPEG
+bool
+isJpeg(const cv::Mat &img)
+{
+    return img.rows == 1 && img.type() == CV_8UC1 && img.total() > 2 &&
+           img.data[0] == 0xFF && img.data[1] == 0xD8;
+};
+
+/// stretch of time where a device gave no frames
+struct Gap
+{
+    VideoTimeType start = -1;
+    VideoTimeType end   = -1;
+
+    bool
+    empty() const
+    {
+        return start < 0;
+    };
+};
+
+struct Frame
+{
+    FrameRef      img;
+    VideoTimeType ts      = 0;
+    uint64_t      index   = 0;
+    bool          encoded = false;  // img holds JPEG bytes, see decodeFrame
+    Gap           gap;              // frames missing just before this one
+    Frame()               = default;
+    Frame(FrameRef _img, VideoTimeType _ts, uint64_t _index, bool _encoded = false)
+      : img(std::move(_img)), ts(_ts), index(_index), encoded(_encoded){};
+};
+
+/// small BGR copy of a frame made for the display by the capture thread
+struct Preview
+{
+    cv::Mat       img;
+    FrameRef      buffer;  // pooled memory behind img, if it has any
+    VideoTimeType ts    = 0;
+    uint64_t      index = 0;
+};
+
+/**
+ * Get a displayable image from a frame, decoding it only if it is compressed
+ * @param frame frame from a device
+ * @param img filled with the BGR image, left as it was if decoding fails
+ * @return false if there is no frame or its JPEG data is corrupt
+ */
+bool
+decodeFrame(const Frame &frame, cv::Mat &img)
+{
+    if (!frame.img) return false;
+    if (!frame.encoded)
+    {
+        img = *frame.img;
+        return true;
+    }
+    cv::Mat decoded = cv::imdecode(*frame.img, cv::IMREAD_COLOR);
+    if (decoded.empty()) return false;
+    img = decoded;
+    return true;
+};
+
+/**
+ * Live metrics for one device, registered in metrics::registry() with the
+ * device's file label, e.g., usb00, so they are published while recording.
+ * Times are in microseconds.
+ */
+struct DeviceMetrics
+{
+    explicit DeviceMetrics(const std::string &device)
+      : frames(counter("cogdevcam_video_frames_total",
+                       "Frames read from the device",
+                       device)),
+        grab_failures(counter("cogdevcam_video_grab_failures_total",
+                              "Grabs that returned no frame",
+                              device)),
+        written(counter("cogdevcam_video_frames_written_total",
+                        "Frames encoded to the video file",
+                        device)),
+        duplicated(counter("cogdevcam_video_frames_duplicated_total",
+                           "Frames repeated to fill a constant rate tick",
+                           device)),
+        dropped(counter("cogdevcam_video_frames_dropped_total",
+                        "Frames not written because their tick was taken",
+                        device)),
+        queue_dropped(counter("cogdevcam_video_queue_dropped_total",
+                              "Frames dropped by a full encoder queue",
+                              device)),
+        timer_misses(counter("cogdevcam_video_timer_misses_total",
+                             "Write timer periods that passed unchecked",
+                             device)),
+        reconnects(counter("cogdevcam_video_reconnects_total",
+                           "Times the watchdog reconnected the device",
+                           device)),
+        decode_failures(counter("cogdevcam_video_decode_failures_total",
+                                "Compressed frames that could not be decoded",
+                                device)),
+        queue_depth(metrics::registry().gauge(
+          "cogdevcam_video_queue_depth",
+          "Frames waiting for the encoder",
+          {{"device", device}})),
+        grab_us(histogram(
+          "cogdevcam_video_grab_us", "Time spent in grab", device)),
+        decode_us(histogram(
+          "cogdevcam_video_decode_us", "Time spent in retrieve", device)),
+        encode_us(histogram(
+          "cogdevcam_video_encode_us", "Time spent encoding a frame", device))
+    {};
+
+    metrics::Counter &  frames;
+    metrics::Counter &  grab_failures;
+    metrics::Counter &  written;
+    metrics::Counter &  duplicated;
+    metrics::Counter &  dropped;
+    metrics::Counter &  queue_dropped;
+    metrics::Counter &  timer_misses;
+    metrics::Counter &  reconnects;
+    metrics::Counter &  decode_failures;
+    metrics::Gauge &    queue_depth;
+    metrics::Histogram &grab_us;
+    metrics::Histogram &decode_us;
+    metrics::Histogram &encode_us;
+
+  private:
+    static metrics::Counter &
+    counter(const std::string &name,
+            const std::string &help,
+            const std::string &device)
+    {
+        return metrics::registry().counter(name, help, {{"device", device}});
+    };
+
+    static metrics::Histogram &
+    histogram(const std::string &name,
+              const std::string &help,
+              const std::string &device)
+    {
+        return metrics::registry().histogram(name, help, {{"device", device}});
+    };
+};
+
 struct VideoFile
 {
     std::string full_path = "";
@@ -356,6 +715,15 @@ class Timestamps
         return timestamp_timer.elapsed();
     };
 
+    /// same time base as getTimestamp(), but safe to call from any thread
+    VideoTimeType
+    timeSinceStart() const
+    {
+        return std::chrono::duration_cast<VideoDuration>(
+                 timing::getPresent() - timestamp_timer.getStartTime())
+          .count();
+    };
+
     void
     closeTime()
     {
@@ -369,6 +737,15 @@ class Timestamps
         if (isTimeOpen()) timestamp_stream << ts << "\n";
     };
 
+    /// extra stream information, commented out so it is not read as a time
+    template<typename T>
+    void
+    writeNote(const std::string &key, const T &value)
+    {
+        if (!write_timestmaps) return;
+        if (isTimeOpen()) timestamp_stream << "# " << key << "=" << value << "\n";
+    };
+
     bool
     useTimestampWriter() const
     {
@@ -387,6 +764,12 @@ class Timestamps
         return timestamp_timer.timeout();
     }
 
+    uint64_t
+    getTimerMisses() const
+    {
+        return timestamp_timer.getTimerMisses();
+    }
+
     void
     timerSetTimeout(double ms, double thresh = 1)
     {
@@ -417,6 +800,25 @@ class Timestamps
     bool              write_timestmaps = false;
 };
 
+/**
+ * One open connection to a device, shared by the reader and the capture loop
+ * that uses it. Driver calls hold in_use. A reconnect retires the connection;
+ * a call that was stuck and comes back after that closes the device and
+ * leaves the reader alone, since a new loop may be using it by then.
+ */
+struct Connection
+{
+    explicit Connection(std::shared_ptr<Source> _source)
+      : source(std::move(_source)){};
+
+    std::shared_ptr<Source> source;
+    std::timed_mutex        in_use;
+    std::atomic_bool        retired{false};
+    // start of the driver call in progress, microseconds, -1 if none
+    std::atomic<timing::Int_t> call_start_us{-1};
+};
+using ConnectionRef = std::shared_ptr<Connection>;
+
 class Reader
 {
   protected:
@@ -424,16 +826,98 @@ class Reader
 
   public:
     explicit Reader(int _input)
-      : is_usb(true), dev_id_int(_input), dev_id(std::to_string(_input)){};
+      : dev_id(std::to_string(_input)), reader(new CameraSource(_input)){};
 
     explicit Reader(const std::string &_input)
-      : is_usb(false), dev_id_str(_input), dev_id(_input){};
+      : dev_id(_input), reader(new CameraSource(_input)){};
 
-    std::shared_ptr<cv::Mat>
+    explicit Reader(std::unique_ptr<Source> _input)
+      : dev_id(_input->name()), reader(std::move(_input)){};
+
+    FrameRef
     readImage()
     {
         readNextFrame();
-        return shared_mat;
+        return frame_ref;
+    };
+
+    /// latch the next frame on the device without decoding it
+    bool
+    grabImage()
+    {
+        return grabFrame();
+    };
+
+    /// decode the frame latched by the last call to grabImage()
+    FrameRef
+    retrieveImage()
+    {
+        retrieveFrame();
+        return frame_ref;
+    };
+
+    /**
+     * Latch the next frame on a capture loop's connection
+     * @return false if there is no frame or the connection was retired
+     */
+    bool
+    grabImage(Connection &conn)
+    {
+        bool grabbed = false;
+        if (!useConnection(conn, [&grabbed](Source &device) {
+                grabbed = device.isOpened() && device.grab();
+            }))
+        {
+            return false;
+        }
+        return grabResult(grabbed);
+    };
+
+    /**
+     * Decode the frame latched on a capture loop's connection
+     * @param img filled with the new frame
+     * @return false if there is no new frame or the connection was retired
+     */
+    bool
+    retrieveImage(Connection &conn, FrameRef &img)
+    {
+        // decode into a buffer nobody else holds a handle to
+        auto frame     = frame_pool->acquire();
+        bool retrieved = false;
+        if (!useConnection(conn, [&retrieved, &frame](Source &device) {
+                retrieved = device.isOpened() && device.retrieve(*frame);
+            }))
+        {
+            return false;
+        }
+        if (!retrieveResult(retrieved, frame)) return false;
+        img = frame_ref;
+        return true;
+    };
+
+    /// the connection capture loops use, replaced by each reconnect
+    ConnectionRef
+    getConnection() const
+    {
+        return std::atomic_load(&connection);
+    };
+
+    /// make capture loops on the current connection stop using this reader
+    void
+    cutOffCapture()
+    {
+        auto conn = getConnection();
+        if (conn) conn->retired = true;
+    };
+
+    /// how long the driver call in progress has been running, in milliseconds
+    double
+    getCallTime() const
+    {
+        auto conn = getConnection();
+        if (!conn) return 0;
+        auto start = conn->call_start_us.load();
+        return start < 0 ? 0 : (nowUs() - start) / 1000.0;
     };
 
     uint64_t
@@ -451,113 +935,374 @@ class Reader
             setReaderProperties(capture_props, false, true);
         }
 
-        bool cap_failed = true;
+        *open_cancelled  = false;
+        bool   cap_failed = true;
+        double backoff    = 0;
         for (auto j = 0; j < n_attempts; ++j)
         {
-            timing::sleep::sec(0.5);
+            // a failed attempt may have left the device open and half set up
+            if (reader->isOpened()) reader->release();
+            if (!backOff(backoff)) break;
+            backoff = std::min(max_backoff_sec, std::max(0.1, backoff * 2));
             if (!openCaptureDevice()) continue;
             if (!readNextFrame()) continue;
-            cap_failed = false;
             std::cout << "\n\nSUCCESS!\n\n";
+            if (!checkRawCapture()) continue;
             read_props.merge(read_props);
-            read_props.frame_width  = shared_mat->cols;
-            read_props.frame_height = shared_mat->rows;
+            cv::Mat first_img;
+            if (!decodeFrame(Frame(frame_ref, 0, 0, raw_capture), first_img))
+            {
+                continue;
+            }
+            read_props.frame_width  = first_img.cols;
+            read_props.frame_height = first_img.rows;
             std::cout << "Size:  W=" << read_props.frame_width
                       << ", H=" << read_props.frame_height << "\n";
+            cap_failed = false;
+            allocateFramePool();
+            std::atomic_store(&connection,
+                              std::make_shared<Connection>(source()));
             break;
         }
 
         if (cap_failed)
         {
-            throw err::Runtime("Failed too many times trying to read device!");
+            throw err::Runtime(
+              *open_cancelled ?
+                "Stopped opening device: " + dev_id :
+                "Failed " + std::to_string(n_attempts) +
+                  " times trying to read device: " + dev_id);
+        }
+    };
+
+    /// make a running openReader() or reconnect give up at its next attempt
+    void
+    cancelOpen()
+    {
+        *open_cancelled = true;
+    };
+
+    /**
+     * Retire the current connection, then open a new one for a new capture
+     * loop, see getConnection(). The old connection is closed first so the
+     * device is free; if a call on it is stuck that call closes it when it
+     * returns, and opening retries until then. Meant for a background thread.
+     * Retries with backoff until it works or cancelOpen() is called.
+     * @return false if cancelled before a connection was made
+     */
+    bool
+    reconnectSource()
+    {
+        *open_cancelled = false;
+        auto old        = getConnection();
+        if (old && !retireConnection(*old))
+        {
+            std::cerr << "Capture is stuck in the driver, leaving it behind:\n "
+                      << dev_id << "\n";
         }
+        double backoff = 0;
+        while (backOff(backoff))
+        {
+            backoff = std::min(max_backoff_sec, std::max(0.1, backoff * 2));
+            std::shared_ptr<Source> fresh(source()->clone());
+            if (!fresh->open()) continue;
+            Properties props = read_props;
+            setCaptureProperties(*fresh, props);
+            if (raw_capture) requestRaw(*fresh);
+            std::atomic_store(&reader, fresh);
+            std::atomic_store(&connection, std::make_shared<Connection>(fresh));
+            return true;
+        }
+        return false;
+    };
+
+    const std::string &
+    getDeviceName() const
+    {
+        return dev_id;
     };
 
     void
     closeReader()
     {
-        if (reader.isOpened()) reader.release();
+        auto conn = getConnection();
+        if (!conn)
+        {
+            if (reader->isOpened()) reader->release();
+        } else if (!retireConnection(*conn))
+        {
+            std::cerr << "Capture is stuck in the driver, not waiting:\n "
+                      << dev_id << "\n";
+        }
     };
 
     Properties
     getReaderProperties(bool from_capture = false)
     {
-        if (from_capture) return getCaptureProperties(reader);
+        if (from_capture) return getCaptureProperties(*reader);
         return read_props;
     };
 
+    void
+    setFramePoolSize(size_t n_frames)
+    {
+        pool_size = n_frames;
+    };
+
+    /**
+     * Ask the device for its MJPG bitstream instead of decoded images. Only
+     * used if the backend hands back the JPEG bytes, see isRawCapture()
+     * @param on true to request undecoded frames when the device is opened
+     */
+    void
+    setRawCapture(bool on)
+    {
+        want_raw = on;
+    };
+
+    /// frames read are JPEG bytes that still need decodeFrame()
+    bool
+    isRawCapture() const
+    {
+        return raw_capture;
+    };
+
+    uint64_t
+    getPoolMisses() const
+    {
+        return frame_pool->getMisses();
+    };
+
     void
     setReaderProperties(const Properties &capture_props,
                         bool              skip_checks  = true,
                         bool              also_set_cap = true)
     {
         read_props.merge(capture_props, skip_checks);
-        if (also_set_cap) setCaptureProperties(reader, read_props);
+        if (also_set_cap) setCaptureProperties(*reader, read_props);
     };
 
   private:
-    bool                     is_usb       = true;
-    int                      dev_id_int   = -1;
-    std::string              dev_id_str   = "";
-    std::string              dev_id       = "";
-    uint64_t                 frame_number = 0;
-    std::shared_ptr<cv::Mat> shared_mat;
-    Properties               read_props;
-    cv::VideoCapture         reader;
+    std::string                dev_id       = "";
+    uint64_t                   frame_number = 0;
+    size_t                     pool_size    = 16;
+    bool                       want_raw     = false;
+    bool                       raw_capture  = false;
+    FrameRef                   frame_ref;
+    std::unique_ptr<FramePool> frame_pool{new FramePool()};
+    Properties                 read_props;
+    std::shared_ptr<Source>    reader{new CameraSource(-1)};
+    ConnectionRef              connection;
+    bool                       grab_failing = false;
+    double                     max_backoff_sec = 2.0;
+    // set from other threads, behind a pointer so the reader stays movable
+    std::unique_ptr<std::atomic_bool> open_cancelled{
+      new std::atomic_bool(false)};
+
+    /// wait before the next open attempt, false if opening was cancelled
+    bool
+    backOff(double wait_sec)
+    {
+        timing::MilliClock waited;
+        while (!*open_cancelled && waited.elapsed() < wait_sec * 1000)
+        {
+            timing::sleep::thread(std::chrono::milliseconds(20));
+        }
+        return !*open_cancelled;
+    };
+
+    /// preallocate retrieve buffers at the negotiated frame size
+    void
+    allocateFramePool()
+    {
+        if (raw_capture)
+        {
+            // compressed sizes change every frame, buffers grow on first use
+            frame_pool.reset(new FramePool(pool_size));
+            return;
+        }
+        auto size = cv::Size(read_props.frame_width, read_props.frame_height);
+        auto type = frame_ref->type();
+        frame_pool.reset(new FramePool(
+          pool_size, [size, type](cv::Mat &mat) { mat.create(size, type); }));
+    };
 
     bool
     openCaptureDevice()
     {
-        shared_mat  = std::make_shared<cv::Mat>(cv::Mat());
+        frame_ref.reset();
         bool opened = false;
-        if (!reader.isOpened())
+        if (!reader->isOpened())
         {
             std::cout << "\nTrying to open device:\n " << dev_id << "\n";
-            opened = is_usb ? reader.open(dev_id_int) : reader.open(dev_id_str);
+            opened = reader->open();
         }
         if (!opened)
         {
             std::cerr << "Cam not detected with input:\n " << dev_id << "\n";
-            reader.release();
+            reader->release();
+        } else if (want_raw)
+        {
+            requestRaw(*reader);
         }
 
         return opened;
     };
 
+    void
+    requestRaw(Source &device)
+    {
+        device.set(cv::CAP_PROP_FOURCC,
+                   cv::VideoWriter::fourcc('M', 'J', 'P', 'G'));
+        device.set(cv::CAP_PROP_CONVERT_RGB, 0);
+    };
+
+    /// the current connection, which a reconnect may replace at any time
+    std::shared_ptr<Source>
+    source() const
+    {
+        return std::atomic_load(&reader);
+    };
+
+    /**
+     * Check the first frame for JPEG bytes. If raw frames were asked for but
+     * the backend gave something else, go back to decoded frames.
+     * @return false if a new frame could not be read after switching back
+     */
+    bool
+    checkRawCapture()
+    {
+        raw_capture = want_raw && isJpeg(*frame_ref);
+        if (!want_raw || raw_capture || frame_ref->channels() == 3)
+        {
+            return true;
+        }
+        std::cerr << "Device did not give MJPG frames, decoding instead:\n "
+                  << dev_id << "\n";
+        reader->set(cv::CAP_PROP_CONVERT_RGB, 1);
+        return readNextFrame();
+    };
+
     bool
     readNextFrame()
     {
-        if (reader.isOpened())
+        return grabFrame() && retrieveFrame();
+    };
+
+    bool
+    grabFrame()
+    {
+        auto device = source();
+        if (!device->isOpened()) return false;
+        return grabResult(device->grab());
+    };
+
+    bool
+    retrieveFrame()
+    {
+        auto device = source();
+        if (!device->isOpened()) return false;
+        // decode into a buffer nobody else holds a handle to
+        auto frame = frame_pool->acquire();
+        return retrieveResult(device->retrieve(*frame), frame);
+    };
+
+    bool
+    grabResult(bool grabbed)
+    {
+        if (!grabbed)
         {
-            if (!reader.grab())
+            // only report when a device starts failing, not every attempt
+            if (!grab_failing)
             {
                 std::cerr << "Frame was not grabbed successfully for device:\n "
                           << dev_id << "\n";
-                return false;
-            }
-            if (!reader.retrieve(*shared_mat))
-            {
-                std::cerr << "Frame was not decoded successfully for device:\n "
-                          << dev_id << "\n";
-                return false;
             }
-        } else
+            grab_failing = true;
+            return false;
+        }
+        grab_failing = false;
+        return true;
+    };
+
+    bool
+    retrieveResult(bool retrieved, FrameRef &frame)
+    {
+        if (!retrieved)
         {
+            std::cerr << "Frame was not decoded successfully for device:\n "
+                      << dev_id << "\n";
             return false;
         }
+        frame_ref = std::move(frame);
         ++frame_number;
         return true;
     };
+
+    static timing::Int_t
+    nowUs()
+    {
+        return std::chrono::duration_cast<timing::unit_us_int>(
+                 timing::getPresent().time_since_epoch())
+          .count();
+    };
+
+    /**
+     * Make one driver call on a connection. Nothing of the reader is used
+     * here, so a call that was stuck can come back after the reader is gone.
+     * @return false if the connection was retired, leave the reader alone
+     */
+    template<typename Call>
+    static bool
+    useConnection(Connection &conn, Call &&call)
+    {
+        std::lock_guard<std::timed_mutex> lock(conn.in_use);
+        if (conn.retired) return false;
+        conn.call_start_us = nowUs();
+        call(*conn.source);
+        conn.call_start_us = -1;
+        if (!conn.retired) return true;
+        conn.source->release();
+        return false;
+    };
+
+    /**
+     * Take a connection out of use and close it. A call on it that does not
+     * return in time is left to close it when it does.
+     * @return false if a call on the connection is stuck
+     */
+    static bool
+    retireConnection(Connection &               conn,
+                     std::chrono::milliseconds wait = std::chrono::milliseconds(
+                       500))
+    {
+        conn.retired = true;
+        std::unique_lock<std::timed_mutex> lock(conn.in_use, std::defer_lock);
+        if (!lock.try_lock_for(wait)) return false;
+        if (conn.source->isOpened()) conn.source->release();
+        return true;
+    };
 };
 
 class Writer
 {
   public:
+    using WriteQueue = buffers::BoundedQueue<Frame>;
+
     explicit Writer(VideoFile file_info)
     {
         setWriterStream(std::move(file_info));
     };
 
+    Writer(Writer &&) = default;
+    Writer &operator=(Writer &&) = default;
+
+    /// the encoder thread uses this object, it must be gone before members are
+    virtual ~Writer()
+    {
+        stopEncoder();
+    };
+
     void
     openWriter(const Properties &writer_properties = getEmptyProps())
     {
@@ -587,46 +1332,201 @@ class Writer
     void
     writeImage(const cv::Mat &img)
     {
-        if (!use_writer || !writer.isOpened()) return;
-        writer.write(img);
+        if (!use_writer) return;
+        TRACE_SCOPE("video", "encode");
+        metrics::ScopedTimer timed(
+          device_metrics ? &device_metrics->encode_us : nullptr);
+        if (encoded_input)
+        {
+            if (!writeEncoded(img)) return;
+        } else
+        {
+            if (!writer.isOpened()) return;
+            writer.write(img);
+        }
         frame_number += 1;
+        if (device_metrics) device_metrics->written.add();
     };
 
     void
     closeWriter()
     {
         if (!use_writer) return;
+        stopEncoder();
         if (writer.isOpened()) writer.release();
+        mjpeg.close();
     };
 
+    /**
+     * Frames given to the writer are JPEG bytes, which are stored as they are
+     * in an MJPG .avi file instead of being encoded again. Set before opening.
+     * @param on true if frames come straight from a raw MJPG capture
+     */
     void
-    setWriterProperties(Properties properties  = getEmptyProps(),
-                        bool       skip_checks = false)
+    setEncodedInput(bool on)
     {
-        if (properties.empty()) properties.merge();
-        write_props.merge(properties, skip_checks);
+        encoded_input = on;
     };
 
-    VideoFile
-    getVideoFileInfo()
-    {
-        return writer_file_info;
-    }
-
-    uint64_t
-    getWriterFrame() const
+    /**
+     * Replace the queue that feeds the encoder thread
+     * @param depth number of frames that can wait to be encoded
+     * @param policy what to do with new frames when the queue is full
+     */
+    void
+    setWriteQueue(size_t depth, buffers::FullPolicy policy)
     {
-        return frame_number;
-    }
+        write_queue.reset(new WriteQueue(depth, policy));
+        reported_queue_dropped = 0;
+    };
 
-    std::string
-    getWriterFilename() const
+    /// hand a frame to the encoder thread, returns false if it was dropped
+    bool
+    queueFrame(Frame frame)
     {
-        return video_out_vid_file;
-    }
+        if (!use_writer) return false;
+        bool queued = write_queue->push(std::move(frame));
+        if (device_metrics)
+        {
+            auto n_dropped_now = write_queue->getDropped();
+            device_metrics->queue_dropped.add(
+              n_dropped_now - reported_queue_dropped);
+            reported_queue_dropped = n_dropped_now;
+            device_metrics->queue_depth.set(
+              static_cast<int64_t>(write_queue->size()));
+        }
+        return queued;
+    };
 
-  protected:
-    Writer() = default;
+    /// encode queued frames on a separate thread so grab() never waits on disk
+    void
+    startEncoder()
+    {
+        if (!use_writer || encoder) return;
+        write_queue->reopen();
+        encoder.reset(new threads::Worker([this]() {
+            TRACE_THREAD(encoder_label);
+            Frame frame;
+            if (write_queue->pop(frame, std::chrono::milliseconds(50)))
+            {
+                encodeFrame(frame);
+            }
+        }));
+        encoder->setPlacement(encoder_place, encoder_label);
+        encoder->start();
+    };
+
+    /// stop the encoder thread and write whatever is still queued
+    void
+    stopEncoder()
+    {
+        if (!encoder) return;
+        write_queue->close();
+        encoder->stop();
+        encoder.reset();
+        Frame frame;
+        while (write_queue->pop(frame))
+        {
+            encodeFrame(frame);
+        }
+    };
+
+    /**
+     * Write at exactly the file frame rate. Each frame is placed on the tick
+     * nearest its timestamp; the previous frame is repeated for ticks with no
+     * frame, and frames landing on a tick that was already written are dropped.
+     * @param on false to write every frame as it comes
+     */
+    void
+    setConstantRate(bool on)
+    {
+        constant_rate = on;
+    };
+
+    /**
+     * Pin the encoder thread and set its scheduling when it starts
+     * @param place core and policy for the encoder thread
+     * @param label thread name used in the placement log
+     */
+    void
+    setEncoderPlacement(const threads::Placement &place,
+                        const std::string &       label)
+    {
+        encoder_place = place;
+        encoder_label = label;
+    };
+
+    /**
+     * Start a new constant rate timeline at the first frame stamped at or
+     * after a time, instead of filling the gap with repeated frames. Safe to
+     * call while the encoder thread is running.
+     * @param from_ts time the new timeline starts, e.g., when recording resumes
+     */
+    void
+    restartConstantRate(VideoTimeType from_ts)
+    {
+        rate_restart_ts->store(from_ts);
+    };
+
+    /// counts are only final once the encoder is stopped
+    uint64_t
+    getDuplicated() const
+    {
+        return n_duplicated;
+    };
+
+    uint64_t
+    getDropped() const
+    {
+        return n_dropped;
+    };
+
+    size_t
+    getQueueCapacity() const
+    {
+        return write_queue->capacity();
+    };
+
+    size_t
+    getQueueHighWater()
+    {
+        return write_queue->getHighWater();
+    };
+
+    uint64_t
+    getQueueDropped()
+    {
+        return write_queue->getDropped();
+    };
+
+    void
+    setWriterProperties(Properties properties  = getEmptyProps(),
+                        bool       skip_checks = false)
+    {
+        if (properties.empty()) properties.merge();
+        write_props.merge(properties, skip_checks);
+    };
+
+    VideoFile
+    getVideoFileInfo()
+    {
+        return writer_file_info;
+    }
+
+    uint64_t
+    getWriterFrame() const
+    {
+        return frame_number;
+    }
+
+    std::string
+    getWriterFilename() const
+    {
+        return video_out_vid_file;
+    }
+
+  protected:
+    Writer() = default;
 
     void
     copyWriterFileInfo(VideoFile _writer_file_info)
@@ -634,15 +1534,100 @@ class Writer
         writer_file_info = std::move(_writer_file_info);
     };
 
+    /// called on the encoder thread after each frame is encoded
+    virtual void
+    frameWritten(const Frame &frame){};
+
+    /// called on the encoder thread when a frame is encoded again for a tick
+    virtual void
+    frameDuplicated(const Frame &frame, VideoTimeType tick_ts){};
+
+    /// called on the encoder thread when a frame is not encoded
+    virtual void
+    frameDropped(const Frame &frame){};
+
+    /// called on the encoder thread when frames continue in a new file
+    virtual void
+    fileContinued(const std::string &filename){};
+
+    std::shared_ptr<DeviceMetrics> device_metrics;
+
   private:
-    std::string     video_out_vid_file = "";
-    bool            use_writer         = false;
-    Properties      write_props;
-    cv::VideoWriter writer;
-    VideoFile       writer_file_info;
-    uint64_t        frame_number = 0;
+    std::string                      video_out_vid_file = "";
+    bool                             use_writer         = false;
+    Properties                       write_props;
+    cv::VideoWriter                  writer;
+    VideoFile                        writer_file_info;
+    uint64_t                         frame_number = 0;
+    std::unique_ptr<WriteQueue>      write_queue{new WriteQueue()};
+    std::unique_ptr<threads::Worker> encoder;
+    threads::Placement               encoder_place;
+    std::string                      encoder_label = "encoder";
+    bool                             constant_rate = false;
+    Frame                            rate_last_frame;
+    int64_t                          rate_next_tick = 0;
+    uint64_t                         n_duplicated   = 0;
+    uint64_t                         n_dropped      = 0;
+    bool                             encoded_input  = false;
+    avi::MjpegWriter                 mjpeg;
+    size_t                           n_file_parts   = 1;
+    uint64_t                         reported_queue_dropped = 0;
+    uint64_t                         n_measured             = 0;
+    VideoTimeType                    first_measured_ts      = 0;
+    VideoTimeType                    last_measured_ts       = 0;
+    // set from other threads, behind a pointer so the writer stays movable
+    std::unique_ptr<std::atomic<VideoTimeType>> rate_restart_ts{
+      new std::atomic<VideoTimeType>(-1)};
 
   private:
+    void
+    encodeFrame(const Frame &frame)
+    {
+        if (n_measured++ == 0) first_measured_ts = frame.ts;
+        last_measured_ts = frame.ts;
+        if (constant_rate && write_props.fps > 0)
+        {
+            encodeAtRate(frame);
+            return;
+        }
+        writeImage(*frame.img);
+        frameWritten(frame);
+    };
+
+    void
+    encodeAtRate(const Frame &frame)
+    {
+        VideoTimeType period = 1000.0 / write_props.fps;
+        auto          tick   = static_cast<int64_t>(std::round(frame.ts / period));
+        auto          restart_ts = rate_restart_ts->load();
+        if (restart_ts >= 0 && frame.ts >= restart_ts)
+        {
+            rate_restart_ts->compare_exchange_strong(restart_ts, -1);
+            rate_last_frame = Frame();
+        }
+        if (!rate_last_frame.img)
+        {
+            rate_next_tick = tick;
+        } else if (tick < rate_next_tick)
+        {
+            ++n_dropped;
+            if (device_metrics) device_metrics->dropped.add();
+            frameDropped(frame);
+            return;
+        }
+        for (; rate_next_tick < tick; ++rate_next_tick)
+        {
+            writeImage(*rate_last_frame.img);
+            ++n_duplicated;
+            if (device_metrics) device_metrics->duplicated.add();
+            frameDuplicated(rate_last_frame, rate_next_tick * period);
+        }
+        writeImage(*frame.img);
+        frameWritten(frame);
+        rate_last_frame = frame;
+        rate_next_tick  = tick + 1;
+    };
+
     void
     setWriterStream(VideoFile file_info)
     {
@@ -656,6 +1641,11 @@ class Writer
     openWriteStream(std::string filename = "")
     {
         if (filename.empty()) filename = video_out_vid_file;
+        if (encoded_input)
+        {
+            openMjpegStream();
+            return;
+        }
         auto img_size = cv::Size(
           write_props.frame_width, write_props.frame_height);
         writer.open(
@@ -669,6 +1659,69 @@ class Writer
         }
     };
 
+    void
+    openMjpegStream()
+    {
+        // the frames are only ever muxed, so the container has to be AVI
+        video_out_vid_file = boost::filesystem::path(video_out_vid_file)
+                               .replace_extension(".avi")
+                               .string();
+        writer_file_info.full_path = video_out_vid_file;
+        if (!mjpeg.open(video_out_vid_file,
+                        write_props.frame_width,
+                        write_props.frame_height,
+                        headerRate()))
+        {
+            throw err::Runtime("Could not open file \"" + video_out_vid_file +
+                               "\" for write");
+        }
+    };
+
+    /**
+     * Rate for the MJPEG header. Devices and replays may not report one, then
+     * the rate measured from the frames encoded so far is used, if any.
+     */
+    double
+    headerRate() const
+    {
+        if (std::isfinite(write_props.fps) && write_props.fps > 0)
+        {
+            return write_props.fps;
+        }
+        if (n_measured > 1 && last_measured_ts > first_measured_ts)
+        {
+            return (n_measured - 1) * 1000.0 /
+                   (last_measured_ts - first_measured_ts);
+        }
+        return 0;
+    };
+
+    bool
+    writeEncoded(const cv::Mat &img)
+    {
+        if (!mjpeg.isOpen()) return false;
+        auto n_bytes = img.total() * img.elemSize();
+        if (mjpeg.write(img.data, n_bytes)) return true;
+
+        // file is full, keep going in the next part
+        mjpeg.close();
+        boost::filesystem::path first(video_out_vid_file);
+        auto next = (first.parent_path() /
+                     (first.stem().string() + "_part" +
+                      misc::zeroPadStr(static_cast<int>(n_file_parts++)) + ".avi"))
+                      .string();
+        if (!mjpeg.open(next,
+                        write_props.frame_width,
+                        write_props.frame_height,
+                        headerRate()))
+        {
+            std::cerr << "Could not continue video in file:\n " << next << "\n";
+            return false;
+        }
+        fileContinued(next);
+        return mjpeg.write(img.data, n_bytes);
+    };
+
     void
     camFile(VideoFile &file_info)
     {
@@ -694,17 +1747,64 @@ class IO
   , public Reader
   , public Writer
 {
-    VideoTimeType            last_ts = 0;
-    std::shared_ptr<cv::Mat> last_img;
-    bool                     io_opened = false;
+    using Ring    = buffers::FrameRing<Preview>;
+    using History = buffers::TimedRing<Frame, VideoTimeType>;
+
+    VideoTimeType              last_ts = 0;
+    VideoTimeType              grab_ts = 0;
+    FrameRef                   last_img;
+    bool                       grabbed = false;
+    std::unique_ptr<Ring>      frame_ring;
+    std::unique_ptr<History>   frame_history;
+    bool                       io_opened = false;
+    double                     open_ms   = 0;
+    threads::Placement         capture_place;
+    bool                       preview_on      = true;
+    double                     preview_scale   = 1;
+    VideoTimeType              preview_period  = 0;
+    VideoTimeType              preview_next_ts = -1;
+    cv::Mat                    preview_full;  // last good decoded frame
+    std::unique_ptr<FramePool> preview_pool{new FramePool()};
+    uint64_t                   reported_timer_misses = 0;
+
+    /// state shared with the watchdog and reconnect threads
+    struct Health
+    {
+        std::atomic<VideoTimeType> last_frame_ts{-1};
+        std::atomic<VideoTimeType> gap_start{-1};
+        std::atomic_bool           reconnecting{false};
+        std::atomic_bool           reconnected{false};
+        std::atomic<uint64_t>      n_reconnects{0};
+        std::mutex                 gap_mutex;
+        Gap                        pending_gap;
+        std::future<void>          reconnect_task;
+    };
+    std::unique_ptr<Health> health{new Health()};
 
   protected:
     IO() = default;
 
   public:
+    IO(IO &&) = default;
+    IO &operator=(IO &&) = default;
+
+    /// stop the encoder while frameWritten() still reaches this class
+    ~IO() override
+    {
+        stopEncoder();
+    };
+
     template<typename D>
-    IO(D device, const VideoFile &writer_file)
-      : Timestamps(), Reader(device), Writer(writer_file){};
+    IO(D device, const VideoFile &writer_file, size_t ring_size = 8)
+      : Timestamps(),
+        Reader(std::move(device)),
+        Writer(writer_file),
+        frame_ring(new Ring(ring_size))
+    {
+        device_metrics = std::make_shared<DeviceMetrics>(
+          writer_file.type + misc::zeroPadStr(writer_file.index));
+        resizeFramePool();
+    };
 
     void
     setProperties(const Properties &reader_properties,
@@ -726,11 +1826,24 @@ class IO
     void
     open(size_t n_attempts = 10)
     {
+        timing::MilliClock open_clock;
         openReader(getReaderProperties(), n_attempts);
+        allocatePreviewPool();
+        setEncodedInput(isRawCapture());
         auto capture_device_props = getReaderProperties(true);
         openWriter(capture_device_props);
         if (useTimestampWriter()) openTimestampStream(getTimestampFileInfo());
-        io_opened = true;
+        startEncoder();
+        health->last_frame_ts = getTimestamp();
+        io_opened             = true;
+        open_ms               = static_cast<double>(open_clock.elapsed());
+    };
+
+    /// how long the last call to open() took, in milliseconds
+    double
+    getOpenTime() const
+    {
+        return open_ms;
     };
 
     bool
@@ -742,43 +1855,284 @@ class IO
     void
     close()
     {
+        cancelOpen();
+        futures::futureValidWait(health->reconnect_task);
         closeReader();
         closeWriter();
+        writeNote("writer_queue_high_water", getQueueHighWater());
+        writeNote("writer_queue_dropped", getQueueDropped());
+        writeNote("cfr_duplicated", getDuplicated());
+        writeNote("cfr_dropped", getDropped());
+        writeNote("reconnects", getReconnects());
         closeTime();
         io_opened = false;
     };
 
+    /**
+     * Set the encoder queue and make room for its frames in the frame pool
+     * @param depth number of frames that can wait to be encoded
+     * @param policy what to do with new frames when the queue is full
+     */
+    void
+    setWriterQueue(size_t depth, buffers::FullPolicy policy)
+    {
+        setWriteQueue(depth, policy);
+        resizeFramePool();
+    };
+
+    /**
+     * Also keep recent frames searchable by their grab time, for matching
+     * frames across devices
+     * @param n_frames how many of the newest frames to keep
+     */
+    void
+    keepHistory(size_t n_frames)
+    {
+        frame_history.reset(n_frames > 0 ? new History(n_frames) : nullptr);
+        resizeFramePool();
+    };
+
+    /**
+     * Look up the kept frame grabbed closest to a time
+     * @param ts time on the timestamp clock
+     * @param frame filled with the nearest frame
+     * @return false if no history is kept or it is still empty
+     */
+    bool
+    nearestFrame(VideoTimeType ts, Frame &frame)
+    {
+        if (!frame_history) return false;
+        VideoTimeType frame_ts;
+        return frame_history->nearest(ts, frame, frame_ts);
+    };
+
+    /**
+     * Read the next frame and hand it to the frame ring without blocking.
+     * Capture loops pass the connection they were started with, see
+     * getConnection(); once it is retired the loop must leave this object
+     * alone.
+     * @return false if nothing new was read
+     */
+    bool
+    read(Connection &conn)
+    {
+        return grab(conn) && retrieve(conn);
+    };
+
+    /// latch the next frame on the device and note the time it was grabbed
+    bool
+    grab(Connection &conn)
+    {
+        TRACE_SCOPE("video", "grab");
+        bool is_grabbed;
+        {
+            metrics::ScopedTimer timed(&device_metrics->grab_us);
+            is_grabbed = grabImage(conn);
+        }
+        if (conn.retired) return false;
+        grabbed = is_grabbed;
+        grab_ts = getTimestamp();
+        if (!grabbed) device_metrics->grab_failures.add();
+        return grabbed;
+    };
+
+    /// decode the grabbed frame, stamped with its grab time, into the ring
+    bool
+    retrieve(Connection &conn)
+    {
+        if (!grabbed) return false;
+        TRACE_SCOPE("video", "retrieve");
+        grabbed = false;
+        bool is_new;
+        {
+            metrics::ScopedTimer timed(&device_metrics->decode_us);
+            is_new = retrieveImage(conn, last_img);
+        }
+        if (!is_new) return false;
+        device_metrics->frames.add();
+        last_ts = grab_ts;
+        markGap();
+        if (frame_history)
+        {
+            frame_history->push(last_ts, lastFrame());
+        }
+        makePreview();
+        return true;
+    };
+
+    VideoTimeType
+    getGrabTime() const
+    {
+        return grab_ts;
+    };
+
+    /**
+     * Record the camera's MJPG frames without decoding and encoding them
+     * again. Frames are only decoded for display, see decodeFrame()
+     * @param on true to request passthrough when the device is opened
+     */
+    void
+    setPassthrough(bool on)
+    {
+        setRawCapture(on);
+    };
+
+    /**
+     * Where this device's capture and encoder threads run
+     * @param capture placement applied by whoever runs the capture loop
+     * @param encode placement applied by the encoder thread
+     */
+    void
+    setThreadPlacement(const threads::Placement &capture,
+                       const threads::Placement &encode)
+    {
+        capture_place = capture;
+        setEncoderPlacement(encode, "encode " + getDeviceName());
+    };
+
+    /// check the write timer and count the periods it missed
+    bool
+    timerTimedOut()
+    {
+        bool timed_out = Timestamps::timerTimedOut();
+        auto misses    = getTimerMisses();
+        device_metrics->timer_misses.add(misses - reported_timer_misses);
+        reported_timer_misses = misses;
+        return timed_out;
+    };
+
+    const threads::Placement &
+    getCapturePlacement() const
+    {
+        return capture_place;
+    };
+
+    /**
+     * Have the capture loop make display copies of its frames, so the display
+     * thread only has to draw them
+     * @param scale size of the copy relative to the frame
+     * @param fps most copies to make per second, 0 for every frame
+     * @param on false when nothing is displayed
+     */
     void
-    read()
+    setPreview(double scale, double fps, bool on = true)
+    {
+        preview_on     = on;
+        preview_scale  = scale > 0 ? scale : 1;
+        preview_period = fps > 0 ? 1000.0 / fps : 0;
+    };
+
+    /// size of the display copies for the negotiated frame size
+    cv::Size
+    getPreviewSize()
+    {
+        auto props = getReaderProperties();
+        return previewSize(cv::Size(props.frame_width, props.frame_height));
+    };
+
+    /**
+     * Take the newest display copy made by the capture loop, discarding older
+     * ones
+     * @param preview filled with the newest copy
+     * @return false if no new copy was made since the last call
+     */
+    bool
+    popLatest(Preview &preview)
+    {
+        return frame_ring->popLatest(preview);
+    };
+
+    uint64_t
+    getOverwritten() const
     {
-        last_img = readImage();
-        last_ts  = getTimestamp();
+        return frame_ring->getOverwritten();
     };
 
-    cv::Mat
+    FrameRef
     readTemp()
     {
-        return readImage()->clone();
+        return readImage();
     };
 
+    /// queue the last frame read for the encoder thread
     void
     write()
     {
-        writeImage(*last_img);
-        writeTime(last_ts);
+        write(lastFrame());
     };
 
     void
-    write(cv::Mat &img, VideoTimeType &t)
+    write(Frame frame)
     {
-        writeImage(img);
-        writeTime(t);
+        takeGap(frame);
+        queueFrame(std::move(frame));
+    };
+
+    /**
+     * Reconnect in the background if no frame has arrived for too long. Other
+     * devices keep running, and the time without frames is written to the
+     * timestamp file with the next frame that is recorded. The capture loop
+     * on the old connection is cut off; start a new one once
+     * takeReconnect() says so. No other reconnect starts until then.
+     * @param max_wait longest time without a frame, in milliseconds
+     * @return true if a reconnect was started
+     */
+    bool
+    watch(VideoTimeType max_wait)
+    {
+        if (!io_opened || health->reconnecting) return false;
+        auto now  = timeSinceStart();
+        auto last = health->last_frame_ts.load();
+        if (now - last < max_wait) return false;
+        bool idle = false;
+        if (!health->reconnecting.compare_exchange_strong(idle, true))
+        {
+            return false;
+        }
+
+        std::cerr << "No frames from " << getDeviceName() << " for "
+                  << now - last << " ms, reconnecting\n";
+        cutOffCapture();
+        health->gap_start = last;
+        ++health->n_reconnects;
+        device_metrics->reconnects.add();
+        futures::futureValidWait(health->reconnect_task);
+        health->reconnect_task = threads::launch([this]() {
+            if (reconnectSource())
+            {
+                health->reconnected = true;
+            } else
+            {
+                health->reconnecting = false;
+            }
+        });
+        return true;
     };
 
-    cv::Mat
+    /**
+     * Check once for a finished reconnect
+     * @return true if a capture loop should be started on getConnection()
+     */
+    bool
+    takeReconnect()
+    {
+        if (!health->reconnected.exchange(false)) return false;
+        // give the new connection the full wait before judging it
+        health->last_frame_ts = timeSinceStart();
+        health->reconnecting  = false;
+        return true;
+    };
+
+    uint64_t
+    getReconnects() const
+    {
+        return health->n_reconnects;
+    };
+
+    FrameRef
     getLastImage()
     {
-        return *last_img;
+        return last_img;
     }
 
     VideoTimeType
@@ -786,14 +2140,271 @@ class IO
     {
         return last_ts;
     }
+
+  protected:
+    void
+    frameWritten(const Frame &frame) override
+    {
+        if (!frame.gap.empty())
+        {
+            writeNote("gap",
+                      std::to_string(frame.gap.start) + "," +
+                        std::to_string(frame.gap.end));
+        }
+        writeTime(frame.ts);
+    };
+
+    void
+    frameDuplicated(const Frame &frame, VideoTimeType tick_ts) override
+    {
+        writeNote("dup", tick_ts);
+        writeTime(frame.ts);
+    };
+
+    void
+    frameDropped(const Frame &frame) override
+    {
+        writeNote("drop", frame.ts);
+    };
+
+    void
+    fileContinued(const std::string &filename) override
+    {
+        writeNote("continued", filename);
+    };
+
+  private:
+    /// note a new frame, closing the gap if the device was being reconnected
+    void
+    markGap()
+    {
+        health->last_frame_ts = last_ts;
+        auto start            = health->gap_start.exchange(-1);
+        if (start < 0) return;
+        std::lock_guard<std::mutex> lock(health->gap_mutex);
+        health->pending_gap.start = start;
+        health->pending_gap.end   = last_ts;
+    };
+
+    /// attach a gap that has not been written yet to a frame
+    void
+    takeGap(Frame &frame)
+    {
+        std::lock_guard<std::mutex> lock(health->gap_mutex);
+        if (health->pending_gap.empty()) return;
+        frame.gap           = health->pending_gap;
+        health->pending_gap = Gap();
+    };
+
+    Frame
+    lastFrame() const
+    {
+        return Frame(last_img, last_ts, getReaderFrame(), isRawCapture());
+    };
+
+    /**
+     * Enough buffers for the frames normally in flight: the history, a few
+     * waiting for the encoder, and the ones being grabbed and shown. A queue
+     * that backs up further takes frames allocated on a pool miss instead of
+     * holding a full-size buffer per queue slot for the whole session.
+     */
+    void
+    resizeFramePool()
+    {
+        size_t n_history = frame_history ? frame_history->capacity() : 0;
+        size_t n_queued  = std::min<size_t>(getQueueCapacity(), 4);
+        setFramePoolSize(n_history + n_queued + 4);
+    };
+
+    /**
+     * Buffers for the previews in the ring, the one being made, and the one
+     * the display holds
+     */
+    void
+    allocatePreviewPool()
+    {
+        if (!preview_on) return;
+        auto size = getPreviewSize();
+        preview_pool.reset(new FramePool(
+          frame_ring->capacity() + 4,
+          [size](cv::Mat &mat) { mat.create(size, CV_8UC3); }));
+    };
+
+    cv::Size
+    previewSize(const cv::Size &frame_size) const
+    {
+        return cv::Size(
+          std::max(1, static_cast<int>(frame_size.width * preview_scale)),
+          std::max(1, static_cast<int>(frame_size.height * preview_scale)));
+    };
+
+    /// area downscale of the last frame for the display, at most once a period
+    void
+    makePreview()
+    {
+        if (!preview_on || last_ts < preview_next_ts) return;
+        TRACE_SCOPE("video", "preview");
+        preview_next_ts += preview_period;
+        if (preview_next_ts <= last_ts)
+        {
+            preview_next_ts = last_ts + preview_period;
+        }
+
+        Frame frame = lastFrame();
+        if (!frame.img) return;
+        if (!decodeFrame(frame, preview_full))
+        {
+            // corrupt JPEG, show the last good image again
+            device_metrics->decode_failures.add();
+        }
+        if (preview_full.empty()) return;
+        const cv::Mat &full = preview_full;
+        Preview        preview;
+        if (preview_scale == 1 && frame.encoded)
+        {
+            // decoded for the preview alone, nothing else writes to it
+            preview.img = full;
+        } else
+        {
+            // the frame's buffer goes back to the frame pool, fill one of
+            // ours, which is already the right size
+            preview.buffer = preview_pool->acquire();
+            if (preview_scale != 1)
+            {
+                cv::resize(full,
+                           *preview.buffer,
+                           previewSize(full.size()),
+                           0,
+                           0,
+                           cv::INTER_AREA);
+            } else
+            {
+                full.copyTo(*preview.buffer);
+            }
+            preview.img = *preview.buffer;
+        }
+        preview.ts    = last_ts;
+        preview.index = frame.index;
+        frame_ring->push(std::move(preview));
+    };
+};
+
+/**
+ * Writes one frame per device at each tick of a common frame rate so every
+ * file shares the same frame index. For each tick the frame grabbed nearest to
+ * it is taken from each device's history. A tick is decided one period late,
+ * so frames on both sides of it have had time to arrive.
+ */
+class FrameSync
+{
+  public:
+    /**
+     * @param _devices devices with a frame history, see IO::keepHistory
+     * @param fps common frame rate
+     * @param start_time time point the device timestamps are relative to
+     */
+    FrameSync(std::vector<IO> &_devices, double fps, timing::TimePoint start_time)
+      : devices(_devices),
+        period(sync_clock.getSecondsMultiplier() / fps),
+        frame_set(_devices.size())
+    {
+        sync_clock.set(start_time);
+    };
+
+    /**
+     * Handle every tick that is due
+     * @param write false to only advance the ticks, e.g., when not recording
+     * @return false if no tick was due
+     */
+    bool
+    update(bool write)
+    {
+        TRACE_SCOPE("video", "sync");
+        auto now = sync_clock.elapsed();
+        if (!started) next_tick = std::floor(now / period);
+        started = true;
+        if (now < (next_tick + 1) * period) return false;
+        while (now >= (next_tick + 1) * period)
+        {
+            matchTick(next_tick * period, write);
+            ++next_tick;
+        }
+        return true;
+    };
+
+    uint64_t
+    getSetsWritten() const
+    {
+        return n_written;
+    };
+
+    uint64_t
+    getSetsSkipped() const
+    {
+        return n_skipped;
+    };
+
+    /// mean and largest distance between a tick and the frame matched to it
+    VideoTimeType
+    getMeanOffset() const
+    {
+        return n_matched > 0 ? offset_sum / n_matched : 0;
+    };
+
+    VideoTimeType
+    getMaxOffset() const
+    {
+        return offset_max;
+    };
+
+  private:
+    std::vector<IO> &  devices;
+    VideoClock         sync_clock;
+    VideoTimeType      period;
+    VideoTimeType      next_tick  = 0;
+    bool               started    = false;
+    uint64_t           n_written  = 0;
+    uint64_t           n_skipped  = 0;
+    uint64_t           n_matched  = 0;
+    VideoTimeType      offset_sum = 0;
+    VideoTimeType      offset_max = 0;
+    std::vector<Frame> frame_set;
+
+    void
+    matchTick(VideoTimeType tick_ts, bool write)
+    {
+        for (size_t d = 0; d < devices.size(); ++d)
+        {
+            // a partial set would shift the frame index of some files
+            if (!devices[d].nearestFrame(tick_ts, frame_set[d]))
+            {
+                if (write) ++n_skipped;
+                return;
+            }
+        }
+        for (auto &frame : frame_set)
+        {
+            auto offset = std::abs(frame.ts - tick_ts);
+            offset_sum += offset;
+            offset_max = std::max(offset_max, offset);
+            ++n_matched;
+        }
+        if (!write) return;
+        for (size_t d = 0; d < devices.size(); ++d)
+        {
+            frame_set[d].index = n_written;
+            devices[d].write(std::move(frame_set[d]));
+        }
+        ++n_written;
+    };
 };
 
 namespace factory {
 video::VideoFile
-makeVideoFile(const opts::Pars &options, int index, std::string url = "")
+makeVideoFile(const opts::Pars &options, int index, std::string type = "usb")
 {
     video::VideoFile vid_file;
-    vid_file.type   = url.empty() ? "usb" : "url";
+    vid_file.type   = type;
     vid_file.index  = index;
     vid_file.folder = options.basic.root_save_folder;
     vid_file.stem   = options.basic.file_identifier;
@@ -812,6 +2423,34 @@ setVideoTimeFile(std::vector<video::IO> &videos, const timing::Clock<C> &clock)
     }
 };
 
+buffers::FullPolicy
+getFullPolicy(const std::string &policy)
+{
+    if (policy == "oldest") return buffers::FullPolicy::DROP_OLDEST;
+    if (policy == "newest") return buffers::FullPolicy::DROP_NEWEST;
+    return buffers::FullPolicy::BLOCK;
+};
+
+/**
+ * Thread placement for one device
+ * @param cores cores in device order, devices past the end are not pinned
+ * @param index device order, USB then URL then synthetic then replay
+ * @param policy scheduling policy: other, fifo, or rr
+ * @param priority priority for fifo and rr
+ */
+threads::Placement
+getPlacement(const std::vector<int> &cores,
+             size_t                  index,
+             const std::string &     policy,
+             int                     priority)
+{
+    threads::Placement place;
+    place.core     = index < cores.size() ? cores[index] : -1;
+    place.policy   = policy;
+    place.priority = priority;
+    return place;
+};
+
 void
 setVideoProperties(std::vector<video::IO> &videos, const opts::Pars &options)
 {
@@ -842,6 +2481,23 @@ setVideoProperties(std::vector<video::IO> &videos, const opts::Pars &options)
         write_props[v].merge(
           options.video.four_cc, options.video.frames_per_second, 0, 0, false);
         videos[v].setProperties(cap_props[v], write_props[v]);
+        videos[v].setWriterQueue(
+          options.video.writer_queue_depth,
+          getFullPolicy(options.video.writer_queue_policy));
+        videos[v].setConstantRate(options.video.constant_rate);
+        videos[v].setPassthrough(options.video.passthrough);
+        videos[v].setPreview(options.video.display_feed_scale,
+                             options.video.display_feed_fps,
+                             !options.basic.headless);
+        videos[v].setThreadPlacement(
+          getPlacement(options.video.capture_cores,
+                       v,
+                       options.basic.rt_policy,
+                       options.video.capture_priority),
+          getPlacement(options.video.encode_cores,
+                       v,
+                       options.basic.rt_policy,
+                       options.video.encode_priority));
     }
 };
 
@@ -864,10 +2520,24 @@ multiIO(const opts::Pars &options, const timing::Clock<C> &clock)
         std::string ip_url = options.video.ip_urls[l];
         if (!ip_url.empty())
         {
-            video::VideoFile vid_file = makeVideoFile(options, l, ip_url);
+            video::VideoFile vid_file = makeVideoFile(options, l, "url");
             video_devices.emplace_back(video::IO(ip_url, vid_file));
         }
     }
+    for (auto s = 0; s < options.video.synth_specs.size(); ++s)
+    {
+        std::unique_ptr<video::Source> synth(
+          new video::SynthSource(options.video.synth_specs[s]));
+        video::VideoFile vid_file = makeVideoFile(options, s, "synth");
+        video_devices.emplace_back(video::IO(std::move(synth), vid_file));
+    }
+    for (auto r = 0; r < options.video.replay_specs.size(); ++r)
+    {
+        std::unique_ptr<video::Source> replay(new video::ReplaySource(
+          options.video.replay_specs[r], clock.getStartTime()));
+        video::VideoFile vid_file = makeVideoFile(options, r, "replay");
+        video_devices.emplace_back(video::IO(std::move(replay), vid_file));
+    }
     setVideoProperties(video_devices, options);
     setVideoTimeFile(video_devices, clock);
 
@@ -8,10 +8,187 @@
 */
 
 #include "audio.h"
+#include <random>
+#include <vector>
+
+/**
+ * The pulse generator as it was, one frame and one channel at a time
+ */
+template<RtAudioFormat F>
+void
+pulseByFrame(audio::data::CallbackData *       data,
+             typename audio::traits::Format<F>::type *out)
+{
+    auto on  = audio::traits::Format<F>::fromUnit(data->play.pulse_amp);
+    auto off = audio::traits::Format<F>::fromUnit(-data->play.pulse_amp);
+    for (unsigned frame = 0; frame < data->buffer_len_now; ++frame)
+    {
+        if (data->ts.frameUpdate())
+        {
+            data->play.pulse_count = data->play.pulse_width;
+        }
+        auto sample = off;
+        if (data->play.pulse_count > 0)
+        {
+            sample = on;
+            data->play.pulse_count -= 1;
+        }
+        for (unsigned chan = 0; chan < data->play.n_channels; ++chan)
+        {
+            *out++ = sample;
+        }
+    }
+};
+
+/**
+ * Generate 5 s of pulses in random buffer sizes with playPulse and with the
+ * per-frame loop, the samples have to match exactly
+ * @return number of settings that did not match
+ */
+int
+checkPulseBlocks()
+{
+    using sample_t = audio::traits::Format<RTAUDIO_SINT16>::type;
+    std::mt19937                            rng(7);
+    std::uniform_int_distribution<unsigned> buffer_size(1, 2048);
+    int                                     n_bad = 0;
+    for (unsigned rate : {8000u, 44100u, 48000u, 96000u, 192000u})
+    {
+        for (double pulse_rate : {10.0, 30.0, 7.3})
+        {
+            for (unsigned width : {1u, 64u})
+            {
+                auto interval = static_cast<audio::data::AudioTimeType>(
+                  audio::data::timeRescaleVal() / pulse_rate);
+                auto tp = timing::nowTP<timing::TimePoint>();
+                audio::data::CallbackData block(tp, rate, interval, 0.95);
+                audio::data::CallbackData frame(tp, rate, interval, 0.95);
+                block.play.n_channels  = frame.play.n_channels  = 2;
+                block.play.pulse_width = frame.play.pulse_width = width;
+
+                std::vector<sample_t> block_out, frame_out;
+                bool                  same    = true;
+                size_t                n_edges = 0;
+                sample_t              last    = 0;
+                for (unsigned done = 0; same && done < rate * 5;)
+                {
+                    auto n               = buffer_size(rng);
+                    block.buffer_len_now = frame.buffer_len_now = n;
+                    block_out.assign(n * 2, 0);
+                    frame_out.assign(n * 2, 1);
+                    audio::rt::playPulse<RTAUDIO_SINT16>(&block,
+                                                         block_out.data());
+                    pulseByFrame<RTAUDIO_SINT16>(&frame, frame_out.data());
+                    same = block_out == frame_out;
+                    for (size_t i = 0; i < block_out.size(); i += 2)
+                    {
+                        if (block_out[i] > last) ++n_edges;
+                        last = block_out[i];
+                    }
+                    done += n;
+                }
+                if (!same || n_edges < pulse_rate * 4)
+                {
+                    std::cerr << "Pulses differ at " << rate << " Hz, "
+                              << pulse_rate << " pulses/s, width " << width
+                              << "\n";
+                    ++n_bad;
+                }
+            }
+        }
+    }
+    std::cout << "Pulse blocks: " << (n_bad == 0 ? "ok" : "FAILED") << "\n";
+    return n_bad;
+};
+
+/**
+ * Mix random input through spec with Matrix::apply and with a double
+ * reference, the outputs may differ by at most tol in units of full scale
+ * @param gains gain from each input to each output, by output then input
+ * @return true if they matched
+ */
+template<RtAudioFormat F>
+bool
+checkMixFormat(const std::string &                     spec,
+               const std::vector<std::vector<double>> &gains,
+               double                                  tol)
+{
+    using format = audio::traits::Format<F>;
+    auto n_out   = static_cast<unsigned>(gains.size());
+    auto n_in    = static_cast<unsigned>(gains[0].size());
+    // several reserve() blocks, mixed in pieces
+    size_t                                 n_frames = 1000;
+    std::mt19937                           rng(11);
+    std::uniform_real_distribution<double> unit(-0.6, 0.6);
+    std::vector<typename format::type>     in(n_frames * n_in);
+    std::vector<typename format::type>     out(n_frames * n_out);
+    for (auto &sample : in) sample = format::fromUnit(unit(rng));
+
+    audio::mix::Matrix matrix;
+    matrix.set(spec, n_in, n_out, F);
+    matrix.reserve(256);
+    matrix.apply<F>(in.data(), out.data(), n_frames);
+
+    double worst = 0;
+    for (size_t f = 0; f < n_frames; ++f)
+    {
+        for (unsigned o = 0; o < n_out; ++o)
+        {
+            double sum = 0;
+            for (unsigned i = 0; i < n_in; ++i)
+            {
+                sum += gains[o][i] * format::toUnit(in[f * n_in + i]);
+            }
+            auto expected = format::toUnit(format::fromUnit(sum));
+            auto mixed    = format::toUnit(out[f * n_out + o]);
+            worst         = std::max(worst, std::abs(mixed - expected));
+        }
+    }
+    if (worst > tol)
+    {
+        std::cerr << "Mix of " << format::kind << format::bits << " is off by "
+                  << worst << " of full scale, more than " << tol << "\n";
+        return false;
+    }
+    return true;
+};
+
+/**
+ * Compare the mix kernel of every format with a double reference. Formats up
+ * to 24 bits may be one step off from float rounding, wider ones must match
+ * to double precision.
+ * @return number of formats that did not match
+ */
+int
+checkMix()
+{
+    std::string                      spec  = "0*0.7+1*0.3,2+3+4,-,1*-1.5";
+    const double                     third = 1.0 / 3;
+    std::vector<std::vector<double>> gains = {{0.7, 0.3, 0, 0, 0},
+                                              {0, 0, third, third, third},
+                                              {0, 0, 0, 0, 0},
+                                              {0, -1.5, 0, 0, 0}};
+    auto step = [](double scale) { return 1.0001 / scale; };
+    int  n_bad = 0;
+    n_bad += !checkMixFormat<RTAUDIO_SINT8>(spec, gains, step(127));
+    n_bad += !checkMixFormat<RTAUDIO_SINT16>(spec, gains, step(32767));
+    n_bad += !checkMixFormat<RTAUDIO_SINT24>(spec, gains, step(8388607));
+    n_bad += !checkMixFormat<RTAUDIO_SINT32>(spec, gains, 0);
+    n_bad += !checkMixFormat<RTAUDIO_FLOAT32>(spec, gains, 1e-6);
+    n_bad += !checkMixFormat<RTAUDIO_FLOAT64>(spec, gains, 1e-14);
+    std::cout << "Mix formats: " << (n_bad == 0 ? "ok" : "FAILED") << "\n";
+    return n_bad;
+};
 
 /*!
  * Test audio portion of program.
  *   test_audio -d test -f temp -a 0 --aout 0 --aomode pulse --apulse 10 --aplaywav
+ * Without sound hardware, on the simulated device:
+ *   test_audio -d test -f temp -a 0 --aout 0 --aomode pulse --abits 16 --aapi 10
+ * Check that block pulse generation matches the per-frame loop, or that
+ * mixing matches a double reference:
+ *   test_audio pulse
+ *   test_audio mix
  * @param argc
  * @param argv
  * @return
@@ -19,6 +196,14 @@
 int
 main(int argc, const char *const *argv)
 {
+    if (argc == 2 && std::string(argv[1]) == "pulse")
+    {
+        return checkPulseBlocks() == 0 ? 0 : 1;
+    }
+    if (argc == 2 && std::string(argv[1]) == "mix")
+    {
+        return checkMix() == 0 ? 0 : 1;
+    }
     timing::Clock<timing::unit_sec_flt> clock;
     try
     {
@@ -7,6 +7,7 @@
     @version 0.9.0 12/11/2017
 */
 
+#include "sources.h"
 #include <iostream>
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
@@ -103,6 +104,64 @@ readNextFrame(VideoCapture &reader, Mat &mat)
     return true;
 };
 
+/**
+ * Generate frames from a synthetic source and read back the frame number and
+ * generation time drawn into each, as is and after a JPEG round trip.
+ * @param n_frames frames to check
+ * @return number of frames that did not read back
+ */
+int
+checkSynthSource(int n_frames = 30)
+{
+    video::SynthSource synth("640x480@30");
+    synth.open();
+    int             n_bad      = 0;
+    uint64_t        last_frame = 0;
+    Mat             img, jpeg_img;
+    vector<uint8_t> jpeg;
+    for (int i = 0; i < n_frames; ++i)
+    {
+        auto before = chrono::duration_cast<timing::unit_us_int>(
+                        timing::getPresent().time_since_epoch())
+                        .count();
+        synth.grab();
+        auto after = chrono::duration_cast<timing::unit_us_int>(
+                       timing::getPresent().time_since_epoch())
+                       .count();
+        synth.retrieve(img);
+        imencode(".jpg", img, jpeg);
+        jpeg_img = imdecode(jpeg, IMREAD_COLOR);
+
+        for (const Mat *decoded : {&img, &jpeg_img})
+        {
+            uint64_t frame = 0, generated_us = 0;
+            video::SynthSource::decode(*decoded, frame, generated_us);
+            auto gen_us = static_cast<int64_t>(generated_us);
+            bool ok     = frame > last_frame && gen_us >= before &&
+                      gen_us <= after;
+            if (!ok)
+            {
+                cerr << "Synthetic frame " << i
+                     << (decoded == &img ? "" : " (jpeg)")
+                     << " read back frame=" << frame << ", us=" << gen_us
+                     << ", expected a frame after " << last_frame
+                     << " made in [" << before << ", " << after << "]\n";
+                ++n_bad;
+            }
+            if (decoded == &jpeg_img) last_frame = frame;
+        }
+    }
+    synth.release();
+    cout << "Synthetic frames read back: " << n_frames * 2 - n_bad << "/"
+         << n_frames * 2 << endl;
+    return n_bad;
+};
+
+/*!
+ * Show a camera, or check the synthetic source without one.
+ *   test_video [CAM_ID [WAIT_MS [WRITE_FILE]]]
+ *   test_video synth
+ */
 int
 main(int argc, char *argv[])
 {
@@ -110,6 +169,11 @@ main(int argc, char *argv[])
     int    window_wait_ms = 33;
     string write_file;
 
+    if (argc == 2 && string(argv[1]) == "synth")
+    {
+        return checkSynthSource() == 0 ? 0 : 1;
+    }
+
     // handle input arguments
     if (argc == 4)
     {